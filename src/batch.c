@@ -0,0 +1,777 @@
+/* batch.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif  /* #ifdef HAVE_IO_URING */
+#include "common.h"
+#include "batch.h"
+
+#ifndef BATCH_THREADS
+#define BATCH_THREADS 4  /* [thread] */
+#endif  /* #ifndef BATCH_THREADS */
+
+typedef enum {
+    OP_RENAME,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_MKDIR,
+    OP_LINK,
+    OP_SYMLINK
+} OP;
+
+typedef struct {
+    OP op;
+    mode_t mode;
+    int error;
+    char path[2][PATH_MAX];
+} SLOT;
+
+static int slot_set(SLOT *slot, OP op, const char *path1, const char *path2, mode_t mode, int error) {
+    int status = INT_MIN;
+
+    if (strlen(path1) >= sizeof(slot->path[0])) {
+        status = error;
+        goto error;
+    }
+    strcpy(slot->path[0], path1);
+    if (path2) {
+        if (strlen(path2) >= sizeof(slot->path[1])) {
+            status = error;
+            goto error;
+        }
+        strcpy(slot->path[1], path2);
+    }
+    else
+        *slot->path[1] = 0;
+    slot->op = op;
+    slot->mode = mode;
+    slot->error = error;
+    status = 0;
+error:
+    return status;
+}
+
+static int slot_exec(SLOT *slot) {
+    int status = INT_MIN;
+    int n = -1;
+
+    switch (slot->op) {
+    case OP_RENAME:
+        n = rename(slot->path[0], slot->path[1]);
+        break;
+    case OP_UNLINK:
+        n = unlink(slot->path[0]);
+        break;
+    case OP_RMDIR:
+        n = rmdir(slot->path[0]);
+        break;
+    case OP_MKDIR:
+        n = mkdir(slot->path[0], slot->mode);
+        break;
+    case OP_LINK:
+        n = link(slot->path[0], slot->path[1]);
+        break;
+    case OP_SYMLINK:
+        n = symlink(slot->path[0], slot->path[1]);
+        break;
+    }
+    if (n == -1) {
+        status = slot->error;
+        goto error;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+/* The paths of an operation that are entries of the tree, the target of a
+ * symlink is not one. */
+static void op_paths(OP op, const char *path1, const char *path2, const char *paths[2]) {
+    paths[0] = op == OP_SYMLINK ? path2 : path1;
+    paths[1] = op == OP_SYMLINK ? NULL : path2;
+}
+
+/* Length of the directory part of path, up to the last '/'. */
+static size_t dir_length(const char *path) {
+    const char *e = strrchr(path, '/');
+
+    return e ? e - path : 0;
+}
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned int depth, count;
+    unsigned int tail;
+    struct {
+        void *ptr;
+        size_t size;
+        unsigned int *tail, *mask, *array;
+    } sq;
+    struct {
+        void *ptr;
+        size_t size;
+        unsigned int *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+    struct io_uring_sqe *sqes;
+    size_t size;
+    SLOT slot[];
+} RING;
+
+static bool ring_probe(int fd) {
+    bool supported = false;
+    static const uint8_t op[] = {
+        IORING_OP_RENAMEAT,
+        IORING_OP_UNLINKAT,
+        IORING_OP_MKDIRAT,
+        IORING_OP_LINKAT,
+        IORING_OP_SYMLINKAT
+    };
+    struct io_uring_probe *probe;
+    unsigned int n;
+
+    probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(*probe->ops));
+    if (!probe)
+        goto error;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1)
+        goto error;
+    for (n = 0; n < sizeof(op)/sizeof(*op); ++n)
+        if (op[n] > probe->last_op || !(probe->ops[op[n]].flags & IO_URING_OP_SUPPORTED))
+            goto error;
+    supported = true;
+error:
+    free(probe);
+    return supported;
+}
+
+static void ring_free(RING *ring) {
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->size);
+    if (ring->cq.ptr != MAP_FAILED && ring->cq.ptr != ring->sq.ptr)
+        munmap(ring->cq.ptr, ring->cq.size);
+    if (ring->sq.ptr != MAP_FAILED)
+        munmap(ring->sq.ptr, ring->sq.size);
+    close(ring->fd);
+    free(ring);
+}
+
+static RING *ring_new(unsigned int depth) {
+    RING *ring = NULL;
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd == -1)
+        goto error;
+    if (!ring_probe(fd)) {
+        close(fd);
+        goto error;
+    }
+    ring = malloc(offsetof(RING, slot) + sizeof(*ring->slot) * p.sq_entries);
+    if (!ring) {
+        close(fd);
+        goto error;
+    }
+    ring->fd = fd;
+    ring->depth = depth < p.sq_entries ? depth : p.sq_entries;
+    ring->count = 0;
+    ring->sq.ptr = MAP_FAILED, ring->cq.ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->sq.size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq.size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq.size > ring->sq.size)
+            ring->sq.size = ring->cq.size;
+        ring->cq.size = ring->sq.size;
+    }
+    ring->sq.ptr = mmap(NULL, ring->sq.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq.ptr == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq.ptr = ring->sq.ptr;
+    else {
+        ring->cq.ptr = mmap(NULL, ring->cq.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq.ptr == MAP_FAILED)
+            goto error;
+    }
+    ring->size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+    ring->sq.tail  = (unsigned int *)((char *)ring->sq.ptr + p.sq_off.tail);
+    ring->sq.mask  = (unsigned int *)((char *)ring->sq.ptr + p.sq_off.ring_mask);
+    ring->sq.array = (unsigned int *)((char *)ring->sq.ptr + p.sq_off.array);
+    ring->cq.head  = (unsigned int *)((char *)ring->cq.ptr + p.cq_off.head);
+    ring->cq.tail  = (unsigned int *)((char *)ring->cq.ptr + p.cq_off.tail);
+    ring->cq.mask  = (unsigned int *)((char *)ring->cq.ptr + p.cq_off.ring_mask);
+    ring->cq.cqes  = (struct io_uring_cqe *)((char *)ring->cq.ptr + p.cq_off.cqes);
+    ring->tail = *ring->sq.tail;
+    return ring;
+error:
+    if (ring)
+        ring_free(ring), ring = NULL;
+    return ring;
+}
+
+static int ring_flush(RING *ring, int status) {
+    unsigned int submit, wait;
+    unsigned int head, tail;
+    struct io_uring_cqe *cqe;
+    int n;
+
+    if (ring->count > 0) {
+        __atomic_store_n(ring->sq.tail, ring->tail, __ATOMIC_RELEASE);
+        submit = wait = ring->count;
+        while (wait > 0) {
+            n = syscall(__NR_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (!ISERR(status))
+                    status = ring->slot[(ring->tail - wait) & *ring->sq.mask].error;
+                break;
+            }
+            submit -= n;
+            head = *ring->cq.head;
+            tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+            while (head != tail) {
+                cqe = &ring->cq.cqes[head & *ring->cq.mask];
+                if (cqe->res < 0 && !ISERR(status))
+                    status = ring->slot[cqe->user_data].error;
+                ++head, --wait;
+            }
+            __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+        }
+        ring->count = 0;
+    }
+    return status;
+}
+
+/* Whether path is an entry directly in the directory dirname. */
+static bool is_entry(const char *dirname, const char *path) {
+    size_t length = dir_length(path);
+
+    return strlen(dirname) == length && !strncmp(dirname, path, length);
+}
+
+/* Whether an operation has to wait for the submitted ones: the ring runs
+ * them in any order, so one in a directory made by them, or the rmdir of
+ * a directory with entries handled by them, goes to the next submission.
+ */
+static bool ring_depends(RING *ring, OP op, const char *path1, const char *path2) {
+    const char *paths[2], *spaths[2];
+    unsigned int n, k;
+    SLOT *slot;
+
+    op_paths(op, path1, path2, paths);
+    for (n = ring->tail - ring->count; n != ring->tail; ++n) {
+        slot = &ring->slot[n & *ring->sq.mask];
+        op_paths(slot->op, slot->path[0], *slot->path[1] ? slot->path[1] : NULL, spaths);
+        for (k = 0; k < 2; ++k) {
+            if (slot->op == OP_MKDIR && paths[k] && is_entry(slot->path[0], paths[k]))
+                return true;
+            if (op == OP_RMDIR && spaths[k] && is_entry(path1, spaths[k]))
+                return true;
+        }
+    }
+    return false;
+}
+
+static int ring_add(RING *ring, OP op, const char *path1, const char *path2, mode_t mode, int error) {
+    int status = INT_MIN;
+    unsigned int index;
+    SLOT *slot;
+    struct io_uring_sqe *sqe;
+
+    if (ring->count >= ring->depth || ring_depends(ring, op, path1, path2))
+        if (ISERR(status = ring_flush(ring, 0)))
+            goto error;
+    index = ring->tail & *ring->sq.mask;
+    slot = &ring->slot[index];
+    if (ISERR(status = slot_set(slot, op, path1, path2, mode, error)))
+        goto error;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->path[0];
+    switch (op) {
+    case OP_RENAME:
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uintptr_t)slot->path[1];
+        break;
+    case OP_UNLINK:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        break;
+    case OP_RMDIR:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->unlink_flags = AT_REMOVEDIR;
+        break;
+    case OP_MKDIR:
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->len = mode;
+        break;
+    case OP_LINK:
+        sqe->opcode = IORING_OP_LINKAT;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uintptr_t)slot->path[1];
+        break;
+    case OP_SYMLINK:
+        sqe->opcode = IORING_OP_SYMLINKAT;
+        sqe->addr2 = (uintptr_t)slot->path[1];
+        break;
+    }
+    sqe->user_data = index;
+    ring->sq.array[index] = index;
+    ++ring->tail, ++ring->count;
+    status = 0;
+error:
+    return status;
+}
+#endif  /* #ifdef HAVE_IO_URING */
+
+/* Operations are spread over the workers in turn, entries of one directory
+ * included.  A worker holds an operation back only while the directory it
+ * depends on is pending: the mkdir of the directory of its paths, or for
+ * an rmdir, the entries in the directory that were queued before it.
+ */
+#define DEP_BUCKETS 64
+
+typedef struct DEP {
+    struct DEP *next;
+    unsigned int bucket;
+    unsigned int made, removed;  /* pending mkdir and rmdir of the directory */
+    unsigned int inside;  /* pending operations on entries in it */
+    char name[];
+} DEP;
+
+typedef struct {
+    SLOT slot;
+    DEP *parent[2];  /* directories of the paths */
+    DEP *dep;  /* the directory made or removed */
+} TASK;
+
+typedef struct {
+    pthread_t tid;
+    unsigned int head, count;
+    TASK *task;
+} WORKER;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int depth;
+    unsigned int pending;
+    unsigned int next;  /* worker of the next operation */
+    bool quit;
+    int status;
+    DEP *dep[DEP_BUCKETS];
+    unsigned int threads;
+    WORKER worker[];
+} POOL;
+
+typedef struct {
+    POOL *pool;
+    WORKER *worker;
+} POOL_PARAM;
+
+static unsigned int dep_hash(const char *name, size_t length) {
+    unsigned int hash = 2166136261U;
+
+    while (length-- > 0)
+        hash = (hash ^ (unsigned char)*name++) * 16777619U;
+    return hash % DEP_BUCKETS;
+}
+
+static DEP *dep_find(POOL *pool, const char *name, size_t length) {
+    DEP *dep;
+
+    for (dep = pool->dep[dep_hash(name, length)]; dep; dep = dep->next)
+        if (!strncmp(dep->name, name, length) && !dep->name[length])
+            break;
+    return dep;
+}
+
+static DEP *dep_get(POOL *pool, const char *name, size_t length) {
+    DEP *dep;
+
+    dep = dep_find(pool, name, length);
+    if (dep)
+        goto error;
+    dep = malloc(offsetof(DEP, name) + length + 1);
+    if (!dep)
+        goto error;
+    dep->bucket = dep_hash(name, length);
+    dep->made = 0, dep->removed = 0, dep->inside = 0;
+    memcpy(dep->name, name, length), dep->name[length] = 0;
+    dep->next = pool->dep[dep->bucket], pool->dep[dep->bucket] = dep;
+error:
+    return dep;
+}
+
+static void dep_put(POOL *pool, DEP *dep) {
+    DEP **p;
+
+    if (dep->made > 0 || dep->removed > 0 || dep->inside > 0)
+        return;
+    for (p = &pool->dep[dep->bucket]; *p != dep; p = &(*p)->next);
+    *p = dep->next;
+    free(dep);
+}
+
+static void task_detach(POOL *pool, TASK *task) {
+    unsigned int k;
+
+    for (k = 0; k < 2; ++k)
+        if (task->parent[k]) {
+            --task->parent[k]->inside;
+            dep_put(pool, task->parent[k]), task->parent[k] = NULL;
+        }
+    if (task->dep) {
+        if (task->slot.op == OP_MKDIR)
+            --task->dep->made;
+        else
+            --task->dep->removed;
+        dep_put(pool, task->dep), task->dep = NULL;
+    }
+}
+
+static bool task_attach(POOL *pool, TASK *task) {
+    const char *paths[2];
+    unsigned int k;
+
+    task->parent[0] = task->parent[1] = task->dep = NULL;
+    op_paths(task->slot.op, task->slot.path[0], *task->slot.path[1] ? task->slot.path[1] : NULL, paths);
+    for (k = 0; k < 2; ++k)
+        if (paths[k]) {
+            task->parent[k] = dep_get(pool, paths[k], dir_length(paths[k]));
+            if (!task->parent[k])
+                goto error;
+            ++task->parent[k]->inside;
+        }
+    if (task->slot.op == OP_MKDIR || task->slot.op == OP_RMDIR) {
+        task->dep = dep_get(pool, task->slot.path[0], strlen(task->slot.path[0]));
+        if (!task->dep)
+            goto error;
+        if (task->slot.op == OP_MKDIR)
+            ++task->dep->made;
+        else
+            ++task->dep->removed;
+    }
+    return true;
+error:
+    task_detach(pool, task);
+    return false;
+}
+
+/* Waits for operations queued before the task. */
+static bool task_blocked(TASK *task) {
+    unsigned int k;
+
+    for (k = 0; k < 2; ++k)
+        if (task->parent[k] && task->parent[k]->made > 0)
+            return true;
+    return task->slot.op == OP_RMDIR && task->dep->inside > 0;
+}
+
+/* Whether a new operation would make one queued before it wait for it:
+ * an entry in a directory being removed, or the mkdir of a directory
+ * with pending entries.  It is then queued only once they are done.
+ */
+static bool pool_blocked(POOL *pool, OP op, const char *path1, const char *path2) {
+    const char *paths[2];
+    DEP *dep;
+    unsigned int k;
+
+    op_paths(op, path1, path2, paths);
+    for (k = 0; k < 2; ++k)
+        if (paths[k]) {
+            dep = dep_find(pool, paths[k], dir_length(paths[k]));
+            if (dep && dep->removed > 0)
+                return true;
+        }
+    if (op == OP_MKDIR) {
+        dep = dep_find(pool, path1, strlen(path1));
+        if (dep && dep->inside > 0)
+            return true;
+    }
+    return false;
+}
+
+static void *pool_thread(void *data) {
+    POOL *pool = ((POOL_PARAM *)data)->pool;
+    WORKER *worker = ((POOL_PARAM *)data)->worker;
+    TASK *task;
+    int status;
+
+    free(data);
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->quit || worker->count > 0) {
+        task = &worker->task[worker->head];
+        if (worker->count == 0 ||
+            (!ISERR(pool->status) && task_blocked(task)) ) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        status = 0;
+        if (!ISERR(pool->status)) {  /* after an error the rest is dropped */
+            pthread_mutex_unlock(&pool->mutex);
+            status = slot_exec(&task->slot);
+            pthread_mutex_lock(&pool->mutex);
+        }
+        if (ISERR(status) && !ISERR(pool->status))
+            pool->status = status;
+        task_detach(pool, task);
+        worker->head = (worker->head + 1) % pool->depth;
+        --worker->count, --pool->pending;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void pool_free(POOL *pool) {
+    unsigned int n;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (n = 0; n < pool->threads; ++n)
+        pthread_join(pool->worker[n].tid, NULL);
+    for (n = 0; n < pool->threads; ++n)
+        free(pool->worker[n].task);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+static POOL *pool_new(unsigned int depth, unsigned int threads) {
+    POOL *pool = NULL;
+    POOL_PARAM *param;
+    unsigned int n;
+
+    pool = malloc(offsetof(POOL, worker) + sizeof(*pool->worker) * threads);
+    if (!pool)
+        goto error;
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool), pool = NULL;
+        goto error;
+    }
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool), pool = NULL;
+        goto error;
+    }
+    pool->depth = (depth + threads - 1) / threads;
+    pool->pending = 0;
+    pool->next = 0;
+    pool->quit = false;
+    pool->status = 0;
+    for (n = 0; n < DEP_BUCKETS; ++n)
+        pool->dep[n] = NULL;
+    pool->threads = 0;
+    for (n = 0; n < threads; ++n) {
+        pool->worker[n].head = 0, pool->worker[n].count = 0;
+        pool->worker[n].task = malloc(sizeof(*pool->worker[n].task) * pool->depth);
+        if (!pool->worker[n].task)
+            break;
+        param = malloc(sizeof(*param));
+        if (!param) {
+            free(pool->worker[n].task);
+            break;
+        }
+        param->pool = pool, param->worker = &pool->worker[n];
+        if (pthread_create(&pool->worker[n].tid, NULL, pool_thread, param) != 0) {
+            free(param);
+            free(pool->worker[n].task);
+            break;
+        }
+        ++pool->threads;
+    }
+    if (pool->threads < threads) {
+        pool_free(pool), pool = NULL;
+        goto error;
+    }
+error:
+    return pool;
+}
+
+static int pool_flush(POOL *pool) {
+    int status = INT_MIN;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    status = pool->status;
+    pthread_mutex_unlock(&pool->mutex);
+    return status;
+}
+
+static int pool_add(POOL *pool, OP op, const char *path1, const char *path2, mode_t mode, int error) {
+    int status = INT_MIN;
+    WORKER *worker;
+    TASK *task;
+
+    pthread_mutex_lock(&pool->mutex);
+    worker = &pool->worker[pool->next++ % pool->threads];
+    while ((worker->count >= pool->depth || pool_blocked(pool, op, path1, path2)) &&
+           !ISERR(pool->status) )
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (ISERR(status = pool->status))
+        goto error;
+    task = &worker->task[(worker->head + worker->count) % pool->depth];
+    status = slot_set(&task->slot, op, path1, path2, mode, error);
+    if (ISERR(status))
+        goto error;
+    if (!task_attach(pool, task)) {
+        status = error;
+        goto error;
+    }
+    ++worker->count, ++pool->pending;
+    pthread_cond_broadcast(&pool->cond);
+    status = 0;
+error:
+    pthread_mutex_unlock(&pool->mutex);
+    return status;
+}
+
+static int batch_add(BATCH *batch, OP op, const char *path1, const char *path2, mode_t mode, int error) {
+    SLOT slot;
+
+    if (ISERR(batch->status))
+        goto error;
+#ifdef HAVE_IO_URING
+    if (batch->ring) {
+        batch->status = ring_add(batch->ring, op, path1, path2, mode, error);
+        goto error;
+    }
+#endif  /* #ifdef HAVE_IO_URING */
+    if (batch->pool) {
+        batch->status = pool_add(batch->pool, op, path1, path2, mode, error);
+        goto error;
+    }
+    batch->status = slot_set(&slot, op, path1, path2, mode, error);
+    if (ISERR(batch->status))
+        goto error;
+    batch->status = slot_exec(&slot);
+error:
+    return batch->status;
+}
+
+int batch_init(BATCH *batch, unsigned int depth) {
+    batch->ring = NULL;
+    batch->pool = NULL;
+    if (depth > 1) {
+#ifdef HAVE_IO_URING
+        batch->ring = ring_new(depth);
+        if (!batch->ring)
+#endif  /* #ifdef HAVE_IO_URING */
+        if (BATCH_THREADS > 1)
+            batch->pool = pool_new(depth, BATCH_THREADS);
+    }
+    batch->status = 0;
+    return batch->status;
+}
+
+int batch_rename(BATCH *batch, const char *oldpath, const char *newpath, int error) {
+    return batch_add(batch, OP_RENAME, oldpath, newpath, 0, error);
+}
+
+int batch_unlink(BATCH *batch, const char *pathname, int error) {
+    return batch_add(batch, OP_UNLINK, pathname, NULL, 0, error);
+}
+
+/* Entries in the directory queued before it are removed first, see
+ * pool_add() and ring_add().
+ */
+int batch_rmdir(BATCH *batch, const char *pathname, int error) {
+    return batch_add(batch, OP_RMDIR, pathname, NULL, 0, error);
+}
+
+/* The directory is made before entries in it queued after it, see
+ * pool_add() and ring_add().
+ */
+int batch_mkdir(BATCH *batch, const char *pathname, mode_t mode, int error) {
+    return batch_add(batch, OP_MKDIR, pathname, NULL, mode, error);
+}
+
+int batch_link(BATCH *batch, const char *oldpath, const char *newpath, int error) {
+    return batch_add(batch, OP_LINK, oldpath, newpath, 0, error);
+}
+
+int batch_symlink(BATCH *batch, const char *target, const char *linkpath, int error) {
+    return batch_add(batch, OP_SYMLINK, target, linkpath, 0, error);
+}
+
+int batch_flush(BATCH *batch) {
+    int status;
+
+#ifdef HAVE_IO_URING
+    if (batch->ring) {
+        status = ring_flush(batch->ring, batch->status);
+        if (!ISERR(batch->status))
+            batch->status = status;
+    }
+#endif  /* #ifdef HAVE_IO_URING */
+    if (batch->pool) {
+        status = pool_flush(batch->pool);
+        if (!ISERR(batch->status))
+            batch->status = status;
+    }
+    return batch->status;
+}
+
+int batch_term(BATCH *batch) {
+    batch_flush(batch);
+#ifdef HAVE_IO_URING
+    if (batch->ring)
+        ring_free(batch->ring), batch->ring = NULL;
+#endif  /* #ifdef HAVE_IO_URING */
+    if (batch->pool)
+        pool_free(batch->pool), batch->pool = NULL;
+    return batch->status;
+}
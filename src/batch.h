@@ -0,0 +1,51 @@
+/* batch.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_batch_h
+#define _INCLUDE_batch_h
+
+#include <sys/types.h>
+
+#ifndef BATCH_DEPTH
+#define BATCH_DEPTH 64  /* [operation] */
+#endif  /* #ifndef BATCH_DEPTH */
+
+typedef struct {
+    void *ring;
+    void *pool;
+    int status;
+} BATCH;
+
+extern int batch_init(BATCH *batch, unsigned int depth);
+extern int batch_rename(BATCH *batch, const char *oldpath, const char *newpath, int error);
+extern int batch_unlink(BATCH *batch, const char *pathname, int error);
+extern int batch_rmdir(BATCH *batch, const char *pathname, int error);
+extern int batch_mkdir(BATCH *batch, const char *pathname, mode_t mode, int error);
+extern int batch_link(BATCH *batch, const char *oldpath, const char *newpath, int error);
+extern int batch_symlink(BATCH *batch, const char *target, const char *linkpath, int error);
+extern int batch_flush(BATCH *batch);
+extern int batch_term(BATCH *batch);
+
+#endif  /* #ifndef _INCLUDE_batch_h */
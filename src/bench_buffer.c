@@ -0,0 +1,215 @@
+/* bench_buffer.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Transfer buffer benchmark: copies a file through a pipe the way upload()
+ * and download() move file contents, once per buffer size, and reports the
+ * throughput.  Buffers are mapped like psync.c does, with huge pages asked
+ * for from HUGEPAGE_SIZE up.
+ *
+ * usage: bench_buffer [-s MiB] [DIRECTORY]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define HUGEPAGE_SIZE (2*1024*1024)  /* [byte] */
+
+static const size_t sizes[] = {
+    16*1024, 64*1024, 256*1024, 1024*1024, 4*1024*1024, 16*1024*1024
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *map(size_t size) {
+    char *p;
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGEPAGE_SIZE)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif  /* #ifdef MADV_HUGEPAGE */
+    return p;
+}
+
+/* read until count bytes or the end, like read_size() */
+static ssize_t fill(int fd, char *buffer, size_t count) {
+    size_t size = 0;
+    ssize_t n;
+
+    while (size < count) {
+        n = read(fd, buffer + size, count - size);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        size += n;
+    }
+    return size;
+}
+
+static int copy(int fdin, int fdout, char *buffer, size_t size) {
+    ssize_t n;
+
+    while ((n = fill(fdin, buffer, size)) > 0)
+        if (write(fdout, buffer, n) != n)
+            return -1;
+    return n;
+}
+
+static int run(const char *srcname, const char *dstname, off_t total, size_t size) {
+    int status = INT_MIN;
+    int fds[2] = {-1, -1};
+    int fdsrc = -1, fddst = -1;
+    char *buffer = NULL;
+    pid_t pid = -1;
+    double t;
+
+    buffer = map(size);
+    if (!buffer)
+        goto error;
+    if (pipe(fds) == -1)
+        goto error;
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, 1024*1024);
+#endif  /* #ifdef F_SETPIPE_SZ */
+    fdsrc = open(srcname, O_RDONLY);
+    fddst = open(dstname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fdsrc == -1 || fddst == -1)
+        goto error;
+    t = now();
+    pid = fork();
+    switch (pid) {
+    case -1:
+        goto error;
+    case 0:  /* sender */
+        close(fds[0]);
+        _exit(copy(fdsrc, fds[1], buffer, size) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    close(fds[1]), fds[1] = -1;
+    if (copy(fds[0], fddst, buffer, size) == -1)
+        goto error;
+    waitpid(pid, &status, 0), pid = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        goto error;
+    t = now() - t;
+    printf("buffer=%zu size=%lld seconds=%.3f mbps=%.1f\n",
+           size, (long long)total, t, total / 1048576.0 / t );
+    status = 0;
+error:
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    if (fddst != -1)
+        close(fddst);
+    if (fdsrc != -1)
+        close(fdsrc);
+    if (fds[1] != -1)
+        close(fds[1]);
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (buffer)
+        munmap(buffer, size);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    off_t total = 256;
+    const char *dirname = ".";
+    char srcname[PATH_MAX], dstname[PATH_MAX];
+    char *buffer = NULL;
+    int fd = -1;
+    off_t offset;
+    size_t n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+        switch (opt) {
+        case 's':
+            total = atoll(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    if (optind < argc)
+        dirname = argv[optind++];
+    if (optind < argc || total < 1)
+        goto usage;
+    total *= 1024*1024;
+    snprintf(srcname, sizeof(srcname), "%s/bench_buffer.src", dirname);
+    snprintf(dstname, sizeof(dstname), "%s/bench_buffer.dst", dirname);
+    buffer = malloc(1024*1024);
+    if (!buffer)
+        goto error;
+    for (n = 0; n < 1024*1024; ++n)
+        buffer[n] = rand();
+    fd = open(srcname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        perror(srcname);
+        goto error;
+    }
+    for (offset = 0; offset < total; offset += 1024*1024)
+        if (write(fd, buffer, 1024*1024) != 1024*1024) {
+            perror(srcname);
+            goto error;
+        }
+    close(fd), fd = -1;
+    for (n = 0; n < sizeof(sizes)/sizeof(*sizes); ++n)
+        if (run(srcname, dstname, total, sizes[n]) < 0) {
+            fprintf(stderr, "buffer=%zu: failed\n", sizes[n]);
+            goto error;
+        }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    unlink(dstname);
+    unlink(srcname);
+    free(buffer);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+usage:
+    fprintf(stderr, "usage: %s [-s MiB] [DIRECTORY]\n", argv[0]);
+    return EXIT_FAILURE;
+}
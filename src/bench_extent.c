@@ -0,0 +1,221 @@
+/* bench_extent.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Write benchmark for downloaded files: writes the same data the way
+ * download() used to (16 KiB writes to a plain file) and the way it does
+ * now (preallocated, 1 MiB writes, optionally O_DIRECT), then reports the
+ * number of extents of each file and the read-back throughput with a cold
+ * page cache.  Several files are written in turn to mimic other writers
+ * competing for free space.
+ *
+ * usage: bench_extent [-n FILES] [-s MiB] [DIRECTORY]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif  /* #ifdef HAVE_LINUX_FS_H */
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif  /* #ifndef O_DIRECT */
+#define ALIGN 4096  /* [byte] */
+#define BUFFER_MAX (1024*1024)  /* [byte] */
+
+typedef struct {
+    const char *name;
+    size_t buffer;  /* [byte] size of each write */
+    bool prealloc;
+    bool direct;
+} METHOD;
+
+static const METHOD methods[] = {
+    {"plain",      16*1024, false, false},
+    {"prealloc", 1024*1024, true,  false},
+    {"direct",   1024*1024, true,  true }
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long extents(int fd) {
+#if defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FIEMAP)
+    struct fiemap fm;
+
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1)
+        return -1;
+    return fm.fm_mapped_extents;
+#else  /* #if defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FIEMAP) */
+    return -1;
+#endif  /* #if defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FIEMAP) */
+}
+
+static int run(const METHOD *method, const char *dirname, int files, off_t size, char *buffer) {
+    int status = INT_MIN;
+    char pathname[PATH_MAX];
+    int fd[files];
+    bool direct[files];
+    off_t offset;
+    size_t length;
+    ssize_t n;
+    long count;
+    double t, twrite, tread;
+    int i;
+
+    for (i = 0; i < files; ++i)
+        fd[i] = -1;
+    for (i = 0; i < files; ++i) {
+        snprintf(pathname, sizeof(pathname), "%s/bench_extent.%d", dirname, i);
+        direct[i] = false;
+        if (method->direct) {
+            fd[i] = open(pathname, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, S_IRUSR|S_IWUSR);
+            direct[i] = fd[i] != -1;
+        }
+        if (fd[i] == -1)
+            fd[i] = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+        if (fd[i] == -1) {
+            perror(pathname);
+            goto error;
+        }
+#ifdef HAVE_FALLOCATE
+        if (method->prealloc)
+            fallocate(fd[i], FALLOC_FL_KEEP_SIZE, 0, size);
+#endif  /* #ifdef HAVE_FALLOCATE */
+    }
+    t = now();
+    for (offset = 0; offset < size; offset += length) {  /* one write to each file in turn */
+        length = size - offset < (off_t)method->buffer ? (size_t)(size - offset) : method->buffer;
+        for (i = 0; i < files; ++i) {
+            if (direct[i] && length % ALIGN) {
+                fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) & ~O_DIRECT);
+                direct[i] = false;
+            }
+            if (write(fd[i], buffer, length) != (ssize_t)length) {
+                perror("write");
+                goto error;
+            }
+        }
+    }
+    for (i = 0; i < files; ++i)
+        fsync(fd[i]);
+    twrite = now() - t;
+    count = 0;
+    for (i = 0; i < files; ++i) {
+        count += extents(fd[i]);
+        close(fd[i]), fd[i] = -1;
+    }
+    tread = 0;
+    for (i = 0; i < files; ++i) {
+        snprintf(pathname, sizeof(pathname), "%s/bench_extent.%d", dirname, i);
+        fd[i] = open(pathname, O_RDONLY);
+        if (fd[i] == -1) {
+            perror(pathname);
+            goto error;
+        }
+        posix_fadvise(fd[i], 0, 0, POSIX_FADV_DONTNEED);
+        t = now();
+        while ((n = read(fd[i], buffer, BUFFER_MAX)) > 0);
+        tread += now() - t;
+        close(fd[i]), fd[i] = -1;
+    }
+    printf("method=%s files=%d size=%lld extents=%ld write_mbps=%.1f read_mbps=%.1f\n",
+           method->name, files, (long long)size, count,
+           files * (size / 1048576.0) / twrite, files * (size / 1048576.0) / tread );
+    status = 0;
+error:
+    for (i = 0; i < files; ++i) {
+        if (fd[i] != -1)
+            close(fd[i]);
+        snprintf(pathname, sizeof(pathname), "%s/bench_extent.%d", dirname, i);
+        unlink(pathname);
+    }
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    int files = 4;
+    off_t size = 64;
+    const char *dirname = ".";
+    void *buffer = NULL;
+    size_t n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+        switch (opt) {
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 's':
+            size = atoll(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    if (optind < argc)
+        dirname = argv[optind++];
+    if (optind < argc || files < 1 || size < 1)
+        goto usage;
+    size *= 1024*1024;
+    if (posix_memalign(&buffer, ALIGN, BUFFER_MAX)) {
+        buffer = NULL;
+        goto error;
+    }
+    for (n = 0; n < BUFFER_MAX; ++n)
+        ((char *)buffer)[n] = rand();
+    for (n = 0; n < sizeof(methods)/sizeof(*methods); ++n)
+        if (run(&methods[n], dirname, files, size, buffer) < 0)
+            goto error;
+    status = 0;
+error:
+    free(buffer);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+usage:
+    fprintf(stderr, "usage: %s [-n FILES] [-s MiB] [DIRECTORY]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,234 @@
+/* bench_sets.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Merge benchmark for sorted file lists: builds two synthetic lists of a
+ * directory tree that differ in about 3% of the entries, and merges them
+ * with sets_next() (strcmp() on whole names), with sets_next_lcp()
+ * (comparisons from the stored shared prefix lengths) and with
+ * sets_next_auto() (the one of the two that run() takes for these lists,
+ * from the mean lcp of the first LCP_SAMPLE entries).  Reports the time
+ * per entry, the best of ROUNDS.
+ *
+ * usage: bench_sets [-n ENTRIES] [-d DEPTH]
+ *
+ * The lists take about 600 MiB per million entries at the default depth.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+#define DEPTH_MAX 32
+#define FANOUT 16  /* entries in each directory */
+#define ROUNDS 5
+
+typedef struct s_elist {
+    struct s_elist *next, *prev;
+    uint8_t st[72];  /* the rest of FLIST */
+    size_t length;
+    size_t lcp;
+    char name[1];
+} ELIST;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ELIST *add_ELIST(ELIST *elist, const char *name, size_t length) {
+    ELIST *enew = NULL;
+
+    enew = malloc(offsetof(ELIST, name) + length + 1);
+    if (!enew)
+        goto error;
+    memcpy(enew->name, name, length + 1);
+    enew->length = length;
+    LIST_INSERT_NEXT(enew, elist);
+    enew->lcp = 0;  /* as read_FLIST() does */
+    strcmp_lcp(elist->name, elist->length, enew->name, enew->length, &enew->lcp);
+error:
+    return enew;
+}
+
+static void free_ELIST(ELIST *elist) {
+    ELIST *e;
+
+    while (*(e = elist->next)->name) {
+        LIST_DELETE(e);
+        free(e);
+    }
+}
+
+static sets_next(ELIST)
+
+static sets_next_lcp(ELIST)
+
+static sets_next_auto(ELIST)
+
+static double mean_lcp(ELIST *elist) {
+    ELIST *e;
+    size_t sum = 0, count = 0;
+
+    for (e = elist->next; *e->name && count < LCP_SAMPLE; e = e->next)
+        if (e->lcp != LCP_NONE)
+            sum += e->lcp, ++count;
+    return count > 0 ? (double)sum / count : 0;
+}
+
+static int count_func(SETS sets, ELIST *p1, ELIST *p2, void *data) {
+    size_t *count = data;
+
+    ++count[sets];
+    return 0;
+}
+
+/* Entries of a tree DEPTH directories deep with FANOUT entries in each, in
+ * sorted order: list1 misses every 100th+1 entry, list2 misses every 100th+2
+ * and has one more after every 100th+3.
+ */
+static int make_lists(ELIST *list1, ELIST *list2, size_t entries, int depth) {
+    int status = INT_MIN;
+    char name[PATH_MAX];
+    size_t offset[DEPTH_MAX+1];
+    unsigned int digit[DEPTH_MAX];
+    size_t count, length;
+    int level;
+
+    for (level = 0; level < depth; ++level)
+        digit[level] = 0;
+    offset[0] = 0;
+    level = 0;
+    for (count = 0; count < entries; ++count) {
+        if (level < depth - 1)
+            length = snprintf(name + offset[level], sizeof(name) - offset[level] - 2,
+                              "directory-level-%02d-%04u", level, digit[level] );
+        else
+            length = snprintf(name + offset[level], sizeof(name) - offset[level] - 2,
+                              "file-%08u.txt", digit[level] );
+        length += offset[level];
+        if (count % 100 != 1 && !(list1 = add_ELIST(list1, name, length)))
+            goto error;
+        if (count % 100 != 2 && !(list2 = add_ELIST(list2, name, length)))
+            goto error;
+        if (count % 100 == 3) {
+            memcpy(name + length, "-", 2);
+            if (!(list2 = add_ELIST(list2, name, length + 1)))
+                goto error;
+        }
+        if (level < depth - 1) {  /* into the directory */
+            name[length] = '/';
+            offset[++level] = length + 1;
+            continue;
+        }
+        while (level > 0 && ++digit[level] == FANOUT)
+            digit[level--] = 0;
+        if (level == 0)
+            ++digit[0];
+    }
+    status = 0;
+error:
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    size_t entries = 1000000;
+    int depth = 8;
+    ELIST list1, list2;
+    size_t count[3], countlcp[3], countauto[3];
+    double t, tstrcmp, tlcp, tauto;
+    int round;
+    int opt;
+
+    list1.length = list2.length = 0;
+    LIST_NEW(&list1);
+    LIST_NEW(&list2);
+    while ((opt = getopt(argc, argv, "n:d:")) != -1)
+        switch (opt) {
+        case 'n':
+            entries = atol(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    if (optind < argc || entries < 1 || depth < 1 || depth > DEPTH_MAX)
+        goto usage;
+    if (make_lists(&list1, &list2, entries, depth)) {
+        fprintf(stderr, "entries=%zu: out of memory\n", entries);
+        goto error;
+    }
+    tstrcmp = tlcp = tauto = 0;
+    for (round = 0; round < ROUNDS; ++round) {  /* the best of each */
+        memset(count, 0, sizeof(count)), memset(countlcp, 0, sizeof(countlcp));
+        memset(countauto, 0, sizeof(countauto));
+        t = now();
+        sets_next_ELIST(&list1, &list2, count_func, count, NULL);
+        t = now() - t;
+        if (round == 0 || t < tstrcmp)
+            tstrcmp = t;
+        t = now();
+        sets_next_lcp_ELIST(&list1, &list2, count_func, countlcp, NULL);
+        t = now() - t;
+        if (round == 0 || t < tlcp)
+            tlcp = t;
+        t = now();
+        sets_next_auto_ELIST(&list1, &list2, count_func, countauto, NULL);
+        t = now() - t;
+        if (round == 0 || t < tauto)
+            tauto = t;
+        if (memcmp(count, countlcp, sizeof(count)) ||
+            memcmp(count, countauto, sizeof(count)) ) {
+            fprintf(stderr, "entries=%zu: results differ\n", entries);
+            goto error;
+        }
+    }
+    printf("entries=%zu depth=%d mean_lcp=%.0f strcmp_ns=%.1f lcp_ns=%.1f auto_ns=%.1f (%s)\n",
+           entries, depth, mean_lcp(&list1),
+           tstrcmp * 1e9 / entries, tlcp * 1e9 / entries, tauto * 1e9 / entries,
+           mean_lcp(&list1) >= LCP_DEEP ? "lcp" : "strcmp" );
+    status = 0;
+error:
+    free_ELIST(&list2);
+    free_ELIST(&list1);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+usage:
+    fprintf(stderr, "usage: %s [-n ENTRIES] [-d DEPTH]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,451 @@
+/* bench_sync.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* End-to-end benchmark: generates a synthetic tree from a seed, so that
+ * every run and every release syncs the same data, and syncs it to an
+ * empty directory with two psync_run() peers connected through relays
+ * that count the bytes on the wire, the way the example in DEV_ja.md
+ * connects them with pipes.  Then syncs again without changes, and once
+ * more after modifying, deleting, creating and renaming a part of the
+ * files.  Reports each of these phases in one line:
+ *
+ *   phase=NAME seconds= user= sys= syscr= syscw= upload= download= maxrss=
+ *
+ * syscr and syscw are the read and write system calls of psync (from
+ * /proc/self/io, -1 if not available), upload and download the bytes
+ * sent by each peer, maxrss the peak resident set size so far in KiB.
+ *
+ * usage: bench_sync [-f FILES] [-s KiB] [-d DEPTH] [-c CHURN%] [-r SEED] [-y FSYNC] [DIRECTORY]
+ *
+ * File sizes are log-uniformly distributed between 0 and -s KiB, files
+ * spread evenly over a tree of DEPTH levels with FANOUT subdirectories.
+ * -y sets fsync= of both peers to none, batch or file, so that the cost
+ * of each durability mode can be compared on the same tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "psync.h"
+
+#define FANOUT 4  /* subdirectories in each directory */
+#define RELAY_BUFFER (64*1024)  /* [byte] */
+
+typedef struct {
+    uint64_t s;
+} RANDOM;
+
+typedef struct {
+    int fdin, fdout;
+    uint64_t bytes;
+    long long reads, writes;  /* system calls */
+    pthread_t tid;
+} RELAY;
+
+typedef struct {
+    PSYNC *psync;
+    int status;
+    pthread_t tid;
+} PEER;
+
+typedef struct {
+    double t;
+    struct rusage ru;
+    long long syscr, syscw;
+} SAMPLE;
+
+static uint64_t random_next(RANDOM *random) {  /* xorshift64*, same on every platform */
+    random->s ^= random->s >> 12;
+    random->s ^= random->s << 25;
+    random->s ^= random->s >> 27;
+    return random->s * 0x2545f4914f6cdd1dULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sample(SAMPLE *s) {
+    FILE *fp;
+    char line[256];
+
+    s->t = now();
+    getrusage(RUSAGE_SELF, &s->ru);
+    s->syscr = s->syscw = -1;
+    fp = fopen("/proc/self/io", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            sscanf(line, "syscr: %lld", &s->syscr);
+            sscanf(line, "syscw: %lld", &s->syscw);
+        }
+        fclose(fp);
+    }
+}
+
+static void pathname_of(char *pathname, size_t size, const char *dirname,
+                        unsigned long n, int depth, const char *suffix ) {
+    unsigned long dir = n;
+    int length;
+    int level;
+
+    length = snprintf(pathname, size, "%s", dirname);
+    for (level = 0; level < depth; ++level, dir /= FANOUT)
+        length += snprintf(pathname + length, size - length, "/d%lu", dir % FANOUT);
+    snprintf(pathname + length, size - length, "/f%06lu%s", n, suffix);
+}
+
+static int make_dirs(const char *dirname, int depth) {
+    int status = INT_MIN;
+    char pathname[PATH_MAX];
+    unsigned long count, n;
+    char *s;
+
+    for (count = 1, n = 0; (int)n < depth; ++n)
+        count *= FANOUT;
+    for (n = 0; n < count; ++n) {
+        pathname_of(pathname, sizeof(pathname), dirname, n, depth, "");
+        for (s = pathname + strlen(dirname) + 1; (s = strchr(s, '/')); ++s) {
+            *s = 0;
+            if (mkdir(pathname, S_IRWXU) == -1 && errno != EEXIST) {
+                perror(pathname);
+                goto error;
+            }
+            *s = '/';
+        }
+    }
+    status = 0;
+error:
+    return status;
+}
+
+static int write_file(const char *pathname, off_t size, RANDOM *random) {
+    int status = INT_MIN;
+    uint64_t buffer[RELAY_BUFFER/sizeof(uint64_t)];
+    int fd;
+    size_t length, n;
+
+    fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        perror(pathname);
+        goto error;
+    }
+    while (size > 0) {
+        length = size < (off_t)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        for (n = 0; n < (length + sizeof(*buffer) - 1) / sizeof(*buffer); ++n)
+            buffer[n] = random_next(random);
+        if (write(fd, buffer, length) != (ssize_t)length) {
+            perror(pathname);
+            goto error;
+        }
+        size -= length;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+static off_t size_of(RANDOM *random, off_t max) {  /* log-uniform in [0, max] */
+    int bits, k;
+    off_t size;
+
+    for (bits = 0; bits < 62 && (off_t)1 << bits <= max; ++bits);
+    k = random_next(random) % (bits + 1);  /* [2^k-1, 2^(k+1)-1) */
+    size = ((off_t)1 << k) - 1 + (k > 0 ? (off_t)(random_next(random) % ((uint64_t)1 << k)) : 0);
+    return size < max ? size : max;
+}
+
+static int make_tree(const char *dirname, unsigned long files, off_t max, int depth,
+                     RANDOM *random ) {
+    int status = INT_MIN;
+    char pathname[PATH_MAX];
+    unsigned long n;
+
+    if (make_dirs(dirname, depth))
+        goto error;
+    for (n = 0; n < files; ++n) {
+        pathname_of(pathname, sizeof(pathname), dirname, n, depth, "");
+        if (write_file(pathname, size_of(random, max), random))
+            goto error;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+/* Changes churn% of the files, a quarter each modified, deleted, created
+ * and renamed.
+ */
+static int churn_tree(const char *dirname, unsigned long files, off_t max, int depth,
+                      int churn, RANDOM *random ) {
+    int status = INT_MIN;
+    char pathname[PATH_MAX], newname[PATH_MAX];
+    unsigned long n;
+    struct stat st;
+
+    for (n = 0; n < files; ++n) {
+        if (random_next(random) % 100 >= (uint64_t)churn)
+            continue;
+        pathname_of(pathname, sizeof(pathname), dirname, n, depth, "");
+        switch (random_next(random) % 4) {
+        case 0:  /* modified, same size */
+            if (stat(pathname, &st) == -1) {
+                perror(pathname);
+                goto error;
+            }
+            if (write_file(pathname, st.st_size, random))
+                goto error;
+            break;
+        case 1:  /* deleted */
+            if (unlink(pathname) == -1) {
+                perror(pathname);
+                goto error;
+            }
+            break;
+        case 2:  /* created */
+            pathname_of(newname, sizeof(newname), dirname, n, depth, ".new");
+            if (write_file(newname, size_of(random, max), random))
+                goto error;
+            break;
+        case 3:  /* renamed */
+            pathname_of(newname, sizeof(newname), dirname, n, depth, ".renamed");
+            if (rename(pathname, newname) == -1) {
+                perror(pathname);
+                goto error;
+            }
+            break;
+        }
+    }
+    status = 0;
+error:
+    return status;
+}
+
+static void *relay_thread(void *data) {
+    RELAY *relay = data;
+    char buffer[RELAY_BUFFER];
+    ssize_t n, w;
+    char *p;
+
+    while (++relay->reads, (n = read(relay->fdin, buffer, sizeof(buffer))) > 0)
+        for (p = buffer; n > 0; n -= w, p += w) {
+            ++relay->writes;
+            w = write(relay->fdout, p, n);
+            if (w <= 0)
+                goto error;
+            relay->bytes += w;
+        }
+error:
+    close(relay->fdout);
+    close(relay->fdin);
+    return NULL;
+}
+
+static void *peer_thread(void *data) {
+    PEER *peer = data;
+
+    peer->status = psync_run(peer->psync);
+    close(peer->psync->fdout);
+    close(peer->psync->fdin);
+    return NULL;
+}
+
+/* peer[0] <-> relay[0] (upload), relay[1] (download) <-> peer[1] */
+static int run(const char *phase, const char *dirname1, const char *dirname2, int fsync) {
+    int status = INT_MIN;
+    PEER peer[2] = {{NULL, INT_MIN}, {NULL, INT_MIN}};
+    RELAY relay[2];
+    int fds[4][2] = {{-1, -1}, {-1, -1}, {-1, -1}, {-1, -1}};
+    SAMPLE s0, s1;
+    int n;
+
+    for (n = 0; n < 4; ++n)
+        if (pipe(fds[n]) == -1)
+            goto error;
+    peer[0].psync = psync_new(dirname1, NULL);
+    peer[1].psync = psync_new(dirname2, NULL);
+    if (!peer[0].psync || !peer[1].psync)
+        goto error;
+    peer[0].psync->fsync = fsync, peer[1].psync->fsync = fsync;
+    peer[0].psync->fdout = fds[0][1], relay[0].fdin = fds[0][0];
+    relay[0].fdout = fds[1][1], peer[1].psync->fdin = fds[1][0];
+    peer[1].psync->fdout = fds[2][1], relay[1].fdin = fds[2][0];
+    relay[1].fdout = fds[3][1], peer[0].psync->fdin = fds[3][0];
+    for (n = 0; n < 2; ++n)
+        relay[n].bytes = 0, relay[n].reads = relay[n].writes = 0;
+    sample(&s0);
+    for (n = 0; n < 2; ++n) {
+        pthread_create(&relay[n].tid, NULL, relay_thread, &relay[n]);
+        pthread_create(&peer[n].tid, NULL, peer_thread, &peer[n]);
+    }
+    for (n = 0; n < 2; ++n) {
+        pthread_join(peer[n].tid, NULL);
+        pthread_join(relay[n].tid, NULL);
+    }
+    sample(&s1);
+    for (n = 0; n < 4; ++n)
+        fds[n][0] = fds[n][1] = -1;  /* closed by the threads */
+    if (s1.syscr >= 0)
+        s1.syscr -= s0.syscr + relay[0].reads + relay[1].reads;
+    if (s1.syscw >= 0)
+        s1.syscw -= s0.syscw + relay[0].writes + relay[1].writes;
+    printf("phase=%s seconds=%.3f user=%.3f sys=%.3f syscr=%lld syscw=%lld upload=%llu download=%llu maxrss=%ld\n",
+           phase, s1.t - s0.t,
+           (s1.ru.ru_utime.tv_sec - s0.ru.ru_utime.tv_sec) + (s1.ru.ru_utime.tv_usec - s0.ru.ru_utime.tv_usec) / 1e6,
+           (s1.ru.ru_stime.tv_sec - s0.ru.ru_stime.tv_sec) + (s1.ru.ru_stime.tv_usec - s0.ru.ru_stime.tv_usec) / 1e6,
+           s1.syscr, s1.syscw,
+           (unsigned long long)relay[0].bytes, (unsigned long long)relay[1].bytes,
+           s1.ru.ru_maxrss );
+    fflush(stdout);
+    if (peer[0].status || peer[1].status) {
+        fprintf(stderr, "phase=%s: psync_run() returned %d, %d\n", phase, peer[0].status, peer[1].status);
+        goto error;
+    }
+    status = 0;
+error:
+    for (n = 0; n < 4; ++n) {
+        if (fds[n][0] != -1)
+            close(fds[n][0]);
+        if (fds[n][1] != -1)
+            close(fds[n][1]);
+    }
+    if (peer[1].psync)
+        psync_free(peer[1].psync);
+    if (peer[0].psync)
+        psync_free(peer[0].psync);
+    return status;
+}
+
+static int remove_func(const char *pathname, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(pathname);
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    unsigned long files = 5000;
+    off_t max = 64;
+    int depth = 4;
+    int churn = 10;
+    RANDOM random = {1};
+    static const char *fsyncs[] = {
+        [FSYNC_NONE]  = "none",
+        [FSYNC_BATCH] = "batch",
+        [FSYNC_FILE]  = "file"
+    };
+    int fsync = FSYNC_NONE;
+    const char *dirname = ".";
+    char topname[PATH_MAX] = "", dirname1[PATH_MAX], dirname2[PATH_MAX];
+    struct timespec ts = {1, 100000000};  /* mtimes must move on */
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:d:c:r:y:")) != -1)
+        switch (opt) {
+        case 'f':
+            files = atol(optarg);
+            break;
+        case 's':
+            max = atoll(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'c':
+            churn = atoi(optarg);
+            break;
+        case 'r':
+            random.s = strtoull(optarg, NULL, 0);
+            break;
+        case 'y':
+            for (fsync = 0; fsync < (int)(sizeof(fsyncs)/sizeof(*fsyncs)); ++fsync)
+                if (!strcmp(optarg, fsyncs[fsync]))
+                    break;
+            if (fsync == (int)(sizeof(fsyncs)/sizeof(*fsyncs)))
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    if (optind < argc)
+        dirname = argv[optind++];
+    if (optind < argc || files < 1 || max < 0 || depth < 0 || depth > 8 ||
+        churn < 0 || churn > 100 || random.s == 0 )
+        goto usage;
+    printf("files=%lu max=%lld depth=%d churn=%d seed=%llu fsync=%s\n",
+           files, (long long)max, depth, churn, (unsigned long long)random.s, fsyncs[fsync] );
+    max *= 1024;
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(topname, sizeof(topname), "%s/bench_sync.XXXXXX", dirname);
+    if (!mkdtemp(topname)) {
+        perror(topname);
+        *topname = 0;
+        goto error;
+    }
+    snprintf(dirname1, sizeof(dirname1), "%s/dir1", topname);
+    snprintf(dirname2, sizeof(dirname2), "%s/dir2", topname);
+    if (mkdir(dirname1, S_IRWXU) == -1 || mkdir(dirname2, S_IRWXU) == -1) {
+        perror(topname);
+        goto error;
+    }
+    if (make_tree(dirname1, files, max, depth, &random))
+        goto error;
+    if (run("initial", dirname1, dirname2, fsync))
+        goto error;
+    nanosleep(&ts, NULL);
+    if (run("unchanged", dirname1, dirname2, fsync))
+        goto error;
+    nanosleep(&ts, NULL);
+    if (churn_tree(dirname1, files, max, depth, churn, &random))
+        goto error;
+    if (run("churn", dirname1, dirname2, fsync))
+        goto error;
+    status = 0;
+error:
+    if (*topname)
+        nftw(topname, remove_func, 16, FTW_DEPTH|FTW_PHYS);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+usage:
+    fprintf(stderr, "usage: %s [-f FILES] [-s KiB] [-d DEPTH] [-c CHURN%%] [-r SEED] [-y FSYNC] [DIRECTORY]\n", argv[0]);
+    return EXIT_FAILURE;
+}
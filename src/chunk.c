@@ -0,0 +1,285 @@
+/* chunk.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "chunk.h"
+
+#ifndef CHUNKBUFFER_SIZE
+#define CHUNKBUFFER_SIZE (256*1024)  /* [byte] */
+#endif  /* #ifndef CHUNKBUFFER_SIZE */
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t length;
+    size_t n;
+    uint8_t block[64];
+} SHA256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(_x, _n) ((_x) >> (_n) | (_x) << (32 - (_n)))
+
+static void sha256_block(SHA256 *sha, const uint8_t *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    unsigned int n;
+
+    for (n = 0; n < 16; ++n, p += 4)
+        w[n] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    for (; n < 64; ++n)
+        w[n] = (ROTR(w[n-2], 17) ^ ROTR(w[n-2], 19) ^ w[n-2] >> 10) + w[n-7] +
+               (ROTR(w[n-15], 7) ^ ROTR(w[n-15], 18) ^ w[n-15] >> 3) + w[n-16];
+    a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3];
+    e = sha->h[4], f = sha->h[5], g = sha->h[6], h = sha->h[7];
+    for (n = 0; n < 64; ++n) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[n] + w[n];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    sha->h[0] += a, sha->h[1] += b, sha->h[2] += c, sha->h[3] += d;
+    sha->h[4] += e, sha->h[5] += f, sha->h[6] += g, sha->h[7] += h;
+}
+
+static void sha256_init(SHA256 *sha) {
+    static const uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->h, h, sizeof(sha->h));
+    sha->length = 0;
+    sha->n = 0;
+}
+
+static void sha256_update(SHA256 *sha, const uint8_t *data, size_t size) {
+    size_t n;
+
+    sha->length += size;
+    if (sha->n > 0) {
+        n = sizeof(sha->block) - sha->n;
+        if (n > size)
+            n = size;
+        memcpy(sha->block + sha->n, data, n);
+        sha->n += n, data += n, size -= n;
+        if (sha->n < sizeof(sha->block))
+            return;
+        sha256_block(sha, sha->block);
+        sha->n = 0;
+    }
+    while (size >= sizeof(sha->block)) {
+        sha256_block(sha, data);
+        data += sizeof(sha->block), size -= sizeof(sha->block);
+    }
+    memcpy(sha->block, data, size);
+    sha->n = size;
+}
+
+static void sha256_final(SHA256 *sha, uint8_t hash[CHUNK_HASHSIZE]) {
+    uint64_t length = sha->length * 8;
+    unsigned int n;
+
+    sha->block[sha->n++] = 0x80;
+    if (sha->n > sizeof(sha->block) - 8) {
+        memset(sha->block + sha->n, 0, sizeof(sha->block) - sha->n);
+        sha256_block(sha, sha->block);
+        sha->n = 0;
+    }
+    memset(sha->block + sha->n, 0, sizeof(sha->block) - 8 - sha->n);
+    for (n = 0; n < 8; ++n)
+        sha->block[sizeof(sha->block) - 1 - n] = length >> n * 8;
+    sha256_block(sha, sha->block);
+    for (n = 0; n < 8; ++n) {
+        hash[n*4+0] = sha->h[n] >> 24;
+        hash[n*4+1] = sha->h[n] >> 16;
+        hash[n*4+2] = sha->h[n] >> 8;
+        hash[n*4+3] = sha->h[n];
+    }
+}
+
+void chunk_hash(uint8_t hash[CHUNK_HASHSIZE], const void *data, size_t size) {
+    SHA256 sha;
+
+    sha256_init(&sha);
+    sha256_update(&sha, data, size);
+    sha256_final(&sha, hash);
+}
+
+int chunk_hashfile(uint8_t hash[CHUNK_HASHSIZE], int fd, off_t size,
+                   volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    uint8_t *buffer = NULL;
+    SHA256 sha;
+    ssize_t n;
+
+    buffer = malloc(CHUNKBUFFER_SIZE);
+    if (!buffer) {
+        status = -1;
+        goto error;
+    }
+    sha256_init(&sha);
+    while (size > 0) {
+        ONSTOP(stop, -1);
+        n = read_size(fd, buffer, size > CHUNKBUFFER_SIZE ? CHUNKBUFFER_SIZE : size);
+        if (n <= 0) {
+            status = -1;
+            goto error;
+        }
+        sha256_update(&sha, buffer, n);
+        size -= n;
+    }
+    sha256_final(&sha, hash);
+    status = 0;
+error:
+    free(buffer);
+    return status;
+}
+
+uint64_t chunk_key(const uint8_t hash[CHUNK_HASHSIZE]) {
+    uint64_t key = 0;
+    unsigned int n;
+
+    for (n = 0; n < sizeof(key); ++n)
+        key = key << 8 | hash[n];
+    return key;
+}
+
+CHUNKS *chunk_new(size_t count) {
+    CHUNKS *chunks;
+
+    chunks = malloc(offsetof(CHUNKS, chunk) + sizeof(*chunks->chunk) * count);
+    if (chunks) {
+        chunks->count = count;
+        memset(chunks->chunk, 0, sizeof(*chunks->chunk) * count);
+    }
+    return chunks;
+}
+
+static int chunk_add(CHUNKS **chunks, size_t *size, SHA256 *sha, uint32_t length) {
+    int status = INT_MIN;
+    CHUNKS *cnew;
+    CHUNK *chunk;
+
+    if ((*chunks)->count >= *size) {
+        cnew = realloc(*chunks, offsetof(CHUNKS, chunk) + sizeof(*cnew->chunk) * *size * 2);
+        if (!cnew) {
+            status = -1;
+            goto error;
+        }
+        *chunks = cnew, *size *= 2;
+    }
+    chunk = &(*chunks)->chunk[(*chunks)->count++];
+    chunk->size = length;
+    chunk->need = false;
+    sha256_final(sha, chunk->hash);
+    sha256_init(sha);
+    status = 0;
+error:
+    return status;
+}
+
+/* Content defined chunking with a gear rolling hash: a boundary is put
+ * where the top CHUNK_BITS bits of the hash are all zero, so inserting or
+ * removing bytes only moves the boundaries next to the edit. */
+int chunk_file(CHUNKS **chunks, int fd, off_t size,
+               volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    uint64_t gear[256];
+    uint64_t seed, h;
+    CHUNKS *clist = NULL;
+    size_t csize;
+    uint8_t *buffer = NULL;
+    SHA256 sha;
+    uint32_t length;
+    ssize_t n, m, start;
+    unsigned int k;
+
+    ONSTOP(stop, -1);
+    for (seed = 0, k = 0; k < 256; ++k) {  /* splitmix64 */
+        h = seed += 0x9e3779b97f4a7c15;
+        h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9;
+        h = (h ^ h >> 27) * 0x94d049bb133111eb;
+        gear[k] = h ^ h >> 31;
+    }
+    csize = 16;
+    clist = chunk_new(csize);
+    buffer = malloc(CHUNKBUFFER_SIZE);
+    if (!clist || !buffer) {
+        status = -1;
+        goto error;
+    }
+    clist->count = 0;
+    sha256_init(&sha);
+    h = 0, length = 0;
+    while (size > 0) {
+        ONSTOP(stop, -1);
+        n = read_size(fd, buffer, size > CHUNKBUFFER_SIZE ? CHUNKBUFFER_SIZE : size);
+        if (n <= 0) {
+            status = -1;
+            goto error;
+        }
+        for (start = 0, m = 0; m < n; ++m) {
+            h = (h << 1) + gear[buffer[m]];
+            if (++length < CHUNK_MIN)
+                continue;
+            if (h >> (64 - CHUNK_BITS) && length < CHUNK_MAX)
+                continue;
+            sha256_update(&sha, buffer + start, m + 1 - start);
+            ONERR(chunk_add(&clist, &csize, &sha, length), -1);
+            start = m + 1;
+            h = 0, length = 0;
+        }
+        sha256_update(&sha, buffer + start, n - start);
+        size -= n;
+    }
+    if (length > 0)
+        ONERR(chunk_add(&clist, &csize, &sha, length), -1);
+    *chunks = clist, clist = NULL;
+    status = 0;
+error:
+    free(buffer);
+    free(clist);
+    return status;
+}
@@ -0,0 +1,64 @@
+/* chunk.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_chunk_h
+#define _INCLUDE_chunk_h
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CHUNK_HASHSIZE 32  /* SHA-256 [byte] */
+#ifndef CHUNK_MIN
+#define CHUNK_MIN  (16*1024)  /* [byte] */
+#endif  /* #ifndef CHUNK_MIN */
+#ifndef CHUNK_BITS
+#define CHUNK_BITS 16         /* average chunk size is 2^CHUNK_BITS [byte] */
+#endif  /* #ifndef CHUNK_BITS */
+#ifndef CHUNK_MAX
+#define CHUNK_MAX (256*1024)  /* [byte] */
+#endif  /* #ifndef CHUNK_MAX */
+
+typedef struct {
+    uint32_t size;
+    bool need;
+    uint8_t hash[CHUNK_HASHSIZE];
+} CHUNK;
+typedef struct {
+    size_t count;
+    CHUNK chunk[];
+} CHUNKS;
+
+extern void chunk_hash(uint8_t hash[CHUNK_HASHSIZE], const void *data, size_t size);
+extern int chunk_hashfile(uint8_t hash[CHUNK_HASHSIZE], int fd, off_t size,
+                          volatile sig_atomic_t *stop );
+extern uint64_t chunk_key(const uint8_t hash[CHUNK_HASHSIZE]);
+extern CHUNKS *chunk_new(size_t count);
+extern int chunk_file(CHUNKS **chunks, int fd, off_t size,
+                      volatile sig_atomic_t *stop );
+
+#endif  /* #ifndef _INCLUDE_chunk_h */
@@ -1,4 +1,4 @@
-/* common.c - Last modified: 07-Mar-2026 (kobayasy)
+/* common.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -32,14 +32,15 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#ifdef POLL_TIMEOUT
+#include <fcntl.h>
 #include <poll.h>
-#endif  /* #ifdef POLL_TIMEOUT */
 #include "common.h"
+#include "trace.h"
 
 void str_init(STR *str, char *buffer, size_t size) {
     str->e = str->s = buffer, str->size = size;
@@ -122,38 +123,46 @@ const char *basename_c(const char *path) {
     return s;
 }
 
-ssize_t write_size(int fd, const void *buf, size_t count) {
-    ssize_t status = -1;
 #ifdef POLL_TIMEOUT
+#define POLL_WAIT (POLL_TIMEOUT * 1000)  /* [msec] */
+#else  /* #ifdef POLL_TIMEOUT */
+#define POLL_WAIT -1
+#endif  /* #ifdef POLL_TIMEOUT */
+
+/* Waits until fd is ready for events, false on timeout or error. */
+static bool poll_fd(int fd, short events) {
     struct pollfd fds = {
         .fd = fd,
-        .events = POLLOUT
+        .events = events
     };
-#endif  /* #ifdef POLL_TIMEOUT */
+    int n;
+
+    do
+        n = poll(&fds, 1, POLL_WAIT);
+    while (n == -1 && errno == EINTR);
+    return n > 0 && fds.revents & events;
+}
+
+/* The fd may be non-blocking (see nonblock_set()): I/O is tried first and
+ * poll() is only called when it would block, not for every buffer. */
+ssize_t write_size(int fd, const void *buf, size_t count) {
+    ssize_t status = -1;
+    int64_t t;
     size_t size;
     ssize_t n;
 
+    t = TRACE_BEGIN();
     size = count;
     while (size > 0) {
-#ifdef POLL_TIMEOUT
-        switch (poll(&fds, 1, POLL_TIMEOUT)) {
-        case -1:
-            switch (errno) {
-            case EINTR:
-                continue;
-            }
-        case  0:  /* timeout */
-            goto error;
-        }
-        if (!(fds.revents & POLLOUT))
-            goto error;
-#endif  /* #ifdef POLL_TIMEOUT */
         n = write(fd, buf, size);
         switch (n) {
         case -1:
             switch (errno) {
             case EINTR:
                 continue;
+            case EAGAIN:
+                if (poll_fd(fd, POLLOUT))
+                    continue;
             }
         case  0:  /* end of file */
             goto error;
@@ -163,41 +172,28 @@ ssize_t write_size(int fd, const void *buf, size_t count) {
     }
     status = count;
 error:
+    trace_wait(t, "write", count);
     return status;
 }
 
 ssize_t read_size(int fd, void *buf, size_t count) {
     ssize_t status = -1;
-#ifdef POLL_TIMEOUT
-    struct pollfd fds = {
-        .fd = fd,
-        .events = POLLIN
-    };
-#endif  /* #ifdef POLL_TIMEOUT */
+    int64_t t;
     size_t size;
     ssize_t n;
 
+    t = TRACE_BEGIN();
     size = count;
     while (size > 0) {
-#ifdef POLL_TIMEOUT
-        switch (poll(&fds, 1, POLL_TIMEOUT)) {
-        case -1:
-            switch (errno) {
-            case EINTR:
-                continue;
-            }
-        case  0:  /* timeout */
-            goto error;
-        }
-        if (!(fds.revents & POLLIN))
-            goto error;
-#endif  /* #ifdef POLL_TIMEOUT */
         n = read(fd, buf, size);
         switch (n) {
         case -1:
             switch (errno) {
             case EINTR:
                 continue;
+            case EAGAIN:
+                if (poll_fd(fd, POLLIN))
+                    continue;
             }
         case  0:  /* end of file */
             goto error;
@@ -207,9 +203,44 @@ ssize_t read_size(int fd, void *buf, size_t count) {
     }
     status = count;
 error:
+    trace_wait(t, "read", count);
     return status;
 }
 
+/* With a communication timeout, a connection fd is made non-blocking so
+ * that write_size() and read_size() can wait with one.  Returns the old
+ * flags for nonblock_reset(). */
+int nonblock_set(int fd) {
+    int flags = -1;
+
+#ifdef POLL_TIMEOUT
+    flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && !(flags & O_NONBLOCK) &&
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+        flags = -1;
+#endif  /* #ifdef POLL_TIMEOUT */
+    return flags;
+}
+
+void nonblock_reset(int fd, int flags) {
+    if (flags != -1 && !(flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags);
+}
+
+#define LCP_BLOCK 16  /* [byte] memcmp() of this size is compiled to vector compares */
+int strcmp_lcp(const char *s1, size_t length1,
+               const char *s2, size_t length2, size_t *lcp) {
+    size_t n = *lcp;
+    size_t length = length1 < length2 ? length1 : length2;
+
+    while (n + LCP_BLOCK <= length && !memcmp(s1 + n, s2 + n, LCP_BLOCK))
+        n += LCP_BLOCK;
+    while (n < length && s1[n] == s2[n])
+        ++n;
+    *lcp = n;
+    return (int)(unsigned char)s1[n] - (int)(unsigned char)s2[n];
+}
+
 int strcmp_next(const char *s1, const char *s2) {
     int n = strcmp(s1, s2);
 
@@ -1,4 +1,4 @@
-/* common.h - Last modified: 07-Mar-2026 (kobayasy)
+/* common.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -129,6 +129,8 @@ extern const char *basename_c(const char *path);
     } while (0)
 extern ssize_t write_size(int fd, const void *buf, size_t count);
 extern ssize_t read_size(int fd, void *buf, size_t count);
+extern int nonblock_set(int fd);
+extern void nonblock_reset(int fd, int flags);
 
 #define WRITE_ONERR(_data, _fd, _write, _error) \
     do { \
@@ -186,6 +188,46 @@ extern ssize_t read_size(int fd, void *buf, size_t count);
     } while (0)
 extern int strcmp_next(const char *s1, const char *s2);
 
+/* Lists sorted by name can keep in each entry its length and the length
+ * of the prefix it shares with the previous entry (lcp), so that sorted
+ * merges compare names from where they differ.  The _LCP macros keep lcp
+ * exact or LCP_NONE (unknown) on every change of the list.
+ */
+#define LCP_NONE SIZE_MAX
+#define LIST_DELETE_LCP(_p) \
+    do { \
+        if ((_p)->next->lcp != LCP_NONE && \
+            ((_p)->lcp == LCP_NONE || (_p)->lcp < (_p)->next->lcp) ) \
+            (_p)->next->lcp = (_p)->lcp; \
+        LIST_DELETE(_p); \
+        (_p)->lcp = LCP_NONE; \
+    } while (0)
+#define LIST_INSERT_NEXT_LCP(_p, _list) \
+    do { \
+        LIST_INSERT_NEXT(_p, _list); \
+        (_p)->lcp = LCP_NONE, (_p)->next->lcp = LCP_NONE; \
+    } while (0)
+#define LIST_INSERT_PREV_LCP(_p, _list) \
+    do { \
+        LIST_INSERT_PREV(_p, _list); \
+        (_p)->lcp = LCP_NONE, (_p)->next->lcp = LCP_NONE; \
+    } while (0)
+#define LIST_SEEK_NEXT_LCP(_p, _name, _length, _seek, _lcpprev, _lcpnext) \
+    do { \
+        while (*(_p)->next->name && \
+               ((_lcpnext) = 0, strcmp_lcp((_p)->next->name, (_p)->next->length, \
+                                           (_name), (_length), &(_lcpnext) ) <= 0) ) \
+            (_p) = (_p)->next; \
+        if (!*(_p)->next->name) \
+            (_lcpnext) = 0; \
+        while ((_lcpprev) = 0, \
+               ((_seek) = strcmp_lcp((_p)->name, (_p)->length, \
+                                     (_name), (_length), &(_lcpprev) )) > 0 ) \
+            (_p) = (_p)->prev, (_lcpnext) = (_lcpprev); \
+    } while (0)
+extern int strcmp_lcp(const char *s1, size_t length1,
+                      const char *s2, size_t length2, size_t *lcp);
+
 typedef enum {
     SETS_1AND2,
     SETS_1NOT2,
@@ -282,6 +324,87 @@ int sets_next_##_LIST(_LIST *list1, _LIST *list2, \
 error: \
     return status; \
 }
+#define sets_next_lcp(_LIST) \
+int sets_next_lcp_##_LIST(_LIST *list1, _LIST *list2, \
+                          int (*func)(SETS sets, _LIST *p1, _LIST *p2, void *data), \
+                                                                       void *data, \
+                          volatile sig_atomic_t *stop ) { \
+    int status = INT_MIN; \
+    _LIST *p1 = list1; \
+    _LIST *p2 = list2; \
+    _LIST *next1, *next2; \
+    size_t lcp, lcp1, lcp2;  /* lcp1, lcp2: prefix p1, p2 share with the last one passed */ \
+    int n; \
+\
+    if (*p1->name || *p2->name) \
+        goto error; \
+    p1 = p1->next, p2 = p2->next; \
+    lcp1 = lcp2 = LCP_NONE; \
+    while (*p1->name || *p2->name) { \
+        ONSTOP(stop, -1); \
+        if (!*p1->name) \
+            n = 1; \
+        else if (!*p2->name) \
+            n = -1; \
+        else if (lcp1 == LCP_NONE || lcp2 == LCP_NONE) \
+            lcp = 0, n = strcmp_lcp(p1->name, p1->length, p2->name, p2->length, &lcp); \
+        else if (lcp1 > lcp2) \
+            lcp = lcp2, n = -1; \
+        else if (lcp1 < lcp2) \
+            lcp = lcp1, n = 1; \
+        else \
+            lcp = lcp1, n = strcmp_lcp(p1->name, p1->length, p2->name, p2->length, &lcp); \
+        if (n < 0) { \
+            next1 = p1->next; \
+            lcp1 = next1->lcp, lcp2 = lcp; \
+            status = func(SETS_1NOT2, p1, p2, data); \
+            if (ISERR(status)) \
+                goto error; \
+            p1 = next1; \
+        } \
+        else if (n > 0) { \
+            next2 = p2->next; \
+            lcp1 = lcp, lcp2 = next2->lcp; \
+            status = func(SETS_2NOT1, p1, p2, data); \
+            if (ISERR(status)) \
+                goto error; \
+            p2 = next2; \
+        } \
+        else { \
+            next1 = p1->next, next2 = p2->next; \
+            lcp1 = next1->lcp, lcp2 = next2->lcp; \
+            status = func(SETS_1AND2, p1, p2, data); \
+            if (ISERR(status)) \
+                goto error; \
+            p1 = next1, p2 = next2; \
+        } \
+    } \
+    status = 0; \
+error: \
+    return status; \
+}
+/* sets_next_lcp() pays for keeping the prefix lengths on every step and
+ * only wins where names share long prefixes (deep trees); sets_next_auto()
+ * takes it when the mean lcp of the first LCP_SAMPLE entries of list1 is
+ * at least LCP_DEEP, and sets_next() otherwise.  Both must be instantiated.
+ */
+#define LCP_SAMPLE 256
+#define LCP_DEEP   256  /* [byte] */
+#define sets_next_auto(_LIST) \
+int sets_next_auto_##_LIST(_LIST *list1, _LIST *list2, \
+                           int (*func)(SETS sets, _LIST *p1, _LIST *p2, void *data), \
+                                                                        void *data, \
+                           volatile sig_atomic_t *stop ) { \
+    _LIST *p; \
+    size_t sum = 0, count = 0; \
+\
+    for (p = list1->next; *p->name && count < LCP_SAMPLE; p = p->next) \
+        if (p->lcp != LCP_NONE) \
+            sum += p->lcp, ++count; \
+    if (count > 0 && sum >= count * LCP_DEEP) \
+        return sets_next_lcp_##_LIST(list1, list2, func, data, stop); \
+    return sets_next_##_LIST(list1, list2, func, data, stop); \
+}
 #define sets_prev(_LIST) \
 int sets_prev_##_LIST(_LIST *list1, _LIST *list2, \
                       int (*func)(SETS sets, _LIST *p1, _LIST *p2, void *data), \
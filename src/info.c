@@ -1,4 +1,4 @@
-/* info.c - Last modified: 18-Jul-2026 (kobayasy)
+/* info.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2023-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -34,11 +34,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include "common.h"
 #include "tpbar.h"
+#include "trace.h"
 #include "info.h"
 
 static const char *strmes(int status) {
@@ -125,6 +127,12 @@ typedef struct s_ilist {
         intmax_t download;
         intmax_t remove;
         intmax_t copy;
+        intmax_t total;         /* bytes the host is going to upload, -1 until the 'T' line */
+        intmax_t files;
+        bool done;
+        int status;
+        int64_t tfirst, tlast;  /* [usec] of the first and the last download progress */
+        intmax_t dfirst, dlast;
     } host[INFONFD];
     char name[1];
 } ILIST;
@@ -138,6 +146,7 @@ static ILIST *new_ILIST(ILIST *ilist) {
 
 static ILIST *add_ILIST(ILIST *ilist, const char *name, int row) {
     ILIST *inew = NULL;
+    unsigned int n;
 
     if (!*name)
         goto error;
@@ -147,6 +156,10 @@ static ILIST *add_ILIST(ILIST *ilist, const char *name, int row) {
     strcpy(inew->name, name);
     inew->row = row;
     memset(inew->host, 0, sizeof(inew->host));
+    for (n = 0; n < INFONFD; ++n) {
+        inew->host[n].total = -1;
+        inew->host[n].tfirst = -1;
+    }
     LIST_INSERT_NEXT(inew, ilist);
 error:
     return inew;
@@ -166,18 +179,199 @@ static int delete_func(ILIST *i, void *data) {
 static struct {
     ILIST ilist, *i[INFONFD];
     TPBAR tpbar;
+    int sumrow;  /* row of the total over the labels, INT_MIN until shown */
+    int format;
+    int64_t tstart;  /* [usec] */
     size_t namelen;
     volatile sig_atomic_t *stop;
     pthread_t tid;
 } priv;
 
+static int64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Bytes host downloads in the label: the total the peer sent with 'T'
+ * once known, what the peer has prepared so far until then. */
+static intmax_t get_total(const ILIST *i, unsigned int host) {
+    return i->host[host ^ 1].total != -1 ? i->host[host ^ 1].total : i->host[host ^ 1].upload;
+}
+
+/* The peer sends 'T' again just before the transfer, which is when the
+ * throughput starts to count. */
+static void start_download(ILIST *i, unsigned int host, int64_t t) {
+    i->host[host].tfirst = i->host[host].tlast = t;
+    i->host[host].dfirst = i->host[host].dlast = i->host[host].download;
+}
+
+static void set_download(ILIST *i, unsigned int host, intmax_t download, int64_t t) {
+    if (i->host[host].tfirst == -1) {
+        i->host[host].tfirst = t;
+        i->host[host].dfirst = download;
+    }
+    i->host[host].tlast = t;
+    i->host[host].dlast = download;
+    i->host[host].download = download;
+}
+
+/* Seconds left for the download of host in the label at its average
+ * throughput so far, -1 while the throughput is unknown. */
+static double get_eta(const ILIST *i, unsigned int host) {
+    intmax_t left;
+
+    left = get_total(i, host) - i->host[host].download;
+    if (i->host[host].done || left <= 0)
+        return 0;
+    if (i->host[host].tfirst == -1 || i->host[host].dlast <= i->host[host].dfirst)
+        return -1;
+    return (double)left * (i->host[host].tlast - i->host[host].tfirst) /
+           (i->host[host].dlast - i->host[host].dfirst) / 1000000;
+}
+
+/* The longer of the two directions of the label. */
+static double get_eta_label(const ILIST *i) {
+    double eta, e;
+    unsigned int n;
+
+    eta = 0;
+    for (n = 0; n < INFONFD; ++n) {
+        e = get_eta(i, n);
+        if (e < 0)
+            return -1;
+        if (e > eta)
+            eta = e;
+    }
+    return eta;
+}
+
+static int str_cateta(STR *str, double eta) {
+    int status = -1;
+    long sec;
+
+    if (eta < 0) {
+        if (ISERR(str_catf(str, " %8s", "--:--:--")))
+            goto error;
+    }
+    else if (eta >= 100*60*60) {
+        if (ISERR(str_catf(str, " %8s", ">99h")))
+            goto error;
+    }
+    else {
+        sec = eta + 0.5;
+        if (ISERR(str_catf(str, " %2ld:%02ld:%02ld", sec / 3600, sec / 60 % 60, sec % 60)))
+            goto error;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+/* "[ downloaded / total ]" of host in the label, with the bar. */
+static int set_download_str(ILIST *i, unsigned int host) {
+    int status = -1;
+    intmax_t n1, n2;
+    STR buffer;
+    char str[64];
+
+    n1 = get_total(i, host);
+    n2 = i->host[host].download;
+    STR_INIT(buffer, str);
+    if (ISERR(str_cats(&buffer, "[", NULL)) ||
+        ISERR(str_catib(&buffer, 12, n2)) ||
+        ISERR(str_cats(&buffer, " /", NULL)) ||
+        ISERR(str_catib(&buffer, 12, n1)) ||
+        ISERR(str_cats(&buffer, " ]", NULL)) )
+        goto error;
+    STR_INIT(buffer, i->host[host].str);
+    if (ISERR(tpbar_printf(&buffer, n2, n1, &priv.tpbar, str)))
+        goto error;
+    status = 0;
+error:
+    return status;
+}
+
+/* Moves to row and clears it, a row a shorter line may be written over. */
+static int set_row(STR *str, int row) {
+    int status = -1;
+
+    if (ISERR(tpbar_setrow(str, row, &priv.tpbar)))
+        goto error;
+    if (priv.tpbar.ce)
+        if (ISERR(str_cats(str, priv.tpbar.ce, NULL)))
+            goto error;
+    status = 0;
+error:
+    return status;
+}
+
+/* A row for a new line, taking the place of the total over the labels
+ * which then moves one row down. */
+static int new_row(void) {
+    return priv.sumrow != INT_MIN ? priv.sumrow++ : tpbar_getrow(INT_MAX, &priv.tpbar);
+}
+
+/* The total over the labels started so far, shown below them once
+ * there are two. */
+static int str_catsum(STR *str) {
+    int status = -1;
+    unsigned int n;
+    intmax_t n1, n2;
+    ILIST *i;
+    double eta, e;
+    STR buffer;
+    char s[64];
+
+    if (priv.sumrow == INT_MIN) {
+        if (priv.ilist.next->next == &priv.ilist) {
+            status = 0;
+            goto error;
+        }
+        priv.sumrow = tpbar_getrow(INT_MAX, &priv.tpbar);
+    }
+    if (ISERR(set_row(str, priv.sumrow)))
+        goto error;
+    if (ISERR(str_catf(str, "%-*s", (int)priv.namelen, priv.namelen < 5 ? "*" : "Total")))
+        goto error;
+    eta = 0;
+    for (i = priv.ilist.next; *i->name; i = i->next) {  /* the labels run one after another */
+        e = get_eta_label(i);
+        if (eta >= 0)
+            eta = e < 0 ? -1 : eta + e;
+    }
+    for (n = 0; n < INFONFD; ++n) {
+        n1 = n2 = 0;
+        for (i = priv.ilist.next; *i->name; i = i->next) {
+            n1 += get_total(i, n);
+            n2 += i->host[n].download;
+        }
+        STR_INIT(buffer, s);
+        if (ISERR(str_cats(&buffer, "[", NULL)) ||
+            ISERR(str_catib(&buffer, 12, n2)) ||
+            ISERR(str_cats(&buffer, " /", NULL)) ||
+            ISERR(str_catib(&buffer, 12, n1)) ||
+            ISERR(str_cats(&buffer, " ]", NULL)) )
+            goto error;
+        if (ISERR(str_cats(str, " ", NULL)) ||
+            ISERR(tpbar_printf(str, n2, n1, &priv.tpbar, s)) )
+            goto error;
+    }
+    if (ISERR(str_cateta(str, eta)))
+        goto error;
+    status = 0;
+error:
+    return status;
+}
+
 static int info_print(unsigned int host, const char *line) {
     int status = INT_MIN;
     ILIST *i;
     int update;
     int seek;
     STR buffer;
-    char str[1024];
+    char str[2048];
     intmax_t n1, n2;
     char *s;
     unsigned int n;
@@ -198,12 +392,12 @@ static int info_print(unsigned int host, const char *line) {
         if (i) {
             LIST_SEEK_NEXT(i, line, seek);
             if (seek) {
-                i = add_ILIST(i, line, tpbar_getrow(INT_MAX, &priv.tpbar));
+                i = add_ILIST(i, line, new_row());
                 if (!i)
                     goto error;
                 for (n = 0; n < INFONFD; ++n) {
                     STR_INIT(buffer, i->host[n].str);
-                    if (ISERR(str_catf(&buffer, "[ %-25s ]", priv.ilist.host[n])))
+                    if (ISERR(str_catf(&buffer, "[ %-25s ]", priv.ilist.host[n].str)))
                         goto error;
                 }
                 update = 1;
@@ -212,6 +406,10 @@ static int info_print(unsigned int host, const char *line) {
         }
         break;
     case ']':
+        if (i && *i->name) {
+            i->host[host].done = true;
+            update = 1;
+        }
         break;
     case 'S':
         if (i) {
@@ -224,36 +422,28 @@ static int info_print(unsigned int host, const char *line) {
             }
         }
         break;
-    case 'U':
+    case 'T':
         if (i) {
-            n1 = i->host[host].upload = strtoll(line, NULL, 10);
-            n2 = i->host[host ^ 1].download;
-            STR_INIT(buffer, str);
-            if (ISERR(str_cats(&buffer, "[", NULL)) ||
-                ISERR(str_catib(&buffer, 12, n2)) ||
-                ISERR(str_cats(&buffer, " /", NULL)) ||
-                ISERR(str_catib(&buffer, 12, n1)) ||
-                ISERR(str_cats(&buffer, " ]", NULL)) )
+            i->host[host].total = strtoll(line, &s, 10);
+            i->host[host].files = strtoll(s, NULL, 10);
+            start_download(i, host ^ 1, now_usec());
+            if (ISERR(set_download_str(i, host ^ 1)))
                 break;
-            STR_INIT(buffer, i->host[host ^ 1].str);
-            if (ISERR(tpbar_printf(&buffer, n2, n1, &priv.tpbar, str)))
+            update = 1;
+        }
+        break;
+    case 'U':
+        if (i) {
+            i->host[host].upload = strtoll(line, NULL, 10);
+            if (ISERR(set_download_str(i, host ^ 1)))
                 break;
             update = 1;
         }
         break;
     case 'D':
         if (i) {
-            n1 = i->host[host ^ 1].upload;
-            n2 = i->host[host].download = strtoll(line, NULL, 10);
-            STR_INIT(buffer, str);
-            if (ISERR(str_cats(&buffer, "[", NULL)) ||
-                ISERR(str_catib(&buffer, 12, n2)) ||
-                ISERR(str_cats(&buffer, " /", NULL)) ||
-                ISERR(str_catib(&buffer, 12, n1)) ||
-                ISERR(str_cats(&buffer, " ]", NULL)) )
-                break;
-            STR_INIT(buffer, i->host[host].str);
-            if (ISERR(tpbar_printf(&buffer, n2, n1, &priv.tpbar, str)))
+            set_download(i, host, strtoll(line, NULL, 10), now_usec());
+            if (ISERR(set_download_str(i, host)))
                 break;
             update = 1;
         }
@@ -294,10 +484,10 @@ static int info_print(unsigned int host, const char *line) {
     switch (update) {
     case -1:
         STR_INIT(buffer, str);
-        if (ISERR(tpbar_setrow(&buffer, INT_MAX, &priv.tpbar)))
+        if (ISERR(set_row(&buffer, host < INFONFD ? new_row() : INT_MAX)))
             break;
         if (host < INFONFD) {
-            if (ISERR(str_cats(&buffer, priv.ilist.host[host], ": ", NULL)))
+            if (ISERR(str_cats(&buffer, priv.ilist.host[host].str, ": ", NULL)))
                 break;
             s = i->name;
             if (*s)
@@ -306,11 +496,14 @@ static int info_print(unsigned int host, const char *line) {
         }
         if (ISERR(str_cats(&buffer, line, NULL)))
             break;
+        if (host < INFONFD && priv.sumrow != INT_MIN)
+            if (ISERR(str_catsum(&buffer)))
+                break;
         write(STDOUT_FILENO, buffer.s, str_len(&buffer));
         break;
     case  1:
         STR_INIT(buffer, str);
-        if (ISERR(tpbar_setrow(&buffer, i->row, &priv.tpbar)))
+        if (ISERR(set_row(&buffer, i->row)))
             break;
         s = i->name;
         if (priv.tpbar.co > priv.namelen + 60) {
@@ -322,6 +515,11 @@ static int info_print(unsigned int host, const char *line) {
                     if (ISERR(str_cats(&buffer, " ", s, NULL)))
                         break;
             }
+            if (priv.tpbar.co > priv.namelen + 69) {  /* room for the ETA */
+                if (ISERR(str_cateta(&buffer, get_eta_label(i))) ||
+                    ISERR(str_catsum(&buffer)) )
+                    break;
+            }
         }
         else {
             if (ISERR(str_cats(&buffer, s, NULL)))
@@ -335,6 +533,160 @@ error:
     return status;
 }
 
+static int str_catq(STR *str, const char *s) {
+    int status = -1;
+    const char *e;
+
+    if (ISERR(str_cats(str, "\"", NULL)))
+        goto error;
+    while (*s) {
+        for (e = s; *e && *e != '"' && *e != '\\' && (unsigned char)*e >= 0x20; ++e);
+        if (e > s && ISERR(str_catf(str, "%.*s", (int)(e - s), s)))
+            goto error;
+        if (!*e)
+            break;
+        if (*e == '"' || *e == '\\') {
+            if (ISERR(str_catf(str, "\\%c", *e)))
+                goto error;
+        }
+        else if (ISERR(str_catf(str, "\\u%04x", (unsigned char)*e)))
+            goto error;
+        s = e + 1;
+    }
+    if (ISERR(str_cats(str, "\"", NULL)))
+        goto error;
+    status = 0;
+error:
+    return status;
+}
+
+/* The same lines as info_print() takes, written out as one JSON event
+ * each.  Download progress also gets the total the peer is going to
+ * upload, the throughput since the last and the first progress, and
+ * the ETA. */
+static int info_json(unsigned int host, const char *line) {
+    int status = INT_MIN;
+    ILIST *i;
+    int seek;
+    STR buffer;
+    char str[1024];
+    int64_t t;
+    intmax_t n1, n2;
+    double rate, average, eta;
+    char *s;
+
+    i = host < INFONFD ? priv.i[host] : NULL;
+    if (!i) {
+        status = 0;
+        goto error;
+    }
+    t = now_usec();
+    STR_INIT(buffer, str);
+    ONERR(str_catf(&buffer, "{\"time\":%.3f,\"host\":\"%s\"",
+                   (double)(t - priv.tstart) / 1000000, host ? "remote" : "local" ), 0);
+    switch (*line++) {
+    case '!':
+        n1 = 0;
+        switch (*line) {
+        case '+':
+        case '-':
+            n1 = strtol(line, NULL, 10);
+            line = strmes(n1);
+            break;
+        }
+        i->host[host].status = n1;
+        ONERR(str_cats(&buffer, ",\"event\":\"error\"", NULL), 0);
+        if (*i->name) {
+            ONERR(str_cats(&buffer, ",\"label\":", NULL), 0);
+            ONERR(str_catq(&buffer, i->name), 0);
+        }
+        ONERR(str_catf(&buffer, ",\"status\":%jd,\"message\":", n1), 0);
+        ONERR(str_catq(&buffer, line), 0);
+        break;
+    case '[':
+        LIST_SEEK_NEXT(i, line, seek);
+        if (seek) {
+            i = add_ILIST(i, line, 0);
+            if (!i)
+                goto error;
+        }
+        priv.i[host] = i;
+        ONERR(str_cats(&buffer, ",\"event\":\"start\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        break;
+    case ']':
+        i->host[host].done = true;
+        ONERR(str_cats(&buffer, ",\"event\":\"stop\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"status\":%d", i->host[host].status), 0);
+        break;
+    case 'S':
+        n1 = i->host[host].scan = strtoll(line, NULL, 10);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"scan\",\"files\":%jd", n1), 0);
+        break;
+    case 'U':
+        n1 = i->host[host].upload = strtoll(line, NULL, 10);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"prepare\",\"bytes\":%jd", n1), 0);
+        break;
+    case 'T':
+        n1 = i->host[host].total = strtoll(line, &s, 10);
+        n2 = i->host[host].files = strtoll(s, NULL, 10);
+        start_download(i, host ^ 1, t);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"total\",\"bytes\":%jd,\"files\":%jd", n1, n2), 0);
+        break;
+    case 'D':
+        n1 = get_total(i, host);
+        n2 = strtoll(line, NULL, 10);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"download\",\"bytes\":%jd,\"total\":%jd", n2, n1), 0);
+        if (i->host[host].tfirst == -1) {
+            set_download(i, host, n2, t);
+            ONERR(str_cats(&buffer, ",\"rate\":null,\"average\":null", NULL), 0);
+        }
+        else {
+            rate = t > i->host[host].tlast ?
+                   (double)(n2 - i->host[host].dlast) * 1000000 / (t - i->host[host].tlast) : 0;
+            set_download(i, host, n2, t);
+            average = t > i->host[host].tfirst ?
+                      (double)(n2 - i->host[host].dfirst) * 1000000 / (t - i->host[host].tfirst) : 0;
+            ONERR(str_catf(&buffer, ",\"rate\":%.0f,\"average\":%.0f", rate, average), 0);
+        }
+        eta = get_eta(i, host);
+        if (eta >= 0)
+            ONERR(str_catf(&buffer, ",\"eta\":%.0f", eta), 0);
+        else
+            ONERR(str_cats(&buffer, ",\"eta\":null", NULL), 0);
+        break;
+    case 'R':
+        n1 = i->host[host].remove = strtoll(line, NULL, 10);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"remove\",\"files\":%jd", n1), 0);
+        break;
+    case 'C':
+        n1 = i->host[host].copy = strtoll(line, NULL, 10);
+        ONERR(str_cats(&buffer, ",\"event\":\"progress\",\"label\":", NULL), 0);
+        ONERR(str_catq(&buffer, i->name), 0);
+        ONERR(str_catf(&buffer, ",\"phase\":\"copy\",\"files\":%jd", n1), 0);
+        break;
+    default:
+        status = 0;
+        goto error;
+    }
+    ONERR(str_cats(&buffer, "}\n", NULL), 0);
+    write(STDOUT_FILENO, buffer.s, str_len(&buffer));
+    status = 0;
+error:
+    return status;
+}
+
 static void *info_thread(void *data) {
     int *fd = data;
     unsigned int nfd;
@@ -343,7 +695,9 @@ static void *info_thread(void *data) {
     char buffer[1024];
     ssize_t size;
     char *s, *p;
+    int64_t t;
 
+    trace_thread("info");
     nfd = 0;
     for (n = 0; n < INFONFD; ++n)
         fds[n].fd = fd[n], fds[n].events = POLLIN, ++nfd;
@@ -376,21 +730,24 @@ static void *info_thread(void *data) {
                     fds[n].fd = -1, --nfd;
                     continue;
                 }
+                t = TRACE_BEGIN();
                 p = buffer;
                 while (p = memchr(s = p, INFOEOL, size), p)  {
                     *p++ = 0;
-                    if (ISERR(info_print(n, s)))
+                    if (ISERR(priv.format == INFO_JSON ? info_json(n, s) : info_print(n, s)))
                         goto error;
                     size -= p - s;
                 }
+                trace_span(t, "info", "print", NULL, -1);
             }
     }
-    info_print(UINT_MAX, "!");
+    if (priv.format != INFO_JSON)
+        info_print(UINT_MAX, "!");
 error:
     return NULL;
 }
 
-int info_start(int *fds, size_t namelen,
+int info_start(int *fds, size_t namelen, int format,
                volatile sig_atomic_t *stop ) {
     int status = INT_MIN;
     unsigned int n;
@@ -401,6 +758,8 @@ int info_start(int *fds, size_t namelen,
     for (n = 0; n < INFONFD; ++n)
         priv.i[n] = &priv.ilist;
     tpbar_init(&priv.tpbar);
+    priv.format = format;
+    priv.tstart = now_usec();
     priv.namelen = namelen;
     priv.stop = stop;
     if (pthread_create(&priv.tid, NULL, info_thread, fds) != 0) {
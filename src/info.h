@@ -1,4 +1,4 @@
-/* info.h - Last modified: 22-Mar-2026 (kobayasy)
+/* info.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2023-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -29,7 +29,10 @@
 #include <stddef.h>
 #include <signal.h>
 
-extern int info_start(int *fds, size_t namelen,
+#define INFO_TEXT 0  /* progress bars on the terminal */
+#define INFO_JSON 1  /* one JSON event per line */
+
+extern int info_start(int *fds, size_t namelen, int format,
                       volatile sig_atomic_t *stop );
 extern int info_stop(void);
 
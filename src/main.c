@@ -1,4 +1,4 @@
-/* main.c - Last modified: 22-Mar-2026 (kobayasy)
+/* main.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -30,14 +30,22 @@
 #include <ctype.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "common.h"
 #include "psync_psp.h"
 #include "popen3.h"
+#include "session.h"
+#include "record.h"
+#include "trace.h"
 #include "info.h"
 
 #ifndef PACKAGE_STRING
@@ -58,6 +66,13 @@
 #ifndef SSHPORT
 #define SSHPORT 22
 #endif  /* #ifndef SSHPORT */
+#ifndef SSHSESSIONOPTS
+#define SSHSESSIONOPTS "-oControlMaster=auto -oControlPath=~/.ssh/"PACKAGE_TARNAME"-%%C -oControlPersist=%u"
+#endif  /* #ifndef SSHSESSIONOPTS */
+#ifndef SESSION_TIMEOUT
+#define SESSION_TIMEOUT 600  /* [sec] */
+#endif  /* #ifndef SESSION_TIMEOUT */
+#define SESSIONSOCK "."PACKAGE_TARNAME"-%c%c%c%u.sock"
 
 #define ERROR_ENVS (-26)
 #define ERROR_CONF (-27)
@@ -66,8 +81,10 @@
 static struct {
     volatile sig_atomic_t stop;
     size_t namelen;
+    pid_t pid;  /* of the child run_detached() waits for */
 } priv = {
-    .stop = 0
+    .stop = 0,
+    .pid = -1
 };
 
 typedef struct {
@@ -138,9 +155,15 @@ static void sighandler(int signo) {
     priv.stop = 1;
 }
 
+static void sigforward(int signo) {
+    if (priv.pid > 0)
+        kill(priv.pid, signo);
+}
+
 typedef struct {
     PSP *psp;
     bool verbose;
+    int format;
 } RUN_PARAM;
 
 static int run_local(int fdin, int fdout, int info, pid_t pid, void *data) {
@@ -159,7 +182,7 @@ static int run_local(int fdin, int fdout, int info, pid_t pid, void *data) {
         infos[0] = info_pipe[0];
         infos[1] = info;
         param->psp->info = info_pipe[1];
-        ONERR(info_start(infos, priv.namelen, &priv.stop), ERROR_SYSTEM);
+        ONERR(info_start(infos, priv.namelen, param->format, &priv.stop), ERROR_SYSTEM);
     }
     sigactinit(&oldact);
     ONERR(sigactset(sighandler, &oldact), ERROR_SYSTEM);
@@ -198,60 +221,6 @@ error:
     return status;
 }
 
-#define ARGVTOK " \t\r\n"
-static int run(PSP *psp, bool verbose, char *hostname) {
-    int status = INT_MIN;
-    RUN_PARAM param = {
-        .psp = psp,
-        .verbose = verbose
-    };
-    signed long port;
-    char opts[128];
-    unsigned int argc;
-    char *argv[64];
-    char *s, *p;
-
-    if (hostname) {
-        s = strchr(hostname, '@');
-        if (s)
-            ++s;
-        else
-            s = hostname;
-        s = strrchr(s, '#');
-        if (s) {
-            *s++ = 0;
-            if (!*s) {
-                status = ERROR_ARGS;
-                goto error;
-            }
-            port = strtol(s, &p, 10);
-            if (*p) {
-                status = ERROR_ARGS;
-                goto error;
-            }
-        }
-        else
-            port = SSHPORT;
-        if (port < 0 || port > 65535) {
-            status = ERROR_ARGS;
-            goto error;
-        }
-        snprintf(opts, sizeof(opts), SSHOPTS, (unsigned int)port);
-        argc = 0;
-        argv[argc++] = SSH;
-        for (s = strtok(opts, ARGVTOK); s; s = strtok(NULL, ARGVTOK))
-            argv[argc++] = s;
-        argv[argc++] = hostname;
-        argv[argc++] = PACKAGE_TARNAME" --remote";
-        argv[argc] = NULL;
-        status = popen3(argv, run_local, &param);
-    }
-    else
-        status = run_remote(STDOUT_FILENO, STDIN_FILENO, STDERR_FILENO, 0, &param);
-error:
-    return status;
-}
-
 static char *strtrim(char *str) {
     char *s;
 
@@ -263,10 +232,36 @@ static char *strtrim(char *str) {
     return str;
 }
 
+/* "HH:MM" to minutes of the day, NULL when not a valid time */
+static char *strtomin(char *s, int *minute) {
+    char *p;
+    unsigned long hour, min;
+
+    hour = strtoul(s, &p, 10);
+    if (p == s || *p != ':' || hour > 23)
+        return NULL;
+    s = p + 1;
+    min = strtoul(s, &p, 10);
+    if (p == s || min > 59)
+        return NULL;
+    *minute = hour * 60 + min;
+    return p;
+}
+
 #define CONFEOL '\n'
 #define CONFREM '#'
 #define CONFVAR '='
 static int get_config(const char *confname, PSP *psp) {
+    static const char *fsyncs[] = {
+        [FSYNC_NONE]  = "none",
+        [FSYNC_BATCH] = "batch",
+        [FSYNC_FILE]  = "file"
+    };
+    static const char *orders[] = {
+        [ORDER_NAME] = "name",
+        [ORDER_SIZE] = "size",
+        [ORDER_NEW]  = "new"
+    };
     int status = INT_MIN;
     size_t length = 0;
     FILE *fp = NULL;
@@ -277,6 +272,7 @@ static int get_config(const char *confname, PSP *psp) {
     char *name, *dirname, *s, *p;
     char pathname[PATH_MAX];
     size_t l;
+    int n;
 
     fp = fopen(confname, "r");
     if (!fp) {
@@ -316,6 +312,46 @@ static int get_config(const char *confname, PSP *psp) {
                 head->expire = strtoul(s, &p, 10) * 60*60*24;
             else if (!strcmp(name, "backup"))
                 head->backup = strtoul(s, &p, 10) * 60*60*24;
+            else if (!strcmp(name, "scancache"))
+                head->scancache = strtoul(s, &p, 10) * 60*60*24;
+            else if (!strcmp(name, "bwlimit")) {
+                head->bwlimit = strtoul(s, &p, 10) * 1024;
+                head->bwbegin = 0, head->bwend = 0;
+                if (*p == '@') {
+                    p = strtomin(p + 1, &head->bwbegin);
+                    if (p && *p == '-')
+                        p = strtomin(p + 1, &head->bwend);
+                    else
+                        p = NULL;
+                }
+            }
+            else if (!strcmp(name, "buffer"))
+                head->buffer = strtoul(s, &p, 10) * 1024;
+            else if (!strcmp(name, "direct"))
+                head->direct = (off_t)strtoul(s, &p, 10) * 1024*1024;
+            else if (!strcmp(name, "dedup"))
+                head->dedup = (off_t)strtoul(s, &p, 10) * 1024*1024;
+            else if (!strcmp(name, "priority")) {
+                if (strlen(s) < sizeof(head->priority)) {
+                    strcpy(head->priority, s);
+                    p = s + strlen(s);
+                }
+            }
+            else if (!strcmp(name, "order")) {
+                for (n = 0; n < sizeof(orders)/sizeof(*orders); ++n)
+                    if (!strcmp(s, orders[n])) {
+                        head->order = n;
+                        p = s + strlen(s);
+                        break;
+                    }
+            }
+            else if (!strcmp(name, "fsync"))
+                for (n = 0; n < sizeof(fsyncs)/sizeof(*fsyncs); ++n)
+                    if (!strcmp(s, fsyncs[n])) {
+                        head->fsync = n;
+                        p = s + strlen(s);
+                        break;
+                    }
             if (!p || *p) {
                 fprintf(stderr, "Error: Line %u in \"~/%s\": Invalid parameter \"%s%c%s\".\n", line, confname, name, CONFVAR, s);
                 status = ERROR_CONF;
@@ -355,19 +391,246 @@ error:
     return status;
 }
 
+static int serve_session(const int fds[3], void *data) {
+    int status = INT_MIN;
+    RUN_PARAM param = {
+        .psp = NULL,
+        .verbose = true,
+        .format = INFO_TEXT
+    };
+    int fd;
+
+    priv.stop = 0;
+    dup2(fds[2], STDERR_FILENO);
+    param.psp = psp_new(&priv.stop);
+    if (!param.psp) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    status = get_config(CONFFILE, param.psp);  /* re-read, it may have been edited */
+    if (ISERR(status))
+        goto error;
+    status = run_remote(fds[1], fds[0], fds[2], 0, &param);
+error:
+    if (param.psp)
+        psp_free(param.psp);
+    fd = open("/dev/null", O_WRONLY);
+    if (fd != -1)
+        dup2(fd, STDERR_FILENO), close(fd);
+    return status;
+}
+
+/* Run this --remote through a session server of the same protocol,
+ * starting one when none is running.  The server stays until it is idle
+ * for timeout seconds, so later runs skip its startup. */
+static int run_session(RUN_PARAM *param, unsigned int timeout) {
+    int status = INT_MIN;
+    const int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char sockname[64];
+    int fd = -1, fdnull;
+    pid_t pid;
+
+    snprintf(sockname, sizeof(sockname), SESSIONSOCK, PSYNC_PROTID, PSYNC_PROTID >> 8, PSYNC_PROTID >> 16, PSYNC_PROTID >> 24);
+    fd = session_connect(sockname);
+    if (fd == -1) {
+        fd = session_listen(sockname);
+        if (fd != -1) {
+            pid = fork();
+            switch (pid) {
+            case -1:
+                status = ERROR_SYSTEM;
+                goto error;
+            case 0:  /* server, detached from this session */
+                setsid();
+                signal(SIGPIPE, SIG_IGN);
+                fdnull = open("/dev/null", O_RDWR);
+                if (fdnull != -1) {
+                    dup2(fdnull, STDIN_FILENO);
+                    dup2(fdnull, STDOUT_FILENO);
+                    dup2(fdnull, STDERR_FILENO);
+                    close(fdnull);
+                }
+                status = session_serve(fd, sockname, timeout, serve_session, NULL);
+                psync_clean_wait();
+                _exit(status == -1 ? 1 : 0);
+            }
+            close(fd);
+        }
+        fd = session_connect(sockname);
+        if (fd == -1) {  /* no server, run the session here */
+            status = run_remote(STDOUT_FILENO, STDIN_FILENO, STDERR_FILENO, 0, param);
+            goto error;
+        }
+    }
+    if (session_call(fd, fds, &status) == -1)
+        status = ERROR_SYSTEM;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+#define ARGVTOK " \t\r\n"
+static int run(PSP *psp, bool verbose, int format, char *hostname, unsigned int session) {
+    int status = INT_MIN;
+    RUN_PARAM param = {
+        .psp = psp,
+        .verbose = verbose,
+        .format = format
+    };
+    signed long port;
+    char opts[128], sopts[256], command[64];
+    unsigned int argc;
+    char *argv[64];
+    char *s, *p;
+
+    if (hostname) {
+        s = strchr(hostname, '@');
+        if (s)
+            ++s;
+        else
+            s = hostname;
+        s = strrchr(s, '#');
+        if (s) {
+            *s++ = 0;
+            if (!*s) {
+                status = ERROR_ARGS;
+                goto error;
+            }
+            port = strtol(s, &p, 10);
+            if (*p) {
+                status = ERROR_ARGS;
+                goto error;
+            }
+        }
+        else
+            port = SSHPORT;
+        if (port < 0 || port > 65535) {
+            status = ERROR_ARGS;
+            goto error;
+        }
+        snprintf(opts, sizeof(opts), SSHOPTS, (unsigned int)port);
+        argc = 0;
+        argv[argc++] = SSH;
+        if (session) {  /* keep the connection for the next runs */
+            snprintf(sopts, sizeof(sopts), SSHSESSIONOPTS, session);
+            for (s = strtok(sopts, ARGVTOK); s; s = strtok(NULL, ARGVTOK))
+                argv[argc++] = s;
+        }
+        for (s = strtok(opts, ARGVTOK); s; s = strtok(NULL, ARGVTOK))
+            argv[argc++] = s;
+        argv[argc++] = hostname;
+        if (session) {
+            snprintf(command, sizeof(command), PACKAGE_TARNAME" --remote --session=%u", session);
+            argv[argc++] = command;
+        }
+        else
+            argv[argc++] = PACKAGE_TARNAME" --remote";
+        argv[argc] = NULL;
+        status = popen3(argv, run_local, &param);
+    }
+    else if (session)
+        status = run_session(&param, session);
+    else
+        status = run_remote(STDOUT_FILENO, STDIN_FILENO, STDERR_FILENO, 0, &param);
+error:
+    return status;
+}
+
+static int open_trace(int fd, const char *pathname) {
+    int status = INT_MIN;
+
+    if (trace_open(fd)) {
+        fprintf(stderr, "Error: Can not write %s\n", pathname);
+        status = ERROR_SYSTEM;  /* not ERROR_ARGS, reported as the PORT by main() */
+        goto error;
+    }
+    trace_thread("main");
+    status = 0;
+error:
+    return status;
+}
+
+/* run() in a child process, returning its status as soon as the sync is
+ * done.  The child then leaves the terminal or the SSH session and waits
+ * there for the removal of expired backups, so that neither the caller
+ * nor the peer waits for it.  The trace on fdtrace, if any, is opened and
+ * closed by the child only, so that it is written by one process. */
+static int run_detached(PSP *psp, bool verbose, int format, char *hostname, unsigned int session,
+                        int fdtrace, const char *trace ) {
+    int status = INT_MIN;
+    int fds[2] = {-1, -1};
+    int32_t result;
+    ssize_t n;
+    int fdnull;
+    SIGACT oldact;
+
+    sigactinit(&oldact);
+    if (pipe(fds) == -1) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    priv.pid = fork();
+    switch (priv.pid) {
+    case -1:
+        status = ERROR_SYSTEM;
+        goto error;
+    case 0:
+        close(fds[0]), fds[0] = -1;
+        status = fdtrace != -1 ? open_trace(fdtrace, trace) : 0;
+        if (!ISERR(status))
+            status = run(psp, verbose, format, hostname, session);
+        result = status;
+        while (write(fds[1], &result, sizeof(result)) == -1 && errno == EINTR);
+        setsid();
+        fdnull = open("/dev/null", O_RDWR);
+        if (fdnull != -1) {
+            dup2(fdnull, STDIN_FILENO);
+            dup2(fdnull, STDOUT_FILENO);
+            dup2(fdnull, STDERR_FILENO);
+            close(fdnull);
+        }
+        psync_clean_wait();
+        goto error;
+    }
+    close(fds[1]), fds[1] = -1;
+    ONERR(sigactset(sigforward, &oldact), ERROR_SYSTEM);
+    while ((n = read(fds[0], &result, sizeof(result))) == -1 && errno == EINTR);
+    if (n == sizeof(result))
+        status = result;
+    else {  /* ended without a status */
+        waitpid(priv.pid, NULL, 0);
+        status = ERROR_SYSTEM;
+    }
+error:
+    sigactreset(&oldact);
+    if (fds[1] != -1)
+        close(fds[1]);
+    if (fds[0] != -1)
+        close(fds[0]);
+    return status;
+}
+
 typedef struct {
     enum {
         RUN=0,
+        RECORD,
         USAGE
     } command;
     char *hostname;
     bool verbose;
+    int format;
+    bool plan;
+    unsigned int session;
+    char *stats;
+    char *trace;
 } OPTS;
 
 static int get_opts(char *argv[], OPTS *opts) {
     int status = INT_MIN;
     bool remote = false;
-    char *s;
+    char *s, *p;
 
     while (*++argv)
         switch (**argv) {
@@ -382,12 +645,46 @@ static int get_opts(char *argv[], OPTS *opts) {
                 ++s;
                 if (!strcmp(s, "help"))
                     opts->command = USAGE;
+                else if (!strcmp(s, "record"))
+                    opts->command = RECORD;
                 else if (!strcmp(s, "remote"))
                     remote = true;
                 else if (!strcmp(s, "verbose"))
                     opts->verbose = true;
                 else if (!strcmp(s, "quiet"))
                     opts->verbose = false;
+                else if (!strcmp(s, "progress=bar"))
+                    opts->verbose = true, opts->format = INFO_TEXT;
+                else if (!strcmp(s, "progress=json"))
+                    opts->verbose = true, opts->format = INFO_JSON;
+                else if (!strcmp(s, "plan"))
+                    opts->verbose = false, opts->plan = true;
+                else if (!strcmp(s, "session"))
+                    opts->session = SESSION_TIMEOUT;
+                else if (!strncmp(s, "session=", 8)) {
+                    opts->session = strtoul(s + 8, &p, 10);
+                    if (!s[8] || *p) {
+                        fprintf(stderr, "Error: Invalid option: %s\n", *argv);
+                        status = ERROR_ARGS;
+                        goto error;
+                    }
+                }
+                else if (!strncmp(s, "stats=", 6)) {
+                    opts->stats = s + 6;
+                    if (!*opts->stats) {
+                        fprintf(stderr, "Error: Invalid option: %s\n", *argv);
+                        status = ERROR_ARGS;
+                        goto error;
+                    }
+                }
+                else if (!strncmp(s, "trace=", 6)) {
+                    opts->trace = s + 6;
+                    if (!*opts->trace) {
+                        fprintf(stderr, "Error: Invalid option: %s\n", *argv);
+                        status = ERROR_ARGS;
+                        goto error;
+                    }
+                }
                 else {
                     fprintf(stderr, "Error: Invalid option: %s\n", *argv);
                     status = ERROR_ARGS;
@@ -436,6 +733,13 @@ static int get_opts(char *argv[], OPTS *opts) {
             }
         }
         break;
+    case RECORD:
+        if (opts->hostname) {
+            fprintf(stderr, "Error: HOST is not required\n");
+            status = ERROR_ARGS;
+            goto error;
+        }
+        break;
     default:
         ;
     }
@@ -444,12 +748,49 @@ error:
     return status;
 }
 
+static int record(PSP *psp) {
+    int status = INT_MIN;
+    SIGACT oldact;
+
+    sigactinit(&oldact);
+    ONERR(sigactset(sighandler, &oldact), ERROR_SYSTEM);
+    status = psp_record(psp);
+    sigactreset(&oldact);
+    switch (status) {
+    case RECORD_ERROR_LOCK:
+        fprintf(stderr, "Error: Already recording.\n");
+        break;
+    case RECORD_ERROR_WATCH:
+        fprintf(stderr, "Error: Too many directories to watch.\n");
+        break;
+    case RECORD_ERROR_SYSTEM:
+        fprintf(stderr, "Error: Recording is not supported.\n");
+        break;
+    default:
+        if (ISERR(status))
+            fprintf(stderr, "Error: Can not record changes.\n");
+    }
+error:
+    return status;
+}
+
+static int open_output(const char *filename) {
+    int fd;
+
+    fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if (fd == -1)
+        fprintf(stderr, "Error: Can not open %s\n", filename);
+    return fd;
+}
+
 static int usage(FILE *fp) {
     int status = INT_MIN;
 
     fprintf(fp, PACKAGE_STRING" (protocol %c%c%c%u)\n"
                 "\n", PSYNC_PROTID, PSYNC_PROTID >> 8, PSYNC_PROTID >> 16, PSYNC_PROTID >> 24 );
-    fprintf(fp, "Usage: "PACKAGE_TARNAME" [-v|-q] [USER@]HOST[#PORT]\n"
+    fprintf(fp, "Usage: "PACKAGE_TARNAME" [-v|-q] [--progress=bar|json] [--plan] [--session[=SECONDS]]\n"
+                "             [--stats=FILE] [--trace=FILE] [USER@]HOST[#PORT]\n"
+                "       "PACKAGE_TARNAME" --record\n"
                 "       "PACKAGE_TARNAME" --help\n"
                 "\n" );
     fprintf(fp, "USER@HOST#PORT\n"
@@ -460,8 +801,22 @@ static int usage(FILE *fp) {
     fprintf(fp, "options\n"
                 "  -v, --verbose  verbose mode (default)\n"
                 "  -q, --quiet    quiet mode\n"
-                "\n" );
+                "  --progress=bar|json\n"
+                "                 show the progress as bars (default) or write it\n"
+                "                 to stdout as JSON lines, both in verbose mode\n"
+                "  --plan         only report what a sync would transfer, remove and\n"
+                "                 back up for each label, and how long it would take\n"
+                "  --session[=SECONDS]\n"
+                "                 keep the SSH connection and a remote server for\n"
+                "                 SECONDS idle (default: %u) to speed up later runs\n"
+                "  --stats=FILE   write the time and the counters of each phase of\n"
+                "                 each label to FILE as JSON lines\n"
+                "  --trace=FILE   write what each thread is doing and waiting for\n"
+                "                 to FILE in the Trace Event format\n"
+                "\n", SESSION_TIMEOUT );
     fprintf(fp, "subcommand\n"
+                "  --record       record changed directories until stopped, to speed\n"
+                "                 up the scan of directories with scancache=\n"
                 "  --help         show this help\n"
                 "\n" );
     status = 0;
@@ -474,10 +829,29 @@ int main(int argc, char *argv[]) {
     OPTS opts = {
         .command = RUN,
         .verbose = true,
-        .hostname = NULL
+        .format = INFO_TEXT,
+        .hostname = NULL,
+        .plan = false,
+        .session = 0,
+        .stats = NULL,
+        .trace = NULL
     };
+    int fd = -1, fdtrace = -1;
     char *s;
 
+    status = get_opts(argv, &opts);
+    if (ISERR(status))
+        goto error;
+    if (opts.command == RUN) {  /* before leaving the current directory */
+        if (opts.stats && ISERR(fd = open_output(opts.stats))) {
+            status = ERROR_ARGS;
+            goto error;
+        }
+        if (opts.trace && ISERR(fdtrace = open_output(opts.trace))) {
+            status = ERROR_ARGS;
+            goto error;
+        }
+    }
     s = getenv("HOME");
     if (!s) {
         fprintf(stderr, "Error: $HOME is not set.\n");
@@ -499,18 +873,22 @@ int main(int argc, char *argv[]) {
     if (ISERR(status))
         goto error;
     priv.namelen = status;
-    status = get_opts(argv, &opts);
-    if (ISERR(status))
-        goto error;
+    psp->stats = fd;
+    if (opts.plan)
+        psp->plan = STDOUT_FILENO;
     switch (opts.command) {
     case RUN:
-        status = run(psp, opts.verbose, opts.hostname);
+        status = run_detached(psp, opts.verbose, opts.format, opts.hostname, opts.session,
+                              fdtrace, opts.trace );
         switch (status) {
         case ERROR_ARGS:
             fprintf(stderr, "Error: PORT is invalid.\n");
             break;
         }
         break;
+    case RECORD:
+        status = record(psp);
+        break;
     case USAGE:
     default:
         status = usage(stdout);
@@ -518,6 +896,12 @@ int main(int argc, char *argv[]) {
 error:
     if (psp)
         psp_free(psp);
+    if (fdtrace != -1) {
+        trace_close();  /* by the child of run_detached(), where it was opened */
+        close(fdtrace);
+    }
+    if (fd != -1)
+        close(fd);
     if (ISERR(status))
         status = status < -255 ? 255 : -status;
     else
@@ -1,4 +1,4 @@
-/* progress.c - Last modified: 14-Feb-2026 (kobayasy)
+/* progress.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -27,30 +27,87 @@
 #include <config.h>
 #endif  /* #ifdef HAVE_CONFIG_H */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include "progress.h"
 
-#define DIFFTS(_now, _last) \
-    ((long)((_now).tv_sec  - (_last).tv_sec)  *    1000 + \
-           ((_now).tv_nsec - (_last).tv_nsec) / 1000000 )
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#define PROGRESS_CLOCK CLOCK_MONOTONIC
+#else  /* #ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK */
+#define PROGRESS_CLOCK CLOCK_REALTIME
+#endif  /* #ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK */
+
+#define ADDTS(_ts, _msec) do { \
+    (_ts).tv_sec  += (_msec) / 1000; \
+    (_ts).tv_nsec += (_msec) % 1000 * 1000000; \
+    if ((_ts).tv_nsec >= 1000000000) \
+        ++(_ts).tv_sec, (_ts).tv_nsec -= 1000000000; \
+} while (0)
+
+/* Ticker: samples the counter every interval and writes it when it has
+ * changed, so that progress_update() is only an atomic add. */
+static void *progress_thread(void *data) {
+    PROGRESS *progress = data;
+    struct timespec next;
+    intmax_t update;
+
+    pthread_mutex_lock(&progress->mutex);
+    clock_gettime(PROGRESS_CLOCK, &next);
+    ADDTS(next, progress->interval);
+    while (!progress->stop)
+        if (pthread_cond_timedwait(&progress->cond, &progress->mutex, &next) == ETIMEDOUT) {
+            update = __atomic_load_n(&progress->update, __ATOMIC_RELAXED);
+            if (update != progress->data) {
+                dprintf(progress->fd, progress->format, update);
+                progress->data = update;
+            }
+            ADDTS(next, progress->interval);
+        }
+    pthread_mutex_unlock(&progress->mutex);
+    return NULL;
+}
 
 int progress_init(PROGRESS *progress, intmax_t update,
                   int fd, unsigned long interval, char id ) {
     int status = -1;
-    struct timespec now;
+    pthread_condattr_t attr;
 
     progress->fd = fd;
     if (progress->fd != -1) {
         progress->interval = interval;
         sprintf(progress->format, "%c%%+jd\n", id);
         progress->update = update;
-        if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+        progress->data = progress->update;
+        progress->stop = false;
+        if (pthread_mutex_init(&progress->mutex, NULL) != 0) {
+            progress->fd = -1;
+            goto error;
+        }
+        if (pthread_condattr_init(&attr) != 0) {
+            pthread_mutex_destroy(&progress->mutex);
+            progress->fd = -1;
+            goto error;
+        }
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+        pthread_condattr_setclock(&attr, PROGRESS_CLOCK);
+#endif  /* #ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK */
+        if (pthread_cond_init(&progress->cond, &attr) != 0) {
+            pthread_condattr_destroy(&attr);
+            pthread_mutex_destroy(&progress->mutex);
+            progress->fd = -1;
+            goto error;
+        }
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&progress->tid, NULL, progress_thread, progress) != 0) {
+            pthread_cond_destroy(&progress->cond);
+            pthread_mutex_destroy(&progress->mutex);
             progress->fd = -1;
             goto error;
         }
-        progress->data = progress->update, progress->last = now;
     }
     status = 0;
 error:
@@ -58,29 +115,24 @@ error:
 }
 
 int progress_update(PROGRESS *progress, intmax_t update) {
-    int status = -1;
-    struct timespec now;
-
-    if (progress->fd != -1) {
-        progress->update += update;
-        if (progress->update != progress->data) {
-            if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-                goto error;
-            if (DIFFTS(now, progress->last) >= progress->interval) {
-                dprintf(progress->fd, progress->format, progress->update);
-                progress->data = progress->update, progress->last = now;
-            }
-        }
-    }
-    status = 0;
-error:
-    return status;
+    if (progress->fd != -1)
+        __atomic_add_fetch(&progress->update, update, __ATOMIC_RELAXED);
+    return 0;
 }
 
+/* Stops the ticker and writes the last count.  Safe to call again, and
+ * after a failed progress_init(). */
 int progress_term(PROGRESS *progress) {
     int status = -1;
 
     if (progress->fd != -1) {
+        pthread_mutex_lock(&progress->mutex);
+        progress->stop = true;
+        pthread_cond_signal(&progress->cond);
+        pthread_mutex_unlock(&progress->mutex);
+        pthread_join(progress->tid, NULL);
+        pthread_cond_destroy(&progress->cond);
+        pthread_mutex_destroy(&progress->mutex);
         if (progress->update != progress->data)
             dprintf(progress->fd, progress->format, progress->update);
         progress->fd = -1;
@@ -1,4 +1,4 @@
-/* progress.h - Last modified: 14-Feb-2026 (kobayasy)
+/* progress.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -26,15 +26,19 @@
 #ifndef _INCLUDE_progress_h
 #define _INCLUDE_progress_h
 
+#include <stdbool.h>
 #include <stdint.h>
-#include <time.h>
+#include <pthread.h>
 
 typedef struct {
     int fd;
     unsigned long interval;
     char format[7];
     intmax_t update, data;
-    struct timespec last;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t tid;
 } PROGRESS;
 
 extern int progress_init(PROGRESS *progress, intmax_t update,
@@ -1,4 +1,4 @@
-/* psync.c - Last modified: 07-Mar-2026 (kobayasy)
+/* psync.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -26,7 +26,11 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif  /* #ifdef HAVE_CONFIG_H */
+#if defined(HAVE_SYNCFS) || defined(HAVE_SYNC_FILE_RANGE)
+#define _GNU_SOURCE
+#endif  /* #if defined(HAVE_SYNCFS) || defined(HAVE_SYNC_FILE_RANGE) */
 
+#include <errno.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -38,17 +42,60 @@
 #include <time.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif  /* #ifdef HAVE_LINUX_FS_H */
 #include "common.h"
 #include "progress.h"
+#include "batch.h"
+#include "chunk.h"
+#include "ratelimit.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
 #include "psync.h"
 
 #ifndef LOADBUFFER_SIZE
 #define LOADBUFFER_SIZE (16*1024)  /* [byte] */
 #endif  /* #ifndef LOADBUFFER_SIZE */
+#define DIRECT_ALIGN 4096  /* [byte] */
+#ifndef PLAN_PROBE
+#define PLAN_PROBE (1024*1024)  /* [byte] sent each way to measure the link for a plan */
+#endif  /* #ifndef PLAN_PROBE */
+#define HUGEPAGE_SIZE (2*1024*1024)  /* [byte] */
+#ifndef CHUNK_FILEMIN
+#define CHUNK_FILEMIN (64*1024)  /* [byte] */
+#endif  /* #ifndef CHUNK_FILEMIN */
+#ifndef SCAN_THREADS
+#define SCAN_THREADS 4  /* [thread] */
+#endif  /* #ifndef SCAN_THREADS */
+#ifndef CLEAN_BUDGET
+#define CLEAN_BUDGET 60  /* [sec] spent at most on the expired backups of a sync directory per run */
+#endif  /* #ifndef CLEAN_BUDGET */
+#ifdef SYS_ioprio_set
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_IDLE (3 << 13)  /* IOPRIO_CLASS_IDLE, the cleaner only uses an idle disk */
+#endif  /* #ifdef SYS_ioprio_set */
+#define SCAN_PARALLEL 64  /* [entry] stat a listed directory in parallel from this many entries */
+#ifndef RECORD_WAIT
+#define RECORD_WAIT 1000  /* [msec] for the recorder to catch up with a scan */
+#endif  /* #ifndef RECORD_WAIT */
+#ifndef SEEK_HOLE  /* no hole detection: every file is one data segment */
+#define SEEK_DATA SEEK_SET
+#define SEEK_HOLE SEEK_END
+#endif  /* #ifndef SEEK_HOLE */
+#ifndef O_DIRECT  /* no O_DIRECT: every file goes through the page cache */
+#define O_DIRECT 0
+#endif  /* #ifndef O_DIRECT */
 #ifdef _INCLUDE_progress_h
 #ifndef PROGRESS_INTERVAL
 #define PROGRESS_INTERVAL 1000  /* [msec] */
@@ -89,31 +136,49 @@ typedef struct {
     time_t mtime;
     mode_t mode;
     off_t size;
+    dev_t dev;
+    ino_t ino;
     uint8_t flags;
 } FST;
 typedef struct s_flist {
     struct s_flist *next, *prev;
+    struct s_flist *move;
+    CHUNKS *chunks;
+    off_t tail;
     FST st;
+    size_t length;
+    size_t lcp;
     char name[1];
 } FLIST;
 
 static FLIST *new_FLIST(FLIST *flist) {
     LIST_NEW(flist);
+    flist->move = NULL;
+    flist->chunks = NULL;
+    flist->tail = 0;
     memset(&flist->st, 0, sizeof(flist->st));
+    flist->length = 0;
+    flist->lcp = LCP_NONE;
     return flist;
 }
 
 static FLIST *add_FLIST(FLIST *flist, const char *name) {
     FLIST *fnew = NULL;
+    size_t length;
 
     if (!*name)
         goto error;
-    fnew = malloc(offsetof(FLIST, name) + strlen(name) + 1);
+    length = strlen(name);
+    fnew = malloc(offsetof(FLIST, name) + length + 1);
     if (!fnew)
         goto error;
-    strcpy(fnew->name, name);
+    memcpy(fnew->name, name, length + 1);
+    fnew->move = NULL;
+    fnew->chunks = NULL;
+    fnew->tail = 0;
     memset(&fnew->st, 0, sizeof(fnew->st));
-    LIST_INSERT_NEXT(fnew, flist);
+    fnew->length = length;
+    LIST_INSERT_NEXT_LCP(fnew, flist);
 error:
     return fnew;
 }
@@ -122,7 +187,11 @@ static each_next(FLIST)
 
 static sets_next(FLIST)
 
-static int write_FLIST(bool synced, FLIST *flist, int fd,
+static sets_next_lcp(FLIST)
+
+static sets_next_auto(FLIST)
+
+static int write_FLIST(bool synced, bool inode, FLIST *flist, int fd,
                        volatile sig_atomic_t *stop ) {
     int status = INT_MIN;
     size_t length, n;
@@ -145,6 +214,10 @@ static int write_FLIST(bool synced, FLIST *flist, int fd,
         WRITE_ONERR(st.revision, fd, write_size, -1);
         WRITE_ONERR(st.mtime, fd, write_size, -1);
         WRITE_ONERR(st.mode, fd, write_size, -1);
+        if (inode) {
+            WRITE_ONERR(st.dev, fd, write_size, -1);
+            WRITE_ONERR(st.ino, fd, write_size, -1);
+        }
         if (synced) {
             WRITE_ONERR(st.size, fd, write_size, -1);
             st.flags = st.flags >> 4 | st.flags << 4;
@@ -158,10 +231,11 @@ error:
     return status;
 }
 
-static int read_FLIST(bool synced, FLIST *flist, int fd,
+static int read_FLIST(bool synced, bool inode, FLIST *flist, int fd,
                       volatile sig_atomic_t *stop ) {
     int status = INT_MIN;
     size_t length;
+    int count;
     char dirname[PATH_MAX];
 
     ONSTOP(stop, -1);
@@ -169,6 +243,7 @@ static int read_FLIST(bool synced, FLIST *flist, int fd,
         status = -1;
         goto error;
     }
+    count = 0;
     READ_ONERR(length, fd, read_size, -1);
     while (length > 0) {
         ONSTOP(stop, -1);
@@ -186,24 +261,104 @@ static int read_FLIST(bool synced, FLIST *flist, int fd,
             status = -1;
             goto error;
         }
+        flist->lcp = 0;
+        strcmp_lcp(flist->prev->name, flist->prev->length, flist->name, flist->length, &flist->lcp);
         READ_ONERR(flist->st.revision, fd, read_size, -1);
         READ_ONERR(flist->st.mtime, fd, read_size, -1);
         READ_ONERR(flist->st.mode, fd, read_size, -1);
+        if (inode) {
+            READ_ONERR(flist->st.dev, fd, read_size, -1);
+            READ_ONERR(flist->st.ino, fd, read_size, -1);
+        }
         if (synced) {
             READ_ONERR(flist->st.size, fd, read_size, -1);
             READ_ONERR(flist->st.flags, fd, read_size, -1);
         }
+        if (count < INT_MAX)
+            ++count;
         READ_ONERR(length, fd, read_size, -1);
     }
+    status = count;
+error:
+    return status;
+}
+
+#define CHUNK_RECSIZE (4+CHUNK_HASHSIZE)  /* size, hash */
+static int write_CHUNKS(CHUNKS *chunks, int fd) {
+    int status = INT_MIN;
+    size_t count, n;
+    uint8_t *buffer = NULL, *p;
+    CHUNK *chunk;
+
+    count = chunks ? chunks->count : 0;
+    n = count;
+    WRITE_ONERR(n, fd, write_size, -1);
+    if (count > 0) {
+        buffer = malloc(CHUNK_RECSIZE * count);
+        if (!buffer) {
+            status = -1;
+            goto error;
+        }
+        for (p = buffer, chunk = chunks->chunk; chunk < chunks->chunk + count; ++chunk) {
+            *p++ = chunk->size >> 24, *p++ = chunk->size >> 16;
+            *p++ = chunk->size >> 8,  *p++ = chunk->size;
+            memcpy(p, chunk->hash, CHUNK_HASHSIZE), p += CHUNK_HASHSIZE;
+        }
+        if (write_size(fd, buffer, CHUNK_RECSIZE * count) != CHUNK_RECSIZE * count) {
+            status = -1;
+            goto error;
+        }
+    }
+    status = 0;
+error:
+    free(buffer);
+    return status;
+}
+
+static int read_CHUNKS(CHUNKS **chunks, off_t size, int fd) {
+    int status = INT_MIN;
+    size_t count;
+    uint8_t *buffer = NULL, *p;
+    CHUNK *chunk;
+
+    READ_ONERR(count, fd, read_size, -1);
+    if (count > 0) {
+        if (count > size / CHUNK_MIN + 1) {
+            status = -1;
+            goto error;
+        }
+        buffer = malloc(CHUNK_RECSIZE * count);
+        *chunks = chunk_new(count);
+        if (!buffer || !*chunks) {
+            status = -1;
+            goto error;
+        }
+        if (read_size(fd, buffer, CHUNK_RECSIZE * count) != CHUNK_RECSIZE * count) {
+            status = -1;
+            goto error;
+        }
+        for (p = buffer, chunk = (*chunks)->chunk; chunk < (*chunks)->chunk + count; ++chunk) {
+            chunk->size = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+            p += 4;
+            memcpy(chunk->hash, p, CHUNK_HASHSIZE), p += CHUNK_HASHSIZE;
+            size -= chunk->size;
+        }
+        if (size != 0) {
+            status = -1;
+            goto error;
+        }
+    }
     status = 0;
 error:
+    free(buffer);
     return status;
 }
 
 static int delete_func(FLIST *f, void *data) {
     int status = INT_MIN;
 
-    LIST_DELETE(f);
+    LIST_DELETE_LCP(f);
+    free(f->chunks);
     free(f);
     status = 0;
     return status;
@@ -217,16 +372,53 @@ static int delete_func(FLIST *f, void *data) {
 #define DOWNFILE "d%lu"
 #define BACKFILE "%lu,%s"
 #define LOGFILE  "log"
+#define CHUNKFILE "chunks"
+#define SCANFILE "scan"
+#define DIRTYFILE "dirty"
+#define STATSFILE "stats"
+#define STOREDIR "store"
+#define PAYLOAD_DATA 0  /* whole file or the chunks the peer needs */
+#define PAYLOAD_MOVE 1  /* name of a local file to move */
+#define PAYLOAD_TAIL 2  /* offset, then the bytes appended after it */
+#define PAYLOAD_SPARSE 3  /* hole and data lengths, each followed by the data */
+/* A local file whose first size bytes send_prefix() offered by hash. */
+typedef struct {
+    FLIST *fsynced;
+    off_t size;
+    uint8_t hash[CHUNK_HASHSIZE];
+} PREFIX;
+
 typedef struct {
     time_t t;
     time_t expire;
     time_t backup;
+    int fsync;
+    off_t direct;
+    size_t buffer;
+    uint64_t bwlimit;
+    int bwbegin, bwend;
+    int order;
+    const char *priority;
+    time_t scancache;
+    off_t dedup;
     int fdin, fdout;
     int info;
+    const char *label;
+    int stats;
+    int plan;
     volatile sig_atomic_t *stop;
+    bool planning;  /* this side or the peer asked for a plan only */
+    bool index, peerindex;  /* this side and the peer have a chunk index */
     time_t tlast;
     FLIST fsynced;
     FLIST flocal, fremote;
+    FLIST fmoved;
+    PREFIX *prefix;  /* in the order of fsynced */
+    unsigned long prefixes;
+    char *upbuf, *downbuf;
+    size_t bufsize;
+    RATELIMIT rlup, rldown;
+    STATS phases;
     char dirname[];
 } PRIV;
 
@@ -258,6 +450,10 @@ static int unlock(PRIV *priv) {
     STR_INIT(loadname, str2);
     ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/", NULL), -1);
     ONERR(str_cats(&loadname, pathname.s, LOCKDIR, NULL), -1);
+    if (priv->planning && rmdir(loadname.s) != -1) {  /* nothing to keep as a backup */
+        status = 0;
+        goto error;
+    }
     ONERR(str_catt(&pathname, BACKDIR, localtime_r(&priv->t, &tm)), -1);
     tv[0].tv_sec = priv->t, tv[0].tv_usec = 0;
     tv[1].tv_sec = priv->t, tv[1].tv_usec = 0;
@@ -289,13 +485,32 @@ static PRIV *new_priv(const char *dirname,
     priv->t = t;
     priv->expire = t - EXPIRE_DEFAULT;
     priv->backup = t - BACKUP_DEFAULT;
+    priv->fsync = FSYNC_DEFAULT;
+    priv->direct = DIRECT_DEFAULT;
+    priv->buffer = BUFFER_DEFAULT;
+    priv->bwlimit = 0;
+    priv->bwbegin = 0, priv->bwend = 0;
+    priv->order = ORDER_DEFAULT;
+    priv->priority = NULL;
+    priv->scancache = 0;
+    priv->dedup = 0;
     priv->fdin = -1, priv->fdout = -1;
     priv->info = -1;
+    priv->label = NULL;
+    priv->stats = -1;
+    priv->plan = -1;
     priv->stop = stop;
+    priv->planning = false;
+    priv->index = false, priv->peerindex = false;
     priv->tlast = -1;
     new_FLIST(&priv->fsynced);
     new_FLIST(&priv->flocal);
     new_FLIST(&priv->fremote);
+    new_FLIST(&priv->fmoved);
+    priv->prefix = NULL, priv->prefixes = 0;
+    priv->upbuf = NULL, priv->downbuf = NULL;
+    priv->bufsize = 0;
+    stats_init(&priv->phases);
     if (lock(priv)) {
         free(priv), priv = NULL;
         goto error;
@@ -309,9 +524,297 @@ static void free_priv(PRIV *priv) {
     each_next_FLIST(&priv->fsynced, delete_func, NULL, NULL);
     each_next_FLIST(&priv->flocal, delete_func, NULL, NULL);
     each_next_FLIST(&priv->fremote, delete_func, NULL, NULL);
+    each_next_FLIST(&priv->fmoved, delete_func, NULL, NULL);
+    free(priv->prefix);
+    if (priv->upbuf)
+        munmap(priv->upbuf, priv->bufsize * 2);
     free(priv);
 }
 
+/* Map the transfer buffers of upload() and download() in one go, each
+ * priv->buffer bytes rounded up to DIRECT_ALIGN.  A mapping of at least
+ * HUGEPAGE_SIZE is aligned to it and asks for huge pages. */
+static int new_buffers(PRIV *priv) {
+    int status = INT_MIN;
+    size_t size, length;
+    char *p, *top;
+
+    size = (priv->buffer + DIRECT_ALIGN-1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (size < DIRECT_ALIGN)
+        size = DIRECT_ALIGN;
+    length = size * 2;
+    if (length >= HUGEPAGE_SIZE)
+        length += HUGEPAGE_SIZE;
+    p = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        goto error;
+    if (length > size * 2) {  /* trim to a huge page boundary */
+        top = (char *)(((uintptr_t)p + HUGEPAGE_SIZE-1) & ~(uintptr_t)(HUGEPAGE_SIZE-1));
+        if (top > p)
+            munmap(p, top - p);
+        if (p + length > top + size * 2)
+            munmap(top + size * 2, p + length - (top + size * 2));
+        p = top;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size * 2, MADV_HUGEPAGE);
+#endif  /* #ifdef MADV_HUGEPAGE */
+    }
+    priv->upbuf = p, priv->downbuf = p + size;
+    priv->bufsize = size;
+    status = 0;
+error:
+    return status;
+}
+
+static int sync_file(PRIV *priv, int fd) {
+    int status = -1;
+
+    switch (priv->fsync) {
+    case FSYNC_BATCH:
+#ifdef HAVE_SYNCFS
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif  /* #ifdef HAVE_SYNC_FILE_RANGE */
+#else   /* #ifdef HAVE_SYNCFS */
+        if (fdatasync(fd) == -1)
+            goto error;
+#endif  /* #ifdef HAVE_SYNCFS */
+        break;
+    case FSYNC_FILE:
+        if (fsync(fd) == -1)
+            goto error;
+        break;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+typedef struct {
+    const char *name;
+    size_t length;  /* of the directory part of name */
+} PARENT;
+
+static int cmp_parent(const void *p1, const void *p2) {
+    const PARENT *d1 = p1, *d2 = p2;
+    int cmp;
+
+    cmp = strncmp(d1->name, d2->name, d1->length < d2->length ? d1->length : d2->length);
+    if (cmp)
+        return cmp;
+    return d1->length < d2->length ? -1 : d1->length > d2->length;
+}
+
+/* fsync() once each directory that commit() renamed, removed or created
+ * entries in: the parents of the downloaded entries and LOCKDIR. */
+static int sync_parents(PRIV *priv) {
+    int status = -1;
+    PARENT *parent = NULL, *p;
+    size_t count;
+    FLIST *fsynced;
+    const char *s;
+    STR pathname;
+    char str[PATH_MAX];
+    int fd = -1;
+
+    count = 1;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        if (fsynced->st.flags & FST_DNLD)
+            ++count;
+    parent = malloc(sizeof(*parent) * count);
+    if (!parent)
+        goto error;
+    p = parent;
+    p->name = SYNCDIR"/"LOCKDIR, p->length = strlen(p->name), ++p;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        if (fsynced->st.flags & FST_DNLD) {
+            s = strrchr(fsynced->name, '/');
+            p->name = fsynced->name, p->length = s ? s - fsynced->name : 0, ++p;
+        }
+    qsort(parent, count, sizeof(*parent), cmp_parent);
+    STR_INIT(pathname, str);
+    if (str_cats(&pathname, priv->dirname, "/", NULL))
+        goto error;
+    pathname.hold = true;
+    for (p = parent; p < parent + count; ++p) {
+        if (p > parent && !cmp_parent(p - 1, p))
+            continue;
+        if (str_catf(&pathname, "%.*s", (int)p->length, p->name))
+            goto error;
+        fd = open(pathname.s, O_RDONLY);
+        if (fd == -1)
+            goto error;
+        if (fsync(fd) == -1)
+            goto error;
+        close(fd), fd = -1;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    free(parent);
+    return status;
+}
+
+static int sync_tree(PRIV *priv) {
+    int status = -1;
+    int fd = -1;
+
+    switch (priv->fsync) {
+    case FSYNC_FILE:  /* the files are synced, their directory entries not yet */
+        if (sync_parents(priv))
+            goto error;
+        break;
+    case FSYNC_BATCH:
+        fd = open(priv->dirname, O_RDONLY);
+        if (fd == -1)
+            goto error;
+#ifdef HAVE_SYNCFS
+        if (syncfs(fd) == -1)
+            goto error;
+#else   /* #ifdef HAVE_SYNCFS */
+        sync();
+        if (fsync(fd) == -1)
+            goto error;
+#endif  /* #ifdef HAVE_SYNCFS */
+        break;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+static int sync_dir(PRIV *priv, const char *pathname) {
+    int status = -1;
+    int fd = -1;
+
+    switch (priv->fsync) {
+    case FSYNC_BATCH:
+    case FSYNC_FILE:
+        fd = open(pathname, O_RDONLY);
+        if (fd == -1)
+            goto error;
+        if (fsync(fd) == -1)
+            goto error;
+        break;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+static int copy_prefix(const char *pathname, int fd, off_t size,
+                       volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    int fdsrc = -1;
+    ssize_t n;
+    char buffer[LOADBUFFER_SIZE];
+
+    fdsrc = open(pathname, O_RDONLY);
+    if (fdsrc == -1)
+        goto error;
+#ifdef FICLONE
+    if (ioctl(fd, FICLONE, fdsrc) != -1) {
+        if (ftruncate(fd, size) == -1)
+            goto error;
+        status = 0;
+        goto error;
+    }
+#endif  /* #ifdef FICLONE */
+    while (size > 0) {
+        ONSTOP(stop, -1);
+        n = read_size(fdsrc, buffer, size > sizeof(buffer) ? sizeof(buffer) : size);
+        if (n <= 0)
+            goto error;
+        if (write_size(fd, buffer, n) != n)
+            goto error;
+        size -= n;
+    }
+    status = 0;
+error:
+    if (fdsrc != -1)
+        close(fdsrc);
+    return status;
+}
+
+/* true when the first size bytes of fd contain a hole */
+static bool is_sparse(int fd, off_t size) {
+    off_t offset;
+
+    offset = lseek(fd, 0, SEEK_HOLE);
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        return false;
+    return offset != -1 && offset < size;
+}
+
+/* Find the next data segment at or after offset, up to size.  Returns the
+ * length of the hole before it in *hole and of the data in *data, and leaves
+ * fd positioned at the start of the data.  *data is 0 when only a hole is
+ * left. */
+static int next_data(int fd, off_t offset, off_t size, off_t *hole, off_t *data) {
+    int status = INT_MIN;
+    off_t start, end;
+
+    start = lseek(fd, offset, SEEK_DATA);
+    if (start == -1) {
+        if (errno != ENXIO)
+            goto error;
+        start = size;
+    }
+    if (start >= size) {
+        *hole = size - offset, *data = 0;
+        status = 0;
+        goto error;
+    }
+    end = lseek(fd, start, SEEK_HOLE);
+    if (end == -1)
+        goto error;
+    if (end > size)
+        end = size;
+    if (lseek(fd, start, SEEK_SET) == -1)
+        goto error;
+    *hole = start - offset, *data = end - start;
+    status = 0;
+error:
+    return status;
+}
+
+/* Reserve the blocks of a file about to be written up to size, so the
+ * filesystem can lay it out in few extents.  Only a hint: where it is not
+ * supported, blocks are allocated while writing as before. */
+static void preallocate(int fd, off_t size) {
+    if (size <= 0)
+        return;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(HAVE_POSIX_FALLOCATE)
+    posix_fallocate(fd, 0, size);
+#endif  /* #if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE) */
+}
+
+/* Create pathname for size bytes to be written in order from the start.
+ * Files of at least priv->direct bytes bypass the page cache and *direct is
+ * set; a filesystem refusing O_DIRECT gets a normal file instead. */
+static int create_file(PRIV *priv, const char *pathname, off_t size, bool *direct) {
+    int fd = -1;
+
+    *direct = false;
+    if (O_DIRECT && priv->direct > 0 && size >= priv->direct) {
+        fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, S_IRUSR|S_IWUSR);
+        if (fd != -1)
+            *direct = true;
+    }
+    if (fd == -1)
+        fd = creat(pathname, S_IRUSR|S_IWUSR);
+    if (fd != -1)
+        preallocate(fd, size);
+    return fd;
+}
+
 static int save_fsynced(PRIV *priv) {
     int status = INT_MIN;
     STR pathname;
@@ -330,9 +833,10 @@ static int save_fsynced(PRIV *priv) {
     }
     id = PSYNC_FILEID;
     WRITE_ONERR(id, fd, write_size, ERROR_DWRITE);
-    status = write_FLIST(false, &priv->fsynced, fd, priv->stop);
+    status = write_FLIST(false, true, &priv->fsynced, fd, priv->stop);
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(status, ERROR_DWRITE);
+    ONERR(sync_file(priv, fd), ERROR_DWRITE);
     close(fd), fd = -1;
     tv[0].tv_sec = priv->t, tv[0].tv_usec = 0;
     tv[1].tv_sec = priv->t, tv[1].tv_usec = 0;
@@ -369,10 +873,11 @@ static int load_fsynced(PRIV *priv) {
         goto error;
     }
     READ(id, fd, read_size, n);
-    if (!ISERR(n) && id == PSYNC_FILEID) {
-        status = read_FLIST(false, &priv->fsynced, fd, priv->stop);
+    if (!ISERR(n) && (id == PSYNC_FILEID || id == PSYNC_FILEID_V1)) {
+        status = read_FLIST(false, id == PSYNC_FILEID, &priv->fsynced, fd, priv->stop);
         ONSTOP(priv->stop, ERROR_STOP);
         ONERR(status, ERROR_DREAD);
+        stats_count(&priv->phases, status);
     }
     close(fd), fd = -1;
     priv->tlast = st.st_mtime;
@@ -383,84 +888,686 @@ error:
     return status;
 }
 
-static int get_flocal_r(FLIST **flocal, FLIST **flast, STR pathname, char *name, const char *entname,
-#ifdef _INCLUDE_progress_h
-                        PROGRESS *progress,
-#endif  /* #ifdef _INCLUDE_progress_h */
-                        volatile sig_atomic_t *stop ) {
+/* Entry names of a directory as listed by a scan.  They still hold while
+ * the directory keeps its inode, mtime and ctime, since adding, removing
+ * or renaming an entry updates them.  The status of each entry is only
+ * trusted while the recorder vouches that the directory is clean. */
+typedef struct {
+    time_t mtime, ctime;
+    mode_t mode;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+} ENTST;
+typedef struct {
+    time_t mtime, ctime;
+    dev_t dev;
+    ino_t ino;
+    size_t count;
+    size_t size;
+    char *names;  /* count names, each terminated */
+    ENTST *ents;  /* status of each entry */
+    char name[1];  /* relative to the sync directory, "" for itself */
+} DENTS;
+
+#define RECID_MAX 64  /* [byte] RECORD_HEAD line, terminator included */
+typedef struct {
+    time_t t;  /* directories changed since this are listed again next time */
+    time_t tfull;  /* last scan that listed every directory */
+    bool full;
+    DENTS **old;
+    size_t nold;
+    DENTS **dents;
+    size_t count, size;
+    bool journal;  /* the recorder has logged every change since the last scan */
+    char **dirty;
+    size_t ndirty;
+    char recid[RECID_MAX], oldrecid[RECID_MAX];
+    off_t recpos, oldpos;  /* journal read up to */
+} SCAN;
+
+#define ENTST_ALIGN sizeof(intmax_t)
+static DENTS *new_DENTS(const char *name, const struct stat *st, const char *names, size_t size, size_t count) {
+    DENTS *dents = NULL;
+    size_t length, offset;
+
+    length = strlen(name) + 1;
+    offset = (offsetof(DENTS, name) + length + size + ENTST_ALIGN-1) / ENTST_ALIGN * ENTST_ALIGN;
+    dents = malloc(offset + sizeof(*dents->ents) * count);
+    if (!dents)
+        goto error;
+    strcpy(dents->name, name);
+    dents->names = dents->name + length;
+    if (names)
+        memcpy(dents->names, names, size);
+    dents->ents = (ENTST *)((char *)dents + offset);
+    memset(dents->ents, 0, sizeof(*dents->ents) * count);
+    dents->size = size;
+    dents->count = count;
+    if (st) {
+        dents->mtime = st->st_mtime;
+        dents->ctime = st->st_ctime;
+        dents->dev = st->st_dev;
+        dents->ino = st->st_ino;
+    }
+error:
+    return dents;
+}
+
+static int cmp_dents(const void *p1, const void *p2) {
+    return strcmp((*(DENTS **)p1)->name, (*(DENTS **)p2)->name);
+}
+
+static int cmp_dents_name(const void *p1, const void *p2) {
+    return strcmp(p1, (*(DENTS **)p2)->name);
+}
+
+static int cmp_dirty(const void *p1, const void *p2) {
+    return strcmp(*(char **)p1, *(char **)p2);
+}
+
+static void free_scan(SCAN *scan) {
+    size_t n;
+
+    for (n = 0; n < scan->nold; ++n)
+        free(scan->old[n]);
+    free(scan->old);
+    for (n = 0; n < scan->count; ++n)
+        free(scan->dents[n]);
+    free(scan->dents);
+    for (n = 0; n < scan->ndirty; ++n)
+        free(scan->dirty[n]);
+    free(scan->dirty);
+}
+
+/* Load the listings of the last scan, unless a full scan is due. */
+static int load_scan(PRIV *priv, SCAN *scan) {
     int status = INT_MIN;
-    struct stat st;
-    uint8_t ltype;
-    int seek;
-    FLIST *fprev;
-    DIR *dir = NULL;
-    FLIST *fdir;
-    struct dirent *ent;
+    STR pathname;
+    char str[PATH_MAX];
+    int fd = -1;
+    uint32_t id;
+    time_t tfull;
+    size_t n, count, length;
+    char name[PATH_MAX];
+    DENTS *dents;
+    ENTST *ent;
 
-    ONERR(str_cats(&pathname, entname, NULL), ERROR_MEMORY);
-    if (lstat(pathname.s, &st) == -1) {
-        status = ERROR_SREAD;
+    scan->t = priv->t;
+    scan->tfull = priv->t;
+    scan->full = true;
+    scan->old = NULL, scan->nold = 0;
+    scan->dents = NULL, scan->count = 0, scan->size = 0;
+    scan->journal = false;
+    scan->dirty = NULL, scan->ndirty = 0;
+    *scan->recid = 0, *scan->oldrecid = 0;
+    scan->recpos = 0, scan->oldpos = 0;
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"SCANFILE, NULL), ERROR_MEMORY);
+    fd = open(pathname.s, O_RDONLY);
+    if (fd == -1) {
+        status = ERROR_DOPEN;
         goto error;
     }
-    switch (st.st_mode & S_IFMT) {
-    case S_IFREG:
-        if (access(pathname.s, R_OK) != 0) {
-            status = ERROR_FPERM;
+    READ_ONERR(id, fd, read_size, ERROR_DREAD);
+    READ_ONERR(tfull, fd, read_size, ERROR_DREAD);
+    if (id != PSYNC_SCANID || tfull <= priv->t - priv->scancache || tfull > priv->t) {
+        status = 0;
+        goto error;
+    }
+    READ_ONERR(length, fd, read_size, ERROR_DREAD);
+    if (length > sizeof(scan->oldrecid)-1) {
+        status = ERROR_DREAD;
+        goto error;
+    }
+    if (read_size(fd, scan->oldrecid, length) != length) {
+        status = ERROR_DREAD;
+        goto error;
+    }
+    scan->oldrecid[length] = 0;
+    READ_ONERR(scan->oldpos, fd, read_size, ERROR_DREAD);
+    READ_ONERR(n, fd, read_size, ERROR_DREAD);
+    scan->old = malloc(sizeof(*scan->old) * (n > 0 ? n : 1));
+    if (!scan->old) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    while (scan->nold < n) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        READ_ONERR(length, fd, read_size, ERROR_DREAD);
+        if (length > sizeof(name)-1) {
+            status = ERROR_DREAD;
             goto error;
         }
-        ltype = FST_LREG;
-        break;
-    case S_IFDIR:
-        if (access(pathname.s, R_OK|W_OK|X_OK) != 0) {
-            status = ERROR_FPERM;
+        if (read_size(fd, name, length) != length) {
+            status = ERROR_DREAD;
             goto error;
         }
-        ltype = FST_LDIR;
-        break;
-    case S_IFLNK:
-        ltype = FST_LLNK;
-        break;
-    default:
-        status = ERROR_FTYPE;
-        goto error;
-    }
-    LIST_SEEK_NEXT(*flocal, name, seek);
-    LIST_SEEK_NEXT(*flast, name, seek);
-    if (seek) {
-        *flocal = add_FLIST(*flocal, name);
-        if (!*flocal) {
+        name[length] = 0;
+        READ_ONERR(length, fd, read_size, ERROR_DREAD);
+        READ_ONERR(count, fd, read_size, ERROR_DREAD);
+        if (count > length) {
+            status = ERROR_DREAD;
+            goto error;
+        }
+        dents = new_DENTS(name, NULL, NULL, length, count);
+        if (!dents) {
             status = ERROR_MEMORY;
             goto error;
         }
-        (*flocal)->st.revision = st.st_ctime > st.st_mtime ? st.st_ctime : st.st_mtime;
-    }
-    else {
-        fprev = (*flast)->prev;
-        LIST_DELETE(*flast);
-        LIST_INSERT_NEXT(*flast, *flocal);
+        scan->old[scan->nold++] = dents;
+        READ_ONERR(dents->mtime, fd, read_size, ERROR_DREAD);
+        READ_ONERR(dents->ctime, fd, read_size, ERROR_DREAD);
+        READ_ONERR(dents->dev, fd, read_size, ERROR_DREAD);
+        READ_ONERR(dents->ino, fd, read_size, ERROR_DREAD);
+        if (read_size(fd, dents->names, dents->size) != dents->size) {
+            status = ERROR_DREAD;
+            goto error;
+        }
+        for (count = length = 0; length < dents->size; ++length)
+            if (!dents->names[length])
+                ++count;
+        if (count != dents->count || (dents->size > 0 && dents->names[dents->size-1])) {
+            status = ERROR_DREAD;
+            goto error;
+        }
+        for (ent = dents->ents; ent < dents->ents + dents->count; ++ent) {
+            READ_ONERR(ent->mtime, fd, read_size, ERROR_DREAD);
+            READ_ONERR(ent->ctime, fd, read_size, ERROR_DREAD);
+            READ_ONERR(ent->mode, fd, read_size, ERROR_DREAD);
+            READ_ONERR(ent->size, fd, read_size, ERROR_DREAD);
+            READ_ONERR(ent->dev, fd, read_size, ERROR_DREAD);
+            READ_ONERR(ent->ino, fd, read_size, ERROR_DREAD);
+        }
+    }
+    qsort(scan->old, scan->nold, sizeof(*scan->old), cmp_dents);
+    scan->tfull = tfull;
+    scan->full = false;
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    if (ISERR(status)) {
+        free_scan(scan);
+        scan->old = NULL, scan->nold = 0;
+        *scan->oldrecid = 0;
+    }
+    return status;
+}
+
+static int save_scan(PRIV *priv, SCAN *scan) {
+    int status = INT_MIN;
+    STR pathname, loadname;
+    char str1[PATH_MAX], str2[PATH_MAX];
+    int fd = -1;
+    uint32_t id;
+    size_t n, size, length;
+    DENTS *dents;
+    ENTST ent;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str1);
+    STR_INIT(loadname, str2);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"SCANFILE, NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/"SCANFILE, NULL), ERROR_MEMORY);
+    qsort(scan->dents, scan->count, sizeof(*scan->dents), cmp_dents);
+    fd = creat(loadname.s, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        status = ERROR_DMAKE;
+        goto error;
+    }
+    id = PSYNC_SCANID;
+    WRITE_ONERR(id, fd, write_size, ERROR_DWRITE);
+    WRITE_ONERR(scan->tfull, fd, write_size, ERROR_DWRITE);
+    size = length = strlen(scan->recid);
+    WRITE_ONERR(size, fd, write_size, ERROR_DWRITE);
+    if (write_size(fd, scan->recid, length) != length) {
+        status = ERROR_DWRITE;
+        goto error;
+    }
+    WRITE_ONERR(scan->recpos, fd, write_size, ERROR_DWRITE);
+    n = scan->count;
+    WRITE_ONERR(n, fd, write_size, ERROR_DWRITE);
+    for (n = 0; n < scan->count; ++n) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        dents = scan->dents[n];
+        size = length = strlen(dents->name);
+        WRITE_ONERR(size, fd, write_size, ERROR_DWRITE);
+        if (write_size(fd, dents->name, length) != length) {
+            status = ERROR_DWRITE;
+            goto error;
+        }
+        size = dents->size;
+        WRITE_ONERR(size, fd, write_size, ERROR_DWRITE);
+        size = dents->count;
+        WRITE_ONERR(size, fd, write_size, ERROR_DWRITE);
+        WRITE_ONERR(dents->mtime, fd, write_size, ERROR_DWRITE);
+        WRITE_ONERR(dents->ctime, fd, write_size, ERROR_DWRITE);
+        WRITE_ONERR(dents->dev, fd, write_size, ERROR_DWRITE);
+        WRITE_ONERR(dents->ino, fd, write_size, ERROR_DWRITE);
+        if (write_size(fd, dents->names, dents->size) != dents->size) {
+            status = ERROR_DWRITE;
+            goto error;
+        }
+        for (size = 0; size < dents->count; ++size) {
+            ent = dents->ents[size];
+            WRITE_ONERR(ent.mtime, fd, write_size, ERROR_DWRITE);
+            WRITE_ONERR(ent.ctime, fd, write_size, ERROR_DWRITE);
+            WRITE_ONERR(ent.mode, fd, write_size, ERROR_DWRITE);
+            WRITE_ONERR(ent.size, fd, write_size, ERROR_DWRITE);
+            WRITE_ONERR(ent.dev, fd, write_size, ERROR_DWRITE);
+            WRITE_ONERR(ent.ino, fd, write_size, ERROR_DWRITE);
+        }
+    }
+    close(fd), fd = -1;
+    if (rename(loadname.s, pathname.s) == -1) {
+        status = ERROR_DWRITE;
+        goto error;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* Find the line starting with c from offset on, and return the offset
+ * just after it, or -1 when there is none yet. */
+static off_t seek_line(int fd, off_t offset, char c) {
+    char buffer[LOADBUFFER_SIZE], *s, *e;
+    ssize_t size;
+    bool head = true;
+
+    while (size = pread(fd, buffer, sizeof(buffer), offset), size > 0) {
+        for (s = buffer; s < buffer + size; s = e + 1) {
+            e = memchr(s, '\n', buffer + size - s);
+            if (!e)
+                break;
+            if (head && *s == c)
+                return offset + (e - buffer) + 1;
+            head = true;
+        }
+        if (s == buffer) {  /* line longer than the buffer */
+            head = false;
+            s = buffer + size;
+        }
+        offset += s - buffer;
+    }
+    return -1;
+}
+
+/* Mark the start of this scan in the journal of the recorder and, when it
+ * was kept by the same recorder since the last scan without losing
+ * anything, take the directories it logged meanwhile as the only dirty
+ * ones. */
+static int load_journal(PRIV *priv, SCAN *scan) {
+    int status = INT_MIN;
+    STR pathname;
+    char str[PATH_MAX];
+    int fd = -1, fdmark = -1;
+    char line[PATH_MAX+1], *s;
+    ssize_t size;
+    off_t offset, mark, end;
+    unsigned int wait;
+    char **p;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"DIRTYFILE, NULL), ERROR_MEMORY);
+    fd = open(pathname.s, O_RDONLY);
+    if (fd == -1) {  /* never recorded */
+        status = 0;
+        goto error;
+    }
+    if (flock(fd, LOCK_SH|LOCK_NB) != -1) {  /* no recorder */
+        status = 0;
+        goto error;
+    }
+    size = pread(fd, scan->recid, sizeof(scan->recid)-1, 0);
+    scan->recid[size > 0 ? size : 0] = 0;
+    s = strchr(scan->recid, '\n');
+    if (!s || strncmp(scan->recid, RECORD_HEAD" ", strlen(RECORD_HEAD" "))) {  /* not watching yet */
+        *scan->recid = 0;
+        status = 0;
+        goto error;
+    }
+    *s = 0;
+    fdmark = open(pathname.s, O_WRONLY|O_APPEND);
+    if (fdmark == -1) {
+        status = ERROR_DOPEN;
+        goto error;
+    }
+    line[0] = RECORD_MARK, line[1] = '\n';
+    if (write_size(fdmark, line, 2) != 2) {
+        status = ERROR_DWRITE;
+        goto error;
+    }
+    mark = lseek(fdmark, 0, SEEK_CUR);
+    close(fdmark), fdmark = -1;
+    for (wait = 0; (end = seek_line(fd, mark, RECORD_SYNC)) == -1; ++wait) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        if (wait >= RECORD_WAIT) {  /* the recorder is stuck, catch up next time */
+            scan->recpos = mark;
+            status = 0;
+            goto error;
+        }
+        usleep(1000);
+    }
+    scan->recpos = end;
+    if (scan->full || strcmp(scan->recid, scan->oldrecid) ||
+        scan->oldpos <= 0 || scan->oldpos > end ) {
+        status = 0;
+        goto error;
+    }
+    for (offset = scan->oldpos; offset < end; offset += s - line + 1) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        size = pread(fd, line, end - offset < sizeof(line) ? end - offset : sizeof(line), offset);
+        s = size > 0 ? memchr(line, '\n', size) : NULL;
+        if (!s || *line == RECORD_LOST) {
+            status = 0;
+            goto error;
+        }
+        *s = 0;
+        if (*line != '/')
+            continue;
+        if (scan->ndirty % 256 == 0) {
+            p = realloc(scan->dirty, sizeof(*scan->dirty) * (scan->ndirty + 256));
+            if (!p) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            scan->dirty = p;
+        }
+        scan->dirty[scan->ndirty] = strdup(line + 1);
+        if (!scan->dirty[scan->ndirty]) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+        ++scan->ndirty;
+    }
+    qsort(scan->dirty, scan->ndirty, sizeof(*scan->dirty), cmp_dirty);
+    scan->journal = true;
+    status = 0;
+error:
+    if (fdmark != -1)
+        close(fdmark);
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* List the entries of the directory pathname, from the last scan when
+ * the directory has not changed since.  clean tells the status of the
+ * entries is also still valid. */
+static int list_dir(SCAN *scan, const char *pathname, const char *name, const struct stat *st, bool top,
+                    DENTS **dents, bool *clean ) {
+    int status = INT_MIN;
+    DENTS **pold;
+    DIR *dir = NULL;
+    struct dirent *ent;
+    char *names = NULL, *p;
+    size_t size = 0, length = 0, count = 0;
+
+    *dents = NULL;
+    *clean = false;
+    if (scan && !scan->full) {
+        pold = bsearch(name, scan->old, scan->nold, sizeof(*scan->old), cmp_dents_name);
+        if (pold && scan->journal &&  /* st may come from the listing of the parent */
+            bsearch(&name, scan->dirty, scan->ndirty, sizeof(*scan->dirty), cmp_dirty) )
+            pold = NULL;
+        if (pold &&
+            (*pold)->mtime == st->st_mtime && (*pold)->ctime == st->st_ctime &&
+            (*pold)->dev == st->st_dev && (*pold)->ino == st->st_ino ) {
+            *dents = new_DENTS(name, st, (*pold)->names, (*pold)->size, (*pold)->count);
+            if (!*dents) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            if (scan->journal) {
+                memcpy((*dents)->ents, (*pold)->ents, sizeof(*(*dents)->ents) * (*dents)->count);
+                *clean = true;
+            }
+            status = 0;
+            goto error;
+        }
+    }
+    dir = opendir(pathname);
+    if (!dir) {
+        status = ERROR_FOPEN;
+        goto error;
+    }
+    while (ent = readdir(dir), ent) {
+        if (!strcmp(ent->d_name, ".") ||
+            !strcmp(ent->d_name, "..") ||
+            (top && !strcmp(ent->d_name, SYNCDIR)) )
+            continue;
+        if (length + strlen(ent->d_name) + 1 > size) {
+            size = (size > 0 ? size : 1024) * 2 + strlen(ent->d_name);
+            p = realloc(names, size);
+            if (!p) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            names = p;
+        }
+        strcpy(names + length, ent->d_name);
+        length += strlen(ent->d_name) + 1;
+        ++count;
+    }
+    closedir(dir), dir = NULL;
+    *dents = new_DENTS(name, st, names, length, count);
+    if (!*dents) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    free(names);
+    return status;
+}
+
+/* Keep the listing with the status of its entries for the next scan,
+ * unless the directory changed in the second the scan started, where a
+ * later change could go unnoticed. */
+static void keep_dents(SCAN *scan, DENTS *dents, const struct stat *sts) {
+    DENTS **p;
+    size_t n;
+
+    if (!scan || dents->mtime >= scan->t || dents->ctime >= scan->t)
+        goto error;
+    if (scan->count >= scan->size) {
+        p = realloc(scan->dents, sizeof(*scan->dents) * (scan->size > 0 ? scan->size * 2 : 256));
+        if (!p)
+            goto error;
+        scan->dents = p, scan->size = scan->size > 0 ? scan->size * 2 : 256;
+    }
+    for (n = 0; n < dents->count; ++n) {
+        dents->ents[n].mtime = sts[n].st_mtime;
+        dents->ents[n].ctime = sts[n].st_ctime;
+        dents->ents[n].mode = sts[n].st_mode;
+        dents->ents[n].size = sts[n].st_size;
+        dents->ents[n].dev = sts[n].st_dev;
+        dents->ents[n].ino = sts[n].st_ino;
+    }
+    scan->dents[scan->count++] = dents, dents = NULL;
+error:
+    free(dents);
+}
+
+typedef struct {
+    STR dirname;
+    const char **names;
+    size_t first, count;
+    struct stat *sts;
+    pthread_t tid;
+    char str[PATH_MAX];
+} STATPARAM;
+
+static void *stat_thread(void *data) {
+    STATPARAM *param = data;
+    STR pathname;
+    size_t n;
+
+    for (n = param->first; n < param->count; n += SCAN_THREADS) {
+        pathname = param->dirname;
+        if (str_cats(&pathname, param->names[n], NULL) ||
+            lstat(pathname.s, &param->sts[n]) == -1 )
+            param->sts[n].st_mode = 0;
+    }
+    return NULL;
+}
+
+/* Status of the entries of a listed directory for get_flocal_r(), taken
+ * from the listing when clean.  Otherwise a directory of SCAN_PARALLEL
+ * entries or more is lstat'ed with SCAN_THREADS threads, and an entry
+ * left with st_mode 0 is lstat'ed by get_flocal_r() itself. */
+static struct stat *stat_dents(const char *dirname, const DENTS *dents, bool clean) {
+    struct stat *sts = NULL;
+    const char **names = NULL;
+    STATPARAM *param = NULL;
+    const char *name;
+    size_t n;
+    unsigned int k, threads;
+
+    sts = calloc(dents->count > 0 ? dents->count : 1, sizeof(*sts));
+    if (!sts)
+        goto error;
+    if (clean) {
+        for (n = 0; n < dents->count; ++n) {
+            sts[n].st_mtime = dents->ents[n].mtime;
+            sts[n].st_ctime = dents->ents[n].ctime;
+            sts[n].st_mode = dents->ents[n].mode;
+            sts[n].st_size = dents->ents[n].size;
+            sts[n].st_dev = dents->ents[n].dev;
+            sts[n].st_ino = dents->ents[n].ino;
+        }
+        goto error;
+    }
+    if (dents->count < SCAN_PARALLEL)
+        goto error;
+    names = malloc(sizeof(*names) * dents->count);
+    param = malloc(sizeof(*param) * SCAN_THREADS);
+    if (!names || !param)
+        goto error;
+    for (name = dents->names, n = 0; n < dents->count; name += strlen(name) + 1, ++n)
+        names[n] = name;
+    for (k = 0; k < SCAN_THREADS; ++k) {
+        STR_INIT(param[k].dirname, param[k].str);
+        if (str_cats(&param[k].dirname, dirname, NULL))
+            goto error;
+        param[k].names = names;
+        param[k].first = k, param[k].count = dents->count;
+        param[k].sts = sts;
+    }
+    for (threads = 1; threads < SCAN_THREADS; ++threads)
+        if (pthread_create(&param[threads].tid, NULL, stat_thread, &param[threads]) != 0)
+            break;
+    stat_thread(&param[0]);
+    for (k = threads; k < SCAN_THREADS; ++k)  /* threads not started */
+        stat_thread(&param[k]);
+    for (k = 1; k < threads; ++k)
+        pthread_join(param[k].tid, NULL);
+error:
+    free(param);
+    free(names);
+    return sts;
+}
+
+static int get_flocal_r(FLIST **flocal, FLIST **flast, STR pathname, char *name, const char *entname,
+                        struct stat *stent, bool clean, SCAN *scan,
+#ifdef _INCLUDE_progress_h
+                        PROGRESS *progress,
+#endif  /* #ifdef _INCLUDE_progress_h */
+                        volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    struct stat st;
+    uint8_t ltype;
+    int seek;
+    size_t lcpprev, lcpnext;
+    FLIST *fprev;
+    DENTS *dents = NULL;
+    struct stat *sts = NULL;
+    bool cleanents;
+    FLIST *fdir;
+    const char *ent;
+    size_t n;
+
+    ONERR(str_cats(&pathname, entname, NULL), ERROR_MEMORY);
+    if (stent && stent->st_mode)
+        st = *stent;
+    else if (lstat(pathname.s, &st) == -1) {
+        status = ERROR_SREAD;
+        goto error;
+    }
+    if (stent)
+        *stent = st;
+    switch (st.st_mode & S_IFMT) {
+    case S_IFREG:
+        if (!clean && access(pathname.s, R_OK) != 0) {
+            status = ERROR_FPERM;
+            goto error;
+        }
+        ltype = FST_LREG;
+        break;
+    case S_IFDIR:
+        if (!clean && access(pathname.s, R_OK|W_OK|X_OK) != 0) {
+            status = ERROR_FPERM;
+            goto error;
+        }
+        ltype = FST_LDIR;
+        break;
+    case S_IFLNK:
+        ltype = FST_LLNK;
+        break;
+    default:
+        status = ERROR_FTYPE;
+        goto error;
+    }
+    LIST_SEEK_NEXT_LCP(*flocal, name, (size_t)(pathname.e - name), seek, lcpprev, lcpnext);
+    LIST_SEEK_NEXT(*flast, name, seek);
+    if (seek) {
+        *flocal = add_FLIST(*flocal, name);
+        if (!*flocal) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+        (*flocal)->st.revision = st.st_ctime > st.st_mtime ? st.st_ctime : st.st_mtime;
+    }
+    else {
+        fprev = (*flast)->prev;
+        LIST_DELETE_LCP(*flast);
+        LIST_INSERT_NEXT_LCP(*flast, *flocal);
         *flocal = *flast, *flast = fprev;
         if ((*flocal)->st.mtime != st.st_mtime)
             (*flocal)->st.revision = st.st_ctime > st.st_mtime ? st.st_ctime : st.st_mtime;
     }
+    (*flocal)->lcp = lcpprev, (*flocal)->next->lcp = lcpnext;
     (*flocal)->st.mtime = st.st_mtime;
     (*flocal)->st.mode = st.st_mode & (S_IFMT|S_IRWXU|S_IRWXG|S_IRWXO);
     (*flocal)->st.size = st.st_size;
+    (*flocal)->st.dev = st.st_dev;
+    (*flocal)->st.ino = st.st_ino;
     (*flocal)->st.flags |= ltype;
     switch (ltype & FST_LTYPE) {
     case FST_LDIR:
-        dir = opendir(pathname.s);
-        if (!dir) {
-            status = ERROR_FOPEN;
+        if (ISERR(status = list_dir(scan, pathname.s, name, &st, false, &dents, &cleanents)))
             goto error;
-        }
         ONERR(str_cats(&pathname, "/", NULL), ERROR_MEMORY);
+        if (scan) {
+            sts = stat_dents(pathname.s, dents, cleanents);
+            if (!sts) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+        }
         fdir = *flocal;
-        while (ent = readdir(dir), ent) {
+        for (ent = dents->names, n = 0; n < dents->count; ent += strlen(ent) + 1, ++n) {
             ONSTOP(stop, ERROR_STOP);
-            if (!strcmp(ent->d_name, ".") ||
-                !strcmp(ent->d_name, "..") )
-                continue;
-            if (ISERR(status = get_flocal_r(flocal, flast, pathname, name, ent->d_name,
+            if (ISERR(status = get_flocal_r(flocal, flast, pathname, name, ent,
+                                            sts ? &sts[n] : NULL, cleanents, scan,
 #ifdef _INCLUDE_progress_h
                                             progress,
 #endif  /* #ifdef _INCLUDE_progress_h */
@@ -469,7 +1576,7 @@ static int get_flocal_r(FLIST **flocal, FLIST **flast, STR pathname, char *name,
             if ((*flocal)->st.revision > fdir->st.revision)
                 fdir->st.revision = (*flocal)->st.revision;
         }
-        closedir(dir), dir = NULL;
+        keep_dents(scan, dents, sts), dents = NULL;
         break;
 #ifdef _INCLUDE_progress_h
     case FST_LREG:
@@ -480,10 +1587,11 @@ static int get_flocal_r(FLIST **flocal, FLIST **flast, STR pathname, char *name,
     }
     status = 0;
 error:
-    if (dir)
-        closedir(dir);
+    free(sts);
+    free(dents);
     return status;
 }
+
 static int get_flocal(PRIV *priv) {
     int status = INT_MIN;
 #ifdef _INCLUDE_progress_h
@@ -492,14 +1600,23 @@ static int get_flocal(PRIV *priv) {
     STR pathname;
     char str[PATH_MAX];
     struct stat st;
-    DIR *dir = NULL;
+    SCAN scan, *pscan = NULL;
+    DENTS *dents = NULL;
+    struct stat *sts = NULL;
+    bool cleanents;
     FLIST *flocal, *flast;
-    struct dirent *ent;
+    const char *ent;
+    size_t n;
 
-    ONSTOP(priv->stop, ERROR_STOP);
 #ifdef _INCLUDE_progress_h
     progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'S');
 #endif  /* #ifdef _INCLUDE_progress_h */
+    ONSTOP(priv->stop, ERROR_STOP);
+    if (priv->scancache > 0) {
+        load_scan(priv, &scan);
+        pscan = &scan;
+        ONERR(load_journal(priv, &scan), ERROR_DREAD);
+    }
     STR_INIT(pathname, str);
     ONERR(str_cats(&pathname, priv->dirname, NULL), ERROR_MEMORY);
     if (stat(pathname.s, &st) == -1) {
@@ -517,20 +1634,21 @@ static int get_flocal(PRIV *priv) {
         status = ERROR_FTYPE;
         goto error;
     }
-    dir = opendir(pathname.s);
-    if (!dir) {
-        status = ERROR_FOPEN;
+    if (ISERR(status = list_dir(pscan, pathname.s, "", &st, true, &dents, &cleanents)))
         goto error;
-    }
     ONERR(str_cats(&pathname, "/", NULL), ERROR_MEMORY);
+    if (pscan) {
+        sts = stat_dents(pathname.s, dents, cleanents);
+        if (!sts) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+    }
     flocal = &priv->flocal, flast = &priv->fsynced;
-    while (ent = readdir(dir), ent) {
+    for (ent = dents->names, n = 0; n < dents->count; ent += strlen(ent) + 1, ++n) {
         ONSTOP(priv->stop, ERROR_STOP);
-        if (!strcmp(ent->d_name, ".") ||
-            !strcmp(ent->d_name, "..") ||
-            !strcmp(ent->d_name, SYNCDIR) )
-            continue;
-        if (ISERR(status = get_flocal_r(&flocal, &flast, pathname, pathname.e, ent->d_name,
+        if (ISERR(status = get_flocal_r(&flocal, &flast, pathname, pathname.e, ent,
+                                        sts ? &sts[n] : NULL, cleanents, pscan,
 #ifdef _INCLUDE_progress_h
                                         &progress,
 #endif  /* #ifdef _INCLUDE_progress_h */
@@ -539,20 +1657,27 @@ static int get_flocal(PRIV *priv) {
                 switch (status) {
                 case ERROR_FTYPE:
                 case ERROR_FPERM:
-                    dprintf(priv->info, "!Unsupported file: %s\n", ent->d_name);
+                    dprintf(priv->info, "!Unsupported file: %s\n", ent);
                     break;
                 }
             goto error;
         }
     }
-    closedir(dir), dir = NULL;
+    keep_dents(pscan, dents, sts), dents = NULL;
+    if (pscan)
+        save_scan(priv, pscan);
 #ifdef _INCLUDE_progress_h
     progress_term(&progress);
 #endif  /* #ifdef _INCLUDE_progress_h */
     status = 0;
 error:
-    if (dir)
-        closedir(dir);
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    free(sts);
+    free(dents);
+    if (pscan)
+        free_scan(pscan);
     return status;
 }
 
@@ -562,17 +1687,22 @@ static int add_deleted_func(SETS sets, FLIST *flocal, FLIST *flast, void *data)
 
     switch (sets) {
     case SETS_1AND2:
-        LIST_DELETE(flast);
+        LIST_DELETE_LCP(flast);
         free(flast);
+        stats_count(&priv->phases, 1);
         break;
     case SETS_1NOT2:
+        stats_count(&priv->phases, 1);
         break;
     case SETS_2NOT1:
-        LIST_DELETE(flast);
+        LIST_DELETE_LCP(flast);
         switch (flast->st.mode & S_IFMT) {
         case 0:  /* deleted */
-            if (flast->st.revision > priv->expire)
-                LIST_INSERT_PREV(flast, flocal);
+            if (flast->st.revision > priv->expire) {
+                flast->st.dev = 0;
+                flast->st.ino = 0;
+                LIST_INSERT_PREV_LCP(flast, flocal);
+            }
             else
                 free(flast);
             break;
@@ -581,7 +1711,7 @@ static int add_deleted_func(SETS sets, FLIST *flocal, FLIST *flast, void *data)
             flast->st.mtime = 0;
             flast->st.mode = 0;
             flast->st.size = 0;
-            LIST_INSERT_PREV(flast, flocal);
+            LIST_INSERT_PREV_LCP(flast, flocal);
         }
         break;
     }
@@ -599,52 +1729,164 @@ static int make_fsynced_func(SETS sets, FLIST *flocal, FLIST *fremote, void *dat
             fremote->st.flags |= flocal->st.flags;
             if (flocal->st.mtime != fremote->st.mtime)
                 fremote->st.flags |= FST_DNLD;
-            LIST_DELETE(flocal);
+            LIST_DELETE_LCP(flocal);
             free(flocal);
-            LIST_DELETE(fremote);
-            LIST_INSERT_PREV(fremote, &priv->fsynced);
+            LIST_DELETE_LCP(fremote);
+            LIST_INSERT_PREV_LCP(fremote, &priv->fsynced);
         }
         else {
             flocal->st.flags |= fremote->st.flags;
             if (flocal->st.revision > fremote->st.revision &&
                 flocal->st.mtime != fremote->st.mtime )
                 flocal->st.flags |= FST_UPLD;
-            LIST_DELETE(fremote);
-            free(fremote);
-            LIST_DELETE(flocal);
-            LIST_INSERT_PREV(flocal, &priv->fsynced);
+            LIST_DELETE_LCP(fremote);
+            if ((flocal->st.flags & (FST_UPLD|FST_LTYPE|FST_RTYPE)) == (FST_UPLD|FST_RREG) &&
+                flocal->st.ino != 0 ) {  /* deleted here since the last sync, regular file remains on remote */
+                LIST_INSERT_PREV_LCP(fremote, &priv->fmoved);
+                flocal->move = fremote;
+            }
+            else
+                free(fremote);
+            LIST_DELETE_LCP(flocal);
+            LIST_INSERT_PREV_LCP(flocal, &priv->fsynced);
         }
         break;
     case SETS_1NOT2:
         flocal->st.flags |= FST_UPLD;
-        LIST_DELETE(flocal);
-        LIST_INSERT_PREV(flocal, &priv->fsynced);
+        LIST_DELETE_LCP(flocal);
+        LIST_INSERT_PREV_LCP(flocal, &priv->fsynced);
         break;
     case SETS_2NOT1:
         fremote->st.flags |= FST_DNLD;
-        LIST_DELETE(fremote);
-        LIST_INSERT_PREV(fremote, &priv->fsynced);
+        LIST_DELETE_LCP(fremote);
+        LIST_INSERT_PREV_LCP(fremote, &priv->fsynced);
         break;
     }
+    stats_count(&priv->phases, 1);
     status = 0;
     return status;
 }
 
+static int cmp_inode(const void *p1, const void *p2) {
+    const FST *st1 = &(*(FLIST *const *)p1)->st;
+    const FST *st2 = &(*(FLIST *const *)p2)->st;
+
+    if (st1->dev != st2->dev)
+        return st1->dev < st2->dev ? -1 : 1;
+    if (st1->ino != st2->ino)
+        return st1->ino < st2->ino ? -1 : 1;
+    return 0;
+}
+
+static int make_moved(PRIV *priv) {
+    int status = INT_MIN;
+    FLIST **fsource = NULL;
+    size_t count, n;
+    FLIST *fsynced, **f;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        if (fsynced->move)
+            ++count;
+    if (count > 0) {
+        fsource = malloc(sizeof(*fsource) * count);
+        if (!fsource) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+        n = 0;
+        for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+            if (fsynced->move)
+                fsource[n++] = fsynced;
+        qsort(fsource, count, sizeof(*fsource), cmp_inode);
+        for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+            ONSTOP(priv->stop, ERROR_STOP);
+            switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+            case FST_UPLD|FST_LREG:
+                f = bsearch(&fsynced, fsource, count, sizeof(*fsource), cmp_inode);
+                if (!f)
+                    break;
+                while (f > fsource && !cmp_inode(f - 1, &fsynced))  /* hard links share the inode */
+                    --f;
+                for (; f < fsource + count && !cmp_inode(f, &fsynced); ++f)
+                    if ((*f)->move &&
+                        (*f)->move->st.mtime == fsynced->st.mtime &&
+                        (*f)->move->st.size == fsynced->st.size ) {
+                        fsynced->move = *f;
+                        (*f)->move = NULL;
+                        break;
+                    }
+                break;
+            }
+        }
+        for (n = 0; n < count; ++n)
+            fsource[n]->move = NULL;
+    }
+    each_next_FLIST(&priv->fmoved, delete_func, NULL, NULL);
+    status = 0;
+error:
+    free(fsource);
+    return status;
+}
+
+#ifdef _INCLUDE_progress_h
+/* Bytes and files this side is going to upload, sent as a 'T' line so
+ * that the progress of the peer's download gets its real total.  Moved
+ * files cost no bytes, and after recv_needs() only the tails and the
+ * chunks the peer could not fill are counted. */
+static void put_total(PRIV *priv) {
+    intmax_t size;
+    unsigned long count;
+    FLIST *fsynced;
+    CHUNK *chunk;
+    size_t n;
+
+    if (priv->info == -1)
+        return;
+    size = 0, count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+            if (fsynced->move)
+                break;
+            if (fsynced->tail > 0)
+                size += fsynced->st.size - fsynced->tail;
+            else if (fsynced->chunks) {
+                for (n = 0, chunk = fsynced->chunks->chunk; n < fsynced->chunks->count; ++n, ++chunk)
+                    if (chunk->need)
+                        size += chunk->size;
+            }
+            else
+                size += fsynced->st.size;
+            ++count;
+            break;
+        case FST_UPLD|FST_LLNK:
+            size += fsynced->st.size;
+            ++count;
+            break;
+        }
+    dprintf(priv->info, "T%jd %lu\n", size, count);
+}
+#endif  /* #ifdef _INCLUDE_progress_h */
+
 static int preload(PRIV *priv) {
     int status = INT_MIN;
 #ifdef _INCLUDE_progress_h
     PROGRESS progress;
 #endif  /* #ifdef _INCLUDE_progress_h */
+    BATCH batch;
     STR pathname, loadname;
     char str1[PATH_MAX], str2[PATH_MAX];
     unsigned long count;
     FLIST *fsynced;
     char buffer[SYMLINK_MAX+1];
 
-    ONSTOP(priv->stop, ERROR_STOP);
+    batch_init(&batch, BATCH_DEPTH);
 #ifdef _INCLUDE_progress_h
     progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'U');
 #endif  /* #ifdef _INCLUDE_progress_h */
+    ONSTOP(priv->stop, ERROR_STOP);
     STR_INIT(pathname, str1);
     STR_INIT(loadname, str2);
     ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
@@ -657,14 +1899,14 @@ static int preload(PRIV *priv) {
         switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
         case FST_UPLD|FST_LREG:
         case FST_UPLD|FST_LLNK:
+            if (fsynced->move)
+                break;
             ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
             ONERR(str_catf(&loadname, UPFILE, ++count), ERROR_MEMORY);
             switch (fsynced->st.flags & FST_LTYPE) {
             case FST_LREG:
-                if (link(pathname.s, loadname.s) == -1) {
-                    status = ERROR_FLINK;
+                if (ISERR(status = batch_link(&batch, pathname.s, loadname.s, ERROR_FLINK)))
                     goto error;
-                }
                 break;
             case FST_LLNK:
                 if (readlink(pathname.s, buffer, sizeof(buffer)) != fsynced->st.size) {
@@ -672,27 +1914,101 @@ static int preload(PRIV *priv) {
                     goto error;
                 }
                 buffer[fsynced->st.size] = 0;
-                if (symlink(buffer, loadname.s) == -1) {
-                    status = ERROR_FWRITE;
+                if (ISERR(status = batch_symlink(&batch, buffer, loadname.s, ERROR_FWRITE)))
                     goto error;
-                }
                 break;
             }
 #ifdef _INCLUDE_progress_h
             progress_update(&progress, fsynced->st.size);
 #endif  /* #ifdef _INCLUDE_progress_h */
+            stats_count(&priv->phases, 1);
             break;
         }
     }
+    if (ISERR(status = batch_flush(&batch)))
+        goto error;
 #ifdef _INCLUDE_progress_h
     progress_term(&progress);
 #endif  /* #ifdef _INCLUDE_progress_h */
     status = 0;
 error:
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    batch_term(&batch);
     return status;
 }
 
-static int upload(PRIV *priv) {
+static int send_prefix(PRIV *priv) {
+    int status = INT_MIN;
+    STR pathname;
+    char str[PATH_MAX];
+    FLIST *fsynced;
+    struct stat st;
+    off_t size, n;
+    unsigned long count;
+    int fd = -1;
+    uint8_t hash[CHUNK_HASHSIZE];
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
+    pathname.hold = true;
+    count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_RREG|FST_LREG:
+            ++count;
+            break;
+        }
+    free(priv->prefix), priv->prefix = NULL, priv->prefixes = 0;
+    if (count > 0) {
+        priv->prefix = malloc(sizeof(*priv->prefix) * count);
+        if (!priv->prefix) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+    }
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_RREG|FST_LREG:
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            size = 0;
+            if (lstat(pathname.s, &st) != -1 && S_ISREG(st.st_mode) &&
+                st.st_size > 0 && st.st_size < fsynced->st.size ) {  /* may have grown by appending */
+                fd = open(pathname.s, O_RDONLY);
+                if (fd != -1) {
+                    status = chunk_hashfile(hash, fd, st.st_size, priv->stop);
+                    ONSTOP(priv->stop, ERROR_STOP);
+                    if (!ISERR(status))
+                        size = st.st_size;
+                    close(fd), fd = -1;
+                }
+            }
+            n = size;
+            WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+            if (size > 0) {
+                if (write_size(priv->fdout, hash, sizeof(hash)) != sizeof(hash)) {
+                    status = ERROR_FUPLD;
+                    goto error;
+                }
+                priv->prefix[priv->prefixes].fsynced = fsynced;  /* for download() to check the copy */
+                priv->prefix[priv->prefixes].size = size;
+                memcpy(priv->prefix[priv->prefixes].hash, hash, sizeof(hash));
+                ++priv->prefixes;
+            }
+            break;
+        }
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+static int recv_prefix(PRIV *priv) {
     int status = INT_MIN;
     STR loadname;
     char str[PATH_MAX];
@@ -700,8 +2016,7 @@ static int upload(PRIV *priv) {
     FLIST *fsynced;
     off_t size;
     int fd = -1;
-    ssize_t n;
-    char buffer[LOADBUFFER_SIZE];
+    uint8_t hash1[CHUNK_HASHSIZE], hash2[CHUNK_HASHSIZE];
 
     ONSTOP(priv->stop, ERROR_STOP);
     STR_INIT(loadname, str);
@@ -713,45 +2028,31 @@ static int upload(PRIV *priv) {
         switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
         case FST_UPLD|FST_LREG:
         case FST_UPLD|FST_LLNK:
-            ONERR(str_catf(&loadname, UPFILE, ++count), ERROR_MEMORY);
-            size = fsynced->st.size;
-            switch (fsynced->st.flags & FST_LTYPE) {
-            case FST_LREG:
-                fd = open(loadname.s, O_RDONLY);
-                if (fd == -1) {
-                    status = ERROR_FOPEN;
-                    goto error;
-                }
-                while (size > 0) {
-                    ONSTOP(priv->stop, ERROR_STOP);
-                    n = read_size(fd, buffer, size > sizeof(buffer) ? sizeof(buffer) : size);
-                    if (n == -1) {
-                        status = ERROR_FREAD;
-                        goto error;
-                    }
-                    if (write_size(priv->fdout, buffer, n) != n) {
-                        status = ERROR_FUPLD;
-                        goto error;
-                    }
-                    size -= n;
-                }
-                close(fd), fd = -1;
+            if (!fsynced->move)
+                ++count;
+            if ((fsynced->st.flags & (FST_LTYPE|FST_RTYPE)) != (FST_LREG|FST_RREG))
                 break;
-            case FST_LLNK:
-                if (readlink(loadname.s, buffer, size) != size) {
-                    status = ERROR_FREAD;
-                    goto error;
-                }
-                if (write_size(priv->fdout, buffer, size) != size) {
-                    status = ERROR_FUPLD;
-                    goto error;
-                }
+            READ_ONERR(size, priv->fdin, read_size, ERROR_FDNLD);
+            if (size <= 0)
                 break;
+            if (read_size(priv->fdin, hash1, sizeof(hash1)) != sizeof(hash1)) {
+                status = ERROR_FDNLD;
+                goto error;
             }
-            if (unlink(loadname.s) == -1) {
-                status = ERROR_FREMOVE;
+            if (fsynced->move || size >= fsynced->st.size)
+                break;
+            ONERR(str_catf(&loadname, UPFILE, count), ERROR_MEMORY);
+            fd = open(loadname.s, O_RDONLY);
+            if (fd == -1) {
+                status = ERROR_FOPEN;
                 goto error;
             }
+            status = chunk_hashfile(hash2, fd, size, priv->stop);
+            ONSTOP(priv->stop, ERROR_STOP);
+            ONERR(status, ERROR_FREAD);
+            close(fd), fd = -1;
+            if (!memcmp(hash1, hash2, sizeof(hash1)))  /* the peer has a prefix of this file */
+                fsynced->tail = size;
             break;
         }
     }
@@ -762,96 +2063,74 @@ error:
     return status;
 }
 
-static int download(PRIV *priv) {
+/* Whether the uploader sends the chunk list of a file, decided the same
+ * way on both sides.  Only a receiver with a chunk index can fill chunks,
+ * from a previous version of the same file or from any file indexed at
+ * another path, so a new path is chunked as well. */
+static bool is_chunked(bool index, bool regular, off_t size) {
+    return index && regular && size >= CHUNK_FILEMIN;
+}
+
+static int send_chunks(PRIV *priv) {
     int status = INT_MIN;
-#ifdef _INCLUDE_progress_h
-    PROGRESS progress;
-#endif  /* #ifdef _INCLUDE_progress_h */
     STR loadname;
     char str[PATH_MAX];
     unsigned long count;
     FLIST *fsynced;
-    off_t size;
     int fd = -1;
-    ssize_t n;
-    char buffer[LOADBUFFER_SIZE];
-    struct timeval tv[2];
 
     ONSTOP(priv->stop, ERROR_STOP);
-#ifdef _INCLUDE_progress_h
-    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'D');
-#endif  /* #ifdef _INCLUDE_progress_h */
     STR_INIT(loadname, str);
     ONERR(str_cats(&loadname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
     loadname.hold = true;
     count = 0;
     for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
         ONSTOP(priv->stop, ERROR_STOP);
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
-        case FST_DNLD|FST_RREG:
-        case FST_DNLD|FST_RLNK:
-            ONERR(str_catf(&loadname, DOWNFILE, ++count), ERROR_MEMORY);
-            size = fsynced->st.size;
-            switch (fsynced->st.flags & FST_RTYPE) {
-            case FST_RREG:
-                fd = creat(loadname.s, S_IRUSR|S_IWUSR);
-                if (fd == -1) {
-                    status = ERROR_FMAKE;
-                    goto error;
-                }
-                while (size > 0) {
-                    ONSTOP(priv->stop, ERROR_STOP);
-                    n = read_size(priv->fdin, buffer, size > sizeof(buffer) ? sizeof(buffer) : size);
-                    if (n == -1) {
-                        status = ERROR_FDNLD;
-                        goto error;
-                    }
-                    if (write_size(fd, buffer, n) != n) {
-                        status = ERROR_FWRITE;
-                        goto error;
-                    }
-                    size -= n;
-#ifdef _INCLUDE_progress_h
-                    progress_update(&progress, n);
-#endif  /* #ifdef _INCLUDE_progress_h */
-                }
-                close(fd), fd = -1;
-                if (chmod(loadname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
-                    status = ERROR_SWRITE;
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+        case FST_UPLD|FST_LLNK:
+            if (fsynced->move) {  /* sent as a move, nothing to chunk */
+                if (is_chunked(priv->peerindex, (fsynced->st.flags & FST_LTYPE) == FST_LREG, fsynced->st.size) &&
+                    ISERR(write_CHUNKS(NULL, priv->fdout)) ) {
+                    status = ERROR_FUPLD;
                     goto error;
                 }
                 break;
-            case FST_RLNK:
-                if (size > sizeof(buffer)-1) {
-                    status = ERROR_SYSTEM;
-                    goto error;
-                }
-                if (read_size(priv->fdin, buffer, size) != size) {
-                    status = ERROR_FDNLD;
+            }
+            ONERR(str_catf(&loadname, UPFILE, ++count), ERROR_MEMORY);
+            if (!is_chunked(priv->peerindex, (fsynced->st.flags & FST_LTYPE) == FST_LREG, fsynced->st.size))
+                break;
+            if (fsynced->tail > 0) {  /* only the tail is sent */
+                if (ISERR(write_CHUNKS(NULL, priv->fdout))) {
+                    status = ERROR_FUPLD;
                     goto error;
                 }
-                buffer[size] = 0;
-                if (symlink(buffer, loadname.s) == -1) {
-                    status = ERROR_FWRITE;
+                break;
+            }
+            fd = open(loadname.s, O_RDONLY);
+            if (fd == -1) {
+                status = ERROR_FOPEN;
+                goto error;
+            }
+            if (is_sparse(fd, fsynced->st.size)) {  /* sent as a segment map, holes are not read */
+                close(fd), fd = -1;
+                if (ISERR(write_CHUNKS(NULL, priv->fdout))) {
+                    status = ERROR_FUPLD;
                     goto error;
                 }
-#ifdef _INCLUDE_progress_h
-                progress_update(&progress, size);
-#endif  /* #ifdef _INCLUDE_progress_h */
                 break;
             }
-            tv[0].tv_sec = fsynced->st.mtime, tv[0].tv_usec = 0;
-            tv[1].tv_sec = fsynced->st.mtime, tv[1].tv_usec = 0;
-            if (lutimes(loadname.s, tv) == -1) {
-                status = ERROR_SWRITE;
+            status = chunk_file(&fsynced->chunks, fd, fsynced->st.size, priv->stop);
+            ONSTOP(priv->stop, ERROR_STOP);
+            ONERR(status, ERROR_FREAD);
+            close(fd), fd = -1;
+            if (ISERR(write_CHUNKS(fsynced->chunks, priv->fdout))) {
+                status = ERROR_FUPLD;
                 goto error;
             }
             break;
         }
     }
-#ifdef _INCLUDE_progress_h
-    progress_term(&progress);
-#endif  /* #ifdef _INCLUDE_progress_h */
     status = 0;
 error:
     if (fd != -1)
@@ -859,124 +2138,100 @@ error:
     return status;
 }
 
-static int commit(PRIV *priv) {
+static int recv_chunks(PRIV *priv) {
     int status = INT_MIN;
-    STR pathname, loadname;
-    char str1[PATH_MAX], str2[PATH_MAX];
-#ifdef _INCLUDE_progress_h
-    PROGRESS progress;
-#endif  /* #ifdef _INCLUDE_progress_h */
-    unsigned long count;
     FLIST *fsynced;
-    struct timeval tv[2];
 
     ONSTOP(priv->stop, ERROR_STOP);
-    STR_INIT(pathname, str1);
-    STR_INIT(loadname, str2);
-    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
-    ONERR(str_cats(&loadname, pathname.s, SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
-    pathname.hold = true;
-    loadname.hold = true;
-#ifdef _INCLUDE_progress_h
-    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'R');
-#endif  /* #ifdef _INCLUDE_progress_h */
-    count = 0;
-    for (fsynced = priv->fsynced.prev; *fsynced->name; fsynced = fsynced->prev)
-        switch (fsynced->st.flags & (FST_DNLD|FST_LTYPE)) {
-        case FST_DNLD|FST_LREG:
-            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-            ONERR(str_catf(&loadname, BACKFILE, ++count, basename_c(fsynced->name)), ERROR_MEMORY);
-            if (rename(pathname.s, loadname.s) == -1) {
-                status = ERROR_FMOVE;
-                goto error;
-            }
-#ifdef _INCLUDE_progress_h
-            progress_update(&progress, 1);
-#endif  /* #ifdef _INCLUDE_progress_h */
-            break;
-        case FST_DNLD|FST_LLNK:
-            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-            if (unlink(pathname.s) == -1) {
-                status = ERROR_FREMOVE;
-                goto error;
-            }
-#ifdef _INCLUDE_progress_h
-            progress_update(&progress, 1);
-#endif  /* #ifdef _INCLUDE_progress_h */
-            break;
-        case FST_DNLD|FST_LDIR:
-            switch (fsynced->st.flags & FST_RTYPE) {
-            case FST_RREG:
-            case FST_RLNK:
-            case 0:  /* deleted */
-                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-                if (rmdir(pathname.s) == -1) {
-                    status = ERROR_FREMOVE;
-                    goto error;
-                }
-                break;
-            }
-            break;
-        }
-#ifdef _INCLUDE_progress_h
-    progress_term(&progress);
-    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'C');
-#endif  /* #ifdef _INCLUDE_progress_h */
-    count = 0;
-    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
         switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
         case FST_DNLD|FST_RREG:
-        case FST_DNLD|FST_RLNK:
-            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-            ONERR(str_catf(&loadname, DOWNFILE, ++count), ERROR_MEMORY);
-            if (rename(loadname.s, pathname.s) == -1) {
-                status = ERROR_FMOVE;
+            if (!is_chunked(priv->index, true, fsynced->st.size))
+                break;
+            if (ISERR(read_CHUNKS(&fsynced->chunks, fsynced->st.size, priv->fdin))) {
+                status = ERROR_FDNLD;
                 goto error;
             }
-#ifdef _INCLUDE_progress_h
-            progress_update(&progress, 1);
-#endif  /* #ifdef _INCLUDE_progress_h */
-            break;
-        case FST_DNLD|FST_RDIR:
-            switch (fsynced->st.flags & FST_LTYPE) {
-            case FST_LREG:
-            case FST_LLNK:
-            case 0:  /* deleted */
-                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-                if (mkdir(pathname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
-                    status = ERROR_FMAKE;
-                    goto error;
-                }
-                break;
-            case FST_LDIR:
-                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-                if (chmod(pathname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
-                    status = ERROR_SWRITE;
-                    goto error;
-                }
-                break;
-            }
             break;
         }
-#ifdef _INCLUDE_progress_h
-    progress_term(&progress);
-#endif  /* #ifdef _INCLUDE_progress_h */
-    for (fsynced = priv->fsynced.prev; *fsynced->name; fsynced = fsynced->prev)
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
-        case FST_DNLD|FST_RDIR:
-            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
-            tv[0].tv_sec = fsynced->st.mtime, tv[0].tv_usec = 0;
-            tv[1].tv_sec = fsynced->st.mtime, tv[1].tv_usec = 0;
-            if (lutimes(pathname.s, tv) == -1) {
-                status = ERROR_SWRITE;
-                goto error;
-            }
-            break;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+typedef struct {
+    uint64_t key;
+    off_t offset;
+    uint32_t size;
+    size_t name;
+} CHUNKREF;
+
+static int cmp_chunkref(const void *p1, const void *p2) {
+    const CHUNKREF *ref1 = p1, *ref2 = p2;
+
+    if (ref1->key != ref2->key)
+        return ref1->key < ref2->key ? -1 : 1;
+    return 0;
+}
+
+#define INDEX_RECSIZE (8+4)  /* key, size */
+static int read_index_group(int fd, char *name, uint8_t **buffer, size_t *size, size_t *count) {
+    int status = INT_MIN;
+    size_t length;
+    uint8_t *bnew;
+
+    READ_ONERR(length, fd, read_size, -1);
+    if (length == 0) {
+        status = 0;
+        goto error;
+    }
+    if (length > PATH_MAX-1) {
+        status = -1;
+        goto error;
+    }
+    if (read_size(fd, name, length) != length) {
+        status = -1;
+        goto error;
+    }
+    name[length] = 0;
+    READ_ONERR(*count, fd, read_size, -1);
+    if (*count > SIZE_MAX / INDEX_RECSIZE) {
+        status = -1;
+        goto error;
+    }
+    if (*count * INDEX_RECSIZE > *size) {
+        bnew = realloc(*buffer, *count * INDEX_RECSIZE);
+        if (!bnew) {
+            status = -1;
+            goto error;
         }
-    ONERR(str_cats(&pathname, SYNCDIR"/"LASTFILE, NULL), ERROR_MEMORY);
-    ONERR(str_cats(&loadname, LASTFILE, NULL), ERROR_MEMORY);
-    if (rename(loadname.s, pathname.s) == -1) {
-        status = ERROR_DWRITE;
+        *buffer = bnew, *size = *count * INDEX_RECSIZE;
+    }
+    if (read_size(fd, *buffer, *count * INDEX_RECSIZE) != *count * INDEX_RECSIZE) {
+        status = -1;
+        goto error;
+    }
+    status = 1;
+error:
+    return status;
+}
+
+static int write_index_group(int fd, const char *name, const uint8_t *buffer, size_t count) {
+    int status = INT_MIN;
+    size_t length, n;
+
+    n = length = strlen(name);
+    WRITE_ONERR(n, fd, write_size, -1);
+    if (write_size(fd, name, length) != length) {
+        status = -1;
+        goto error;
+    }
+    n = count;
+    WRITE_ONERR(n, fd, write_size, -1);
+    if (write_size(fd, buffer, count * INDEX_RECSIZE) != count * INDEX_RECSIZE) {
+        status = -1;
         goto error;
     }
     status = 0;
@@ -984,219 +2239,1792 @@ error:
     return status;
 }
 
-static int logging(PRIV *priv) {
+static bool has_index(PRIV *priv) {
+    bool index = false;
+    STR pathname;
+    char str[PATH_MAX];
+    int fd = -1;
+    uint32_t id;
+    int n;
+
+    STR_INIT(pathname, str);
+    if (ISERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"CHUNKFILE, NULL)))
+        goto error;
+    fd = open(pathname.s, O_RDONLY);
+    if (fd == -1)
+        goto error;
+    READ(id, fd, read_size, n);
+    if (ISERR(n))
+        goto error;
+    index = id == PSYNC_CHUNKID;
+error:
+    if (fd != -1)
+        close(fd);
+    return index;
+}
+
+static int load_index(PRIV *priv, CHUNKREF **refs, size_t *count, char **names) {
     int status = INT_MIN;
     STR pathname;
     char str[PATH_MAX];
-    FILE *fp = NULL;
-    struct {
-        unsigned long backup;
-        unsigned long deleted;
-        unsigned long added;
-        unsigned long modified;
-        unsigned long uploaded;
-    } count;
+    int fd = -1;
+    uint32_t id;
+    int n;
+    char name[PATH_MAX];
+    uint8_t *buffer = NULL, *p;
+    size_t size = 0, nrec, rsize = 0, length, nsize = 0, nlength = 0;
+    off_t offset;
+    void *pnew;
+
+    *refs = NULL, *count = 0, *names = NULL;
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"CHUNKFILE, NULL), ERROR_MEMORY);
+    fd = open(pathname.s, O_RDONLY);
+    if (fd == -1) {
+        status = 0;
+        goto error;
+    }
+    READ(id, fd, read_size, n);
+    if (ISERR(n) || id != PSYNC_CHUNKID) {
+        status = 0;
+        goto error;
+    }
+    while ((n = read_index_group(fd, name, &buffer, &size, &nrec)) > 0) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        length = strlen(name) + 1;
+        if (nlength + length > nsize) {
+            pnew = realloc(*names, (nlength + length) * 2);
+            if (!pnew) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            *names = pnew, nsize = (nlength + length) * 2;
+        }
+        memcpy(*names + nlength, name, length);
+        if (*count + nrec > rsize) {
+            pnew = realloc(*refs, sizeof(**refs) * (*count + nrec) * 2);
+            if (!pnew) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            *refs = pnew, rsize = (*count + nrec) * 2;
+        }
+        for (offset = 0, p = buffer; p < buffer + nrec * INDEX_RECSIZE; p += INDEX_RECSIZE) {
+            (*refs)[*count].key = (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 |
+                                  (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32 |
+                                  (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+                                  (uint64_t)p[6] << 8  | (uint64_t)p[7];
+            (*refs)[*count].size = (uint32_t)p[8] << 24 | (uint32_t)p[9] << 16 |
+                                   (uint32_t)p[10] << 8 | p[11];
+            (*refs)[*count].offset = offset;
+            (*refs)[*count].name = nlength;
+            offset += (*refs)[(*count)++].size;
+        }
+        nlength += length;
+    }
+    ONERR(n, ERROR_DREAD);
+    qsort(*refs, *count, sizeof(**refs), cmp_chunkref);
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    free(buffer);
+    return status;
+}
+
+static int fill_chunks(PRIV *priv) {
+    int status = INT_MIN;
+    STR pathname, loadname;
+    char str1[PATH_MAX], str2[PATH_MAX];
+    CHUNKREF *refs = NULL, *ref;
+    size_t nref;
+    char *names = NULL;
+    const char *source = NULL;
+    unsigned long count;
     FLIST *fsynced;
+    CHUNK *chunk;
+    off_t offset;
+    int fd = -1, fdsrc = -1;
+    CHUNKREF key;
+    uint8_t hash[CHUNK_HASHSIZE];
+    uint8_t *buffer = NULL;
 
     ONSTOP(priv->stop, ERROR_STOP);
-    STR_INIT(pathname, str);
-    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/"LOGFILE, NULL), ERROR_MEMORY);
-    fp = fopen(pathname.s, "w");
-    if (!fp) {
-        status = ERROR_DMAKE;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        if (fsynced->chunks && fsynced->st.flags & FST_DNLD)
+            break;
+    if (!*fsynced->name) {
+        status = 0;
         goto error;
     }
-    memset(&count, 0, sizeof(count));
+    if (ISERR(status = load_index(priv, &refs, &nref, &names)))
+        goto error;
+    buffer = malloc(CHUNK_MAX);
+    if (!buffer) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    STR_INIT(pathname, str1);
+    STR_INIT(loadname, str2);
+    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, pathname.s, SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
+    pathname.hold = true;
+    loadname.hold = true;
+    count = 0;
     for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
         ONSTOP(priv->stop, ERROR_STOP);
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
-        case FST_DNLD|FST_LREG:
-            ++count.backup;
-        case FST_DNLD|FST_LDIR:
-        case FST_DNLD|FST_LLNK:
-            ++count.deleted;
-            break;
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
         case FST_DNLD|FST_RREG:
-        case FST_DNLD|FST_RDIR:
         case FST_DNLD|FST_RLNK:
-            ++count.added;
-            break;
-        case FST_DNLD|FST_LREG|FST_RREG:
-        case FST_DNLD|FST_LREG|FST_RDIR:
-        case FST_DNLD|FST_LREG|FST_RLNK:
-            ++count.backup;
-        case FST_DNLD|FST_LDIR|FST_RREG:
-        case FST_DNLD|FST_LDIR|FST_RDIR:
-        case FST_DNLD|FST_LDIR|FST_RLNK:
-        case FST_DNLD|FST_LLNK|FST_RREG:
-        case FST_DNLD|FST_LLNK|FST_RDIR:
-        case FST_DNLD|FST_LLNK|FST_RLNK:
-            ++count.modified;
-            break;
-        }
-        switch (fsynced->st.flags & FST_UPLD) {
-        case FST_UPLD:
-            ++count.uploaded;
+            ++count;
+            if (!fsynced->chunks)
+                break;
+            ONERR(str_catf(&loadname, DOWNFILE, count), ERROR_MEMORY);
+            fd = creat(loadname.s, S_IRUSR|S_IWUSR);
+            if (fd == -1) {
+                status = ERROR_FMAKE;
+                goto error;
+            }
+            if (ftruncate(fd, fsynced->st.size) == -1) {
+                status = ERROR_FWRITE;
+                goto error;
+            }
+            preallocate(fd, fsynced->st.size);
+            offset = 0;
+            for (chunk = fsynced->chunks->chunk; chunk < fsynced->chunks->chunk + fsynced->chunks->count; ++chunk) {
+                ONSTOP(priv->stop, ERROR_STOP);
+                chunk->need = true;
+                key.key = chunk_key(chunk->hash);
+                ref = nref > 0 ? bsearch(&key, refs, nref, sizeof(*refs), cmp_chunkref) : NULL;
+                if (ref && ref->size == chunk->size && chunk->size <= CHUNK_MAX) {
+                    if (source != names + ref->name) {
+                        if (fdsrc != -1)
+                            close(fdsrc), fdsrc = -1;
+                        source = names + ref->name;
+                        ONERR(str_cats(&pathname, source, NULL), ERROR_MEMORY);
+                        fdsrc = open(pathname.s, O_RDONLY);
+                    }
+                    if (fdsrc != -1 &&
+                        pread(fdsrc, buffer, chunk->size, ref->offset) == chunk->size ) {
+                        chunk_hash(hash, buffer, chunk->size);
+                        if (!memcmp(hash, chunk->hash, sizeof(hash))) {
+                            if (pwrite(fd, buffer, chunk->size, offset) != chunk->size) {
+                                status = ERROR_FWRITE;
+                                goto error;
+                            }
+                            chunk->need = false;
+                        }
+                    }
+                }
+                offset += chunk->size;
+            }
+            close(fd), fd = -1;
             break;
         }
     }
-    fprintf(fp, "%lu deleted, %lu added, %lu modified / %lu uploaded\n",
-            count.deleted, count.added, count.modified, count.uploaded );
+    status = 0;
+error:
+    if (fdsrc != -1)
+        close(fdsrc);
+    if (fd != -1)
+        close(fd);
+    free(buffer);
+    free(names);
+    free(refs);
+    return status;
+}
+
+static int send_needs(PRIV *priv) {
+    int status = INT_MIN;
+    FLIST *fsynced;
+    size_t length, n;
+    uint8_t *buffer = NULL;
+    CHUNK *chunk;
+
+    ONSTOP(priv->stop, ERROR_STOP);
     for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
         ONSTOP(priv->stop, ERROR_STOP);
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
-        case FST_DNLD|FST_LREG:
-            fprintf(fp, "D %s -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
-            break;
-        case FST_DNLD|FST_LDIR:
-            fprintf(fp, "D %s/\n", fsynced->name);
-            break;
-        case FST_DNLD|FST_LLNK:
-            fprintf(fp, "D %s@\n", fsynced->name);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+        case FST_DNLD|FST_RREG:
+            if (!fsynced->chunks)
+                break;
+            length = (fsynced->chunks->count + 7) / 8;
+            buffer = calloc(length, 1);
+            if (!buffer) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            for (n = 0, chunk = fsynced->chunks->chunk; n < fsynced->chunks->count; ++n, ++chunk)
+                if (chunk->need)
+                    buffer[n / 8] |= 1 << n % 8;
+            if (write_size(priv->fdout, buffer, length) != length) {
+                status = ERROR_FUPLD;
+                goto error;
+            }
+            free(buffer), buffer = NULL;
             break;
         }
     }
+    status = 0;
+error:
+    free(buffer);
+    return status;
+}
+
+static int recv_needs(PRIV *priv) {
+    int status = INT_MIN;
+    FLIST *fsynced;
+    size_t length, n;
+    uint8_t *buffer = NULL;
+    CHUNK *chunk;
+
+    ONSTOP(priv->stop, ERROR_STOP);
     for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
         ONSTOP(priv->stop, ERROR_STOP);
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
-        case FST_DNLD|FST_RREG:
-            fprintf(fp, "A %s\n", fsynced->name);
-            break;
-        case FST_DNLD|FST_RDIR:
-            fprintf(fp, "A %s/\n", fsynced->name);
-            break;
-        case FST_DNLD|FST_RLNK:
-            fprintf(fp, "A %s@\n", fsynced->name);
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+            if (!fsynced->chunks)
+                break;
+            length = (fsynced->chunks->count + 7) / 8;
+            buffer = malloc(length);
+            if (!buffer) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            if (read_size(priv->fdin, buffer, length) != length) {
+                status = ERROR_FDNLD;
+                goto error;
+            }
+            for (n = 0, chunk = fsynced->chunks->chunk; n < fsynced->chunks->count; ++n, ++chunk)
+                chunk->need = buffer[n / 8] >> n % 8 & 1;
+            free(buffer), buffer = NULL;
             break;
         }
-    }
-    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
-        ONSTOP(priv->stop, ERROR_STOP);
-        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
-        case FST_DNLD|FST_RREG|FST_LREG:
-            fprintf(fp, "M %s -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
-            break;
-        case FST_DNLD|FST_RREG|FST_LDIR:
-        case FST_DNLD|FST_RREG|FST_LLNK:
-            fprintf(fp, "M %s\n", fsynced->name);
-            break;
-        case FST_DNLD|FST_RDIR|FST_LREG:
-            fprintf(fp, "M %s/ -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
-            break;
-        case FST_DNLD|FST_RDIR|FST_LDIR:
-        case FST_DNLD|FST_RDIR|FST_LLNK:
-            fprintf(fp, "M %s/\n", fsynced->name);
-            break;
-        case FST_DNLD|FST_RLNK|FST_LREG:
-            fprintf(fp, "M %s@ -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
-            break;
-        case FST_DNLD|FST_RLNK|FST_LDIR:
-        case FST_DNLD|FST_RLNK|FST_LLNK:
-            fprintf(fp, "M %s@\n", fsynced->name);
-            break;
+    }
+    status = 0;
+error:
+    free(buffer);
+    return status;
+}
+
+typedef struct {
+    FLIST *fsynced;
+    unsigned long index;  /* DOWNFILE number on the peer */
+    unsigned long upnum;  /* UPFILE number here, 0 when moved */
+    int priority;         /* first matching priority glob, lower goes first */
+    int64_t key;          /* order within the same priority */
+} SLOT;
+
+static int priority_of(const char *globs, const char *name) {
+    char glob[PATH_MAX];
+    const char *s;
+    size_t length;
+    int n;
+
+    n = 0;
+    while (globs && *globs) {
+        s = strchr(globs, ',');
+        length = s ? s - globs : strlen(globs);
+        if (length < sizeof(glob)) {
+            memcpy(glob, globs, length), glob[length] = 0;
+            if (!fnmatch(glob, name, 0))
+                break;
+        }
+        globs += length;
+        if (*globs)
+            ++globs;
+        ++n;
+    }
+    return n;
+}
+
+static int cmp_slot(const void *p1, const void *p2) {
+    const SLOT *s1 = p1, *s2 = p2;
+
+    if (s1->priority != s2->priority)
+        return s1->priority < s2->priority ? -1 : 1;
+    if (s1->key != s2->key)
+        return s1->key < s2->key ? -1 : 1;
+    return s1->index < s2->index ? -1 : s1->index > s2->index;
+}
+
+/* List the payloads to send in the order asked for by priv->priority and
+ * priv->order.  Each carries its position in fsynced order, which is the
+ * DOWNFILE number the peer stores it under. */
+static int new_schedule(PRIV *priv, SLOT **slots, size_t *count) {
+    int status = INT_MIN;
+    FLIST *fsynced;
+    SLOT *slot;
+    unsigned long upnum;
+
+    *slots = NULL, *count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+        case FST_UPLD|FST_LLNK:
+            ++*count;
+            break;
+        }
+    if (*count > 0) {
+        *slots = malloc(sizeof(**slots) * *count);
+        if (!*slots)
+            goto error;
+    }
+    slot = *slots;
+    upnum = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+        case FST_UPLD|FST_LLNK:
+            slot->fsynced = fsynced;
+            slot->index = slot - *slots + 1;
+            slot->upnum = fsynced->move ? 0 : ++upnum;
+            slot->priority = priority_of(priv->priority, fsynced->name);
+            switch (priv->order) {
+            case ORDER_SIZE:
+                slot->key = fsynced->st.size;
+                break;
+            case ORDER_NEW:
+                slot->key = -(int64_t)fsynced->st.mtime;
+                break;
+            default:
+                slot->key = 0;
+            }
+            ++slot;
+            break;
+        }
+    if (*count > 1 && (priv->order != ORDER_NAME || (priv->priority && *priv->priority)))
+        qsort(*slots, *count, sizeof(**slots), cmp_slot);
+    status = 0;
+error:
+    return status;
+}
+
+static int upload(PRIV *priv) {
+    int status = INT_MIN;
+    STR loadname;
+    char str[PATH_MAX];
+    SLOT *slots = NULL, *slot;
+    size_t count;
+    unsigned long index;
+    FLIST *fsynced;
+    CHUNK *chunk;
+    size_t length;
+    bool sparse = false;
+    off_t size, part, hole;
+    int64_t t, tfile;
+    int fd = -1;
+    ssize_t n;
+    char buffer[LOADBUFFER_SIZE];
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(loadname, str);
+    ONERR(str_cats(&loadname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
+    loadname.hold = true;
+    ONERR(new_schedule(priv, &slots, &count), ERROR_MEMORY);
+    for (slot = slots; slot < slots + count; ++slot) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        stats_count(&priv->phases, 1);
+        fsynced = slot->fsynced;
+        index = slot->index;
+        WRITE_ONERR(index, priv->fdout, write_size, ERROR_FUPLD);
+        if (fsynced->move) {
+            n = PAYLOAD_MOVE;
+            WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+            n = length = strlen(fsynced->move->name);
+            WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+            if (write_size(priv->fdout, fsynced->move->name, length) != length) {
+                status = ERROR_FUPLD;
+                goto error;
+            }
+            continue;
+        }
+        tfile = TRACE_BEGIN();
+        ONERR(str_catf(&loadname, UPFILE, slot->upnum), ERROR_MEMORY);
+        size = fsynced->st.size;
+        switch (fsynced->st.flags & FST_LTYPE) {
+        case FST_LREG:
+            fd = open(loadname.s, O_RDONLY);
+            if (fd == -1) {
+                status = ERROR_FOPEN;
+                goto error;
+            }
+            if (fsynced->tail > 0) {
+                n = PAYLOAD_TAIL;
+                WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+                part = fsynced->tail;
+                WRITE_ONERR(part, priv->fdout, write_size, ERROR_FUPLD);
+                if (lseek(fd, fsynced->tail, SEEK_SET) == -1) {
+                    status = ERROR_FREAD;
+                    goto error;
+                }
+                size -= fsynced->tail;
+            }
+            else if (!fsynced->chunks && is_sparse(fd, size)) {
+                n = PAYLOAD_SPARSE;
+                WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+                sparse = true;
+            }
+            else {
+                n = PAYLOAD_DATA;
+                WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+            }
+            chunk = fsynced->chunks ? fsynced->chunks->chunk : NULL;
+            while (size > 0) {
+                if (chunk) {  /* send only the chunks the peer could not fill */
+                    part = chunk->size;
+                    if (!chunk++->need) {
+                        if (lseek(fd, part, SEEK_CUR) == -1) {
+                            status = ERROR_FREAD;
+                            goto error;
+                        }
+                        size -= part;
+                        continue;
+                    }
+                }
+                else if (sparse) {  /* skip the hole, send the data after it */
+                    if (ISERR(next_data(fd, fsynced->st.size - size, fsynced->st.size, &hole, &part))) {
+                        status = ERROR_FREAD;
+                        goto error;
+                    }
+                    size -= hole;
+                    WRITE_ONERR(hole, priv->fdout, write_size, ERROR_FUPLD);
+                    n = part;
+                    WRITE_ONERR(n, priv->fdout, write_size, ERROR_FUPLD);
+                }
+                else
+                    part = size;
+                while (part > 0) {
+                    ONSTOP(priv->stop, ERROR_STOP);
+                    n = read_size(fd, priv->upbuf, ratelimit_size(&priv->rlup, part > (off_t)priv->bufsize ? priv->bufsize : part));
+                    if (n == -1) {
+                        status = ERROR_FREAD;
+                        goto error;
+                    }
+                    ONERR(ratelimit_wait(&priv->rlup, n, priv->stop), ERROR_STOP);
+                    t = ratelimit_now(&priv->rlup);
+                    if (write_size(priv->fdout, priv->upbuf, n) != n) {
+                        status = ERROR_FUPLD;
+                        goto error;
+                    }
+                    ratelimit_rtt(&priv->rlup, ratelimit_now(&priv->rlup) - t);
+                    part -= n, size -= n;
+                }
+            }
+            close(fd), fd = -1;
+            sparse = false;
+            break;
+        case FST_LLNK:
+            if (readlink(loadname.s, buffer, size) != size) {
+                status = ERROR_FREAD;
+                goto error;
+            }
+            if (write_size(priv->fdout, buffer, size) != size) {
+                status = ERROR_FUPLD;
+                goto error;
+            }
+            break;
+        }
+        if (unlink(loadname.s) == -1) {
+            status = ERROR_FREMOVE;
+            goto error;
+        }
+        trace_span(tfile, "file", "upload", fsynced->name, fsynced->st.size);
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    free(slots);
+    return status;
+}
+
+static int cmp_name(const void *p1, const void *p2) {
+    return strcmp(p1, (*(FLIST *const *)p2)->name);
+}
+
+static int cmp_prefix(const void *p1, const void *p2) {
+    return strcmp(p1, ((const PREFIX *)p2)->fsynced->name);
+}
+
+static int download(PRIV *priv) {
+    int status = INT_MIN;
+#ifdef _INCLUDE_progress_h
+    PROGRESS progress;
+#endif  /* #ifdef _INCLUDE_progress_h */
+    STR pathname, loadname;
+    char str1[PATH_MAX], str2[PATH_MAX];
+    FLIST **fsource = NULL, **fdown = NULL;
+    bool *claimed = NULL;  /* fsource already moved by a download */
+    size_t length, n1, n2;
+    unsigned long count, index;
+    FLIST *fsynced, **f;
+    PREFIX *prefix;
+    CHUNK *chunk;
+    uint8_t hash[CHUNK_HASHSIZE];
+    char name[PATH_MAX];
+    struct stat st;
+    off_t size, part, hole;
+    int fd = -1;
+    bool direct = false;
+    ssize_t n;
+    char buffer[LOADBUFFER_SIZE];
+    struct timeval tv[2];
+    int64_t tfile;
+
+#ifdef _INCLUDE_progress_h
+    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'D');
+#endif  /* #ifdef _INCLUDE_progress_h */
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str1);
+    STR_INIT(loadname, str2);
+    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, pathname.s, SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
+    pathname.hold = true;
+    loadname.hold = true;
+    n2 = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_LREG:
+            ++n2;
+            break;
+        }
+    if (n2 > 0) {
+        fsource = malloc(sizeof(*fsource) * n2);
+        claimed = calloc(n2, sizeof(*claimed));
+        if (!fsource || !claimed) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+        n1 = 0;
+        for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+            switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+            case FST_DNLD|FST_LREG:
+                fsource[n1++] = fsynced;
+                break;
+            }
+    }
+    count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+        case FST_DNLD|FST_RREG:
+        case FST_DNLD|FST_RLNK:
+            ++count;
+            break;
+        }
+    if (count > 0) {
+        fdown = malloc(sizeof(*fdown) * count);
+        if (!fdown) {
+            status = ERROR_MEMORY;
+            goto error;
+        }
+        n1 = 0;
+        for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+            switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+            case FST_DNLD|FST_RREG:
+            case FST_DNLD|FST_RLNK:
+                fdown[n1++] = fsynced;
+                break;
+            }
+    }
+    for (n1 = 0; n1 < count; ++n1) {  /* payloads come in the order the peer scheduled */
+        ONSTOP(priv->stop, ERROR_STOP);
+        stats_count(&priv->phases, 1);
+        READ_ONERR(index, priv->fdin, read_size, ERROR_FDNLD);
+        if (index < 1 || index > count || !fdown[index-1]) {
+            status = ERROR_FDNLD;
+            goto error;
+        }
+        fsynced = fdown[index-1], fdown[index-1] = NULL;
+        tfile = TRACE_BEGIN();
+        ONERR(str_catf(&loadname, DOWNFILE, index), ERROR_MEMORY);
+        size = fsynced->st.size;
+        switch (fsynced->st.flags & FST_RTYPE) {
+        case FST_RREG:
+            READ_ONERR(length, priv->fdin, read_size, ERROR_FDNLD);
+            switch (length) {
+            case PAYLOAD_MOVE:  /* moved from a file being deleted here */
+                READ_ONERR(length, priv->fdin, read_size, ERROR_FDNLD);
+                if (length > sizeof(name)-1) {
+                    status = ERROR_FDNLD;
+                    goto error;
+                }
+                if (read_size(priv->fdin, name, length) != length) {
+                    status = ERROR_FDNLD;
+                    goto error;
+                }
+                name[length] = 0;
+                f = n2 > 0 ? bsearch(name, fsource, n2, sizeof(*fsource), cmp_name) : NULL;
+                if (!f || claimed[f - fsource]) {  /* a file moves to one place only */
+                    status = ERROR_FDNLD;
+                    goto error;
+                }
+                claimed[f - fsource] = true;
+                ONERR(str_cats(&pathname, (*f)->name, NULL), ERROR_MEMORY);
+                if (lstat(pathname.s, &st) == -1 || !S_ISREG(st.st_mode)) {
+                    status = ERROR_SREAD;
+                    goto error;
+                }
+                fsynced->move = *f;  /* left in the tree until commit() */
+                break;
+            case PAYLOAD_TAIL:  /* appended to the file here */
+                READ_ONERR(part, priv->fdin, read_size, ERROR_FDNLD);
+                prefix = priv->prefixes > 0 ? bsearch(fsynced->name, priv->prefix, priv->prefixes, sizeof(*priv->prefix), cmp_prefix) : NULL;
+                if (!prefix || part != prefix->size || part >= size) {  /* only a prefix offered */
+                    status = ERROR_FDNLD;
+                    goto error;
+                }
+                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+                fd = open(loadname.s, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+                if (fd == -1) {
+                    status = ERROR_FMAKE;
+                    goto error;
+                }
+                if (ISERR(copy_prefix(pathname.s, fd, part, priv->stop))) {
+                    status = ERROR_FREAD;
+                    goto error;
+                }
+                /* the local file may have changed since send_prefix()
+                 * hashed it; the sender has committed to the tail, so a
+                 * copy that differs fails the run before commit() and
+                 * the next run transfers the file in full */
+                if (lseek(fd, 0, SEEK_SET) == -1) {
+                    status = ERROR_FREAD;
+                    goto error;
+                }
+                status = chunk_hashfile(hash, fd, part, priv->stop);
+                ONSTOP(priv->stop, ERROR_STOP);
+                ONERR(status, ERROR_FREAD);
+                if (memcmp(hash, prefix->hash, sizeof(hash))) {
+                    status = ERROR_FREAD;
+                    goto error;
+                }
+                if (lseek(fd, part, SEEK_SET) == -1) {
+                    status = ERROR_FWRITE;
+                    goto error;
+                }
+                size -= part;
+                /* fall through */
+            case PAYLOAD_SPARSE:
+            case PAYLOAD_DATA:
+                if (fd == -1) {
+                    if (fsynced->chunks)  /* created and partly filled by fill_chunks() */
+                        fd = open(loadname.s, O_WRONLY);
+                    else if (length == PAYLOAD_DATA)
+                        fd = create_file(priv, loadname.s, size, &direct);
+                    else
+                        fd = creat(loadname.s, S_IRUSR|S_IWUSR);
+                    if (fd == -1) {
+                        status = ERROR_FMAKE;
+                        goto error;
+                    }
+                }
+                chunk = fsynced->chunks ? fsynced->chunks->chunk : NULL;
+                while (size > 0) {
+                    if (chunk) {
+                        part = chunk->size;
+                        if (!chunk++->need) {
+                            if (lseek(fd, part, SEEK_CUR) == -1) {
+                                status = ERROR_FWRITE;
+                                goto error;
+                            }
+                            size -= part;
+                            continue;
+                        }
+                    }
+                    else if (length == PAYLOAD_SPARSE) {  /* seeking over the hole leaves it unallocated */
+                        READ_ONERR(hole, priv->fdin, read_size, ERROR_FDNLD);
+                        READ_ONERR(part, priv->fdin, read_size, ERROR_FDNLD);
+                        if (hole < 0 || part < 0 || hole > size - part ||
+                            (part == 0 && hole != size) ) {
+                            status = ERROR_FDNLD;
+                            goto error;
+                        }
+                        if (lseek(fd, hole, SEEK_CUR) == -1) {
+                            status = ERROR_FWRITE;
+                            goto error;
+                        }
+                        size -= hole;
+#ifdef _INCLUDE_progress_h
+                        progress_update(&progress, hole);  /* put_total() counts the holes too */
+#endif  /* #ifdef _INCLUDE_progress_h */
+                    }
+                    else
+                        part = size;
+                    while (part > 0) {
+                        ONSTOP(priv->stop, ERROR_STOP);
+                        n = read_size(priv->fdin, priv->downbuf, ratelimit_size(&priv->rldown, part > (off_t)priv->bufsize ? priv->bufsize : part));
+                        if (n == -1) {
+                            status = ERROR_FDNLD;
+                            goto error;
+                        }
+                        ONERR(ratelimit_wait(&priv->rldown, n, priv->stop), ERROR_STOP);
+                        if (direct && n % DIRECT_ALIGN) {  /* unaligned end of the file */
+                            if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == -1) {
+                                status = ERROR_FWRITE;
+                                goto error;
+                            }
+                            direct = false;
+                        }
+                        if (write_size(fd, priv->downbuf, n) != n) {
+                            status = ERROR_FWRITE;
+                            goto error;
+                        }
+                        part -= n, size -= n;
+#ifdef _INCLUDE_progress_h
+                        progress_update(&progress, n);
+#endif  /* #ifdef _INCLUDE_progress_h */
+                    }
+                }
+                if (length == PAYLOAD_SPARSE &&
+                    ftruncate(fd, fsynced->st.size) == -1 ) {  /* trailing hole */
+                    status = ERROR_FWRITE;
+                    goto error;
+                }
+                ONERR(sync_file(priv, fd), ERROR_FWRITE);
+                if (fstat(fd, &st) == -1) {
+                    status = ERROR_SREAD;
+                    goto error;
+                }
+                close(fd), fd = -1;
+                direct = false;
+                break;
+            default:
+                status = ERROR_FDNLD;
+                goto error;
+            }
+            fsynced->st.dev = st.st_dev;
+            fsynced->st.ino = st.st_ino;
+            if (fsynced->move) {
+                trace_span(tfile, "file", "download", fsynced->name, fsynced->st.size);
+                continue;
+            }
+            if (chmod(loadname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
+                status = ERROR_SWRITE;
+                goto error;
+            }
+            break;
+        case FST_RLNK:
+            if (size > sizeof(buffer)-1) {
+                status = ERROR_SYSTEM;
+                goto error;
+            }
+            if (read_size(priv->fdin, buffer, size) != size) {
+                status = ERROR_FDNLD;
+                goto error;
+            }
+            buffer[size] = 0;
+            if (symlink(buffer, loadname.s) == -1) {
+                status = ERROR_FWRITE;
+                goto error;
+            }
+#ifdef _INCLUDE_progress_h
+            progress_update(&progress, size);
+#endif  /* #ifdef _INCLUDE_progress_h */
+            break;
+        }
+        tv[0].tv_sec = fsynced->st.mtime, tv[0].tv_usec = 0;
+        tv[1].tv_sec = fsynced->st.mtime, tv[1].tv_usec = 0;
+        if (lutimes(loadname.s, tv) == -1) {
+            status = ERROR_SWRITE;
+            goto error;
+        }
+        trace_span(tfile, "file", "download", fsynced->name, fsynced->st.size);
+    }
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    status = 0;
+error:
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    if (fd != -1)
+        close(fd);
+    free(fdown);
+    free(claimed);
+    free(fsource);
+    return status;
+}
+
+static int commit(PRIV *priv) {
+    int status = INT_MIN;
+    STR pathname, loadname;
+    char str1[PATH_MAX], str2[PATH_MAX];
+#ifdef _INCLUDE_progress_h
+    PROGRESS progress;
+#endif  /* #ifdef _INCLUDE_progress_h */
+    BATCH batch;
+    unsigned long count;
+    FLIST *fsynced;
+    struct timeval tv[2];
+
+    batch_init(&batch, BATCH_DEPTH);
+#ifdef _INCLUDE_progress_h
+    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'R');
+#endif  /* #ifdef _INCLUDE_progress_h */
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str1);
+    STR_INIT(loadname, str2);
+    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, pathname.s, SYNCDIR"/"LOCKDIR"/", NULL), ERROR_MEMORY);
+    pathname.hold = true;
+    loadname.hold = true;
+    count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+        case FST_DNLD|FST_RREG:
+            ++count;
+            if (!fsynced->move)
+                break;
+            /* moved from a file being deleted here: only now is it taken
+             * out of the tree, so a failed download() leaves it in place */
+            ONERR(str_cats(&pathname, fsynced->move->name, NULL), ERROR_MEMORY);
+            ONERR(str_catf(&loadname, DOWNFILE, count), ERROR_MEMORY);
+            if (rename(pathname.s, loadname.s) == -1) {
+                status = ERROR_FMOVE;
+                goto error;
+            }
+            fsynced->move->st.flags &= ~FST_LTYPE;
+            if (chmod(loadname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
+                status = ERROR_SWRITE;
+                goto error;
+            }
+            tv[0].tv_sec = fsynced->st.mtime, tv[0].tv_usec = 0;
+            tv[1].tv_sec = fsynced->st.mtime, tv[1].tv_usec = 0;
+            if (lutimes(loadname.s, tv) == -1) {
+                status = ERROR_SWRITE;
+                goto error;
+            }
+            break;
+        case FST_DNLD|FST_RLNK:
+            ++count;
+            break;
+        }
+    count = 0;
+    for (fsynced = priv->fsynced.prev; *fsynced->name; fsynced = fsynced->prev)
+        switch (fsynced->st.flags & (FST_DNLD|FST_LTYPE)) {
+        case FST_DNLD|FST_LREG:
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            ONERR(str_catf(&loadname, BACKFILE, ++count, basename_c(fsynced->name)), ERROR_MEMORY);
+            if (ISERR(status = batch_rename(&batch, pathname.s, loadname.s, ERROR_FMOVE)))
+                goto error;
+#ifdef _INCLUDE_progress_h
+            progress_update(&progress, 1);
+#endif  /* #ifdef _INCLUDE_progress_h */
+            break;
+        case FST_DNLD|FST_LLNK:
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            if (ISERR(status = batch_unlink(&batch, pathname.s, ERROR_FREMOVE)))
+                goto error;
+#ifdef _INCLUDE_progress_h
+            progress_update(&progress, 1);
+#endif  /* #ifdef _INCLUDE_progress_h */
+            break;
+        case FST_DNLD|FST_LDIR:
+            switch (fsynced->st.flags & FST_RTYPE) {
+            case FST_RREG:
+            case FST_RLNK:
+            case 0:  /* deleted */
+                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+                if (ISERR(status = batch_rmdir(&batch, pathname.s, ERROR_FREMOVE)))
+                    goto error;
+                break;
+            }
+            break;
+        }
+    if (ISERR(status = batch_flush(&batch)))
+        goto error;
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+    progress_init(&progress, 0, priv->info, PROGRESS_INTERVAL, 'C');
+#endif  /* #ifdef _INCLUDE_progress_h */
+    count = 0;
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+        case FST_DNLD|FST_RREG:
+        case FST_DNLD|FST_RLNK:
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            ONERR(str_catf(&loadname, DOWNFILE, ++count), ERROR_MEMORY);
+            if (ISERR(status = batch_rename(&batch, loadname.s, pathname.s, ERROR_FMOVE)))
+                goto error;
+#ifdef _INCLUDE_progress_h
+            progress_update(&progress, 1);
+#endif  /* #ifdef _INCLUDE_progress_h */
+            stats_count(&priv->phases, 1);
+            break;
+        case FST_DNLD|FST_RDIR:
+            switch (fsynced->st.flags & FST_LTYPE) {
+            case FST_LREG:
+            case FST_LLNK:
+            case 0:  /* deleted */
+                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+                if (ISERR(status = batch_mkdir(&batch, pathname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO), ERROR_FMAKE)))
+                    goto error;
+                break;
+            case FST_LDIR:
+                ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+                if (chmod(pathname.s, fsynced->st.mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1) {
+                    status = ERROR_SWRITE;
+                    goto error;
+                }
+                break;
+            }
+            break;
+        }
+    if (ISERR(status = batch_flush(&batch)))
+        goto error;
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    for (fsynced = priv->fsynced.prev; *fsynced->name; fsynced = fsynced->prev)
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE)) {
+        case FST_DNLD|FST_RDIR:
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            tv[0].tv_sec = fsynced->st.mtime, tv[0].tv_usec = 0;
+            tv[1].tv_sec = fsynced->st.mtime, tv[1].tv_usec = 0;
+            if (lutimes(pathname.s, tv) == -1) {
+                status = ERROR_SWRITE;
+                goto error;
+            }
+            break;
+        }
+    ONERR(sync_tree(priv), ERROR_FWRITE);
+    ONERR(str_cats(&pathname, SYNCDIR"/"LASTFILE, NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, LASTFILE, NULL), ERROR_MEMORY);
+    if (rename(loadname.s, pathname.s) == -1) {
+        status = ERROR_DWRITE;
+        goto error;
+    }
+    ONERR(str_cats(&pathname, SYNCDIR, NULL), ERROR_MEMORY);
+    ONERR(sync_dir(priv, pathname.s), ERROR_DWRITE);
+    status = 0;
+error:
+#ifdef _INCLUDE_progress_h
+    progress_term(&progress);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    batch_term(&batch);
+    return status;
+}
+
+static int logging(PRIV *priv) {
+    int status = INT_MIN;
+    STR pathname;
+    char str[PATH_MAX];
+    FILE *fp = NULL;
+    struct {
+        unsigned long backup;
+        unsigned long deleted;
+        unsigned long added;
+        unsigned long modified;
+        unsigned long uploaded;
+    } count;
+    FLIST *fsynced;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/"LOGFILE, NULL), ERROR_MEMORY);
+    fp = fopen(pathname.s, "w");
+    if (!fp) {
+        status = ERROR_DMAKE;
+        goto error;
+    }
+    memset(&count, 0, sizeof(count));
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_LREG:
+            ++count.backup;
+        case FST_DNLD|FST_LDIR:
+        case FST_DNLD|FST_LLNK:
+            ++count.deleted;
+            break;
+        case FST_DNLD|FST_RREG:
+        case FST_DNLD|FST_RDIR:
+        case FST_DNLD|FST_RLNK:
+            ++count.added;
+            break;
+        case FST_DNLD|FST_LREG|FST_RREG:
+        case FST_DNLD|FST_LREG|FST_RDIR:
+        case FST_DNLD|FST_LREG|FST_RLNK:
+            ++count.backup;
+        case FST_DNLD|FST_LDIR|FST_RREG:
+        case FST_DNLD|FST_LDIR|FST_RDIR:
+        case FST_DNLD|FST_LDIR|FST_RLNK:
+        case FST_DNLD|FST_LLNK|FST_RREG:
+        case FST_DNLD|FST_LLNK|FST_RDIR:
+        case FST_DNLD|FST_LLNK|FST_RLNK:
+            ++count.modified;
+            break;
+        }
+        switch (fsynced->st.flags & FST_UPLD) {
+        case FST_UPLD:
+            ++count.uploaded;
+            break;
+        }
+    }
+    fprintf(fp, "%lu deleted, %lu added, %lu modified / %lu uploaded\n",
+            count.deleted, count.added, count.modified, count.uploaded );
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_LREG:
+            fprintf(fp, "D %s -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
+            break;
+        case FST_DNLD|FST_LDIR:
+            fprintf(fp, "D %s/\n", fsynced->name);
+            break;
+        case FST_DNLD|FST_LLNK:
+            fprintf(fp, "D %s@\n", fsynced->name);
+            break;
+        }
+    }
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_RREG:
+            if (fsynced->move)
+                fprintf(fp, "A %s <- %s\n", fsynced->name, fsynced->move->name);
+            else
+                fprintf(fp, "A %s\n", fsynced->name);
+            break;
+        case FST_DNLD|FST_RDIR:
+            fprintf(fp, "A %s/\n", fsynced->name);
+            break;
+        case FST_DNLD|FST_RLNK:
+            fprintf(fp, "A %s@\n", fsynced->name);
+            break;
+        }
+    }
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_DNLD|FST_RTYPE|FST_LTYPE)) {
+        case FST_DNLD|FST_RREG|FST_LREG:
+            fprintf(fp, "M %s -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
+            break;
+        case FST_DNLD|FST_RREG|FST_LDIR:
+        case FST_DNLD|FST_RREG|FST_LLNK:
+            fprintf(fp, "M %s\n", fsynced->name);
+            break;
+        case FST_DNLD|FST_RDIR|FST_LREG:
+            fprintf(fp, "M %s/ -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
+            break;
+        case FST_DNLD|FST_RDIR|FST_LDIR:
+        case FST_DNLD|FST_RDIR|FST_LLNK:
+            fprintf(fp, "M %s/\n", fsynced->name);
+            break;
+        case FST_DNLD|FST_RLNK|FST_LREG:
+            fprintf(fp, "M %s@ -> %lu,%s\n", fsynced->name, count.backup--, basename_c(fsynced->name));
+            break;
+        case FST_DNLD|FST_RLNK|FST_LDIR:
+        case FST_DNLD|FST_RLNK|FST_LLNK:
+            fprintf(fp, "M %s@\n", fsynced->name);
+            break;
+        }
+    }
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
+        case FST_UPLD|FST_LREG:
+            fprintf(fp, "U %s\n", fsynced->name);
+            break;
+        case FST_UPLD|FST_LDIR:
+            fprintf(fp, "U %s/\n", fsynced->name);
+            break;
+        case FST_UPLD|FST_LLNK:
+            fprintf(fp, "U %s@\n", fsynced->name);
+            break;
+        case FST_UPLD:
+            fprintf(fp, "U %s%%\n", fsynced->name);
+            break;
+        }
+    }
+    status = 0;
+error:
+    if (fp)
+        fclose(fp);
+    return status;
+}
+
+/* Regular files written or received in this sync, as listed by logging(),
+ * large enough to be chunked. */
+static bool is_indexed(const FLIST *fsynced) {
+    return ((fsynced->st.flags & (FST_DNLD|FST_RTYPE)) == (FST_DNLD|FST_RREG) ||
+            (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) == (FST_UPLD|FST_LREG) ) &&
+           fsynced->st.size >= CHUNK_FILEMIN;
+}
+
+static int save_index(PRIV *priv) {
+    int status = INT_MIN;
+    STR pathname, loadname, filename;
+    char str1[PATH_MAX], str2[PATH_MAX], str3[PATH_MAX];
+    int fdold = -1, fdnew = -1, fd = -1;
+    uint32_t id;
+    int n, cmp;
+    char name[PATH_MAX];
+    uint8_t *buffer = NULL, *record = NULL, *p;
+    size_t size = 0, count;
+    FLIST *fsynced;
+    CHUNKS *chunks = NULL;
+    struct stat st;
+    CHUNK *chunk;
+    uint64_t key;
+    unsigned int k;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next)
+        if (fsynced->st.flags & (FST_DNLD|FST_UPLD))
+            break;
+    if (!*fsynced->name) {  /* nothing changed */
+        status = 0;
+        goto error;
+    }
+    STR_INIT(pathname, str1);
+    STR_INIT(loadname, str2);
+    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"CHUNKFILE, NULL), ERROR_MEMORY);
+    ONERR(str_cats(&loadname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/"CHUNKFILE, NULL), ERROR_MEMORY);
+    STR_INIT(filename, str3);
+    ONERR(str_cats(&filename, priv->dirname, "/", NULL), ERROR_MEMORY);
+    filename.hold = true;
+    fdold = open(pathname.s, O_RDONLY);
+    if (fdold != -1) {
+        READ(id, fdold, read_size, n);
+        if (ISERR(n) || id != PSYNC_CHUNKID)
+            close(fdold), fdold = -1;
+    }
+    fdnew = creat(loadname.s, S_IRUSR|S_IWUSR);
+    if (fdnew == -1) {
+        status = ERROR_DMAKE;
+        goto error;
+    }
+    id = PSYNC_CHUNKID;
+    WRITE_ONERR(id, fdnew, write_size, ERROR_DWRITE);
+    n = fdold != -1 ? read_index_group(fdold, name, &buffer, &size, &count) : 0;
+    ONERR(n, ERROR_DREAD);
+    fsynced = priv->fsynced.next;
+    while (n > 0 || *fsynced->name) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        cmp = n > 0 ? *fsynced->name ? strcmp(name, fsynced->name) : -1 : 1;
+        if (cmp <= 0) {
+            if (cmp == 0 && !(fsynced->st.flags & (FST_DNLD|FST_UPLD)))  /* unchanged */
+                if (ISERR(write_index_group(fdnew, name, buffer, count))) {
+                    status = ERROR_DWRITE;
+                    goto error;
+                }
+            n = read_index_group(fdold, name, &buffer, &size, &count);
+            ONERR(n, ERROR_DREAD);
+            if (cmp < 0)  /* no longer synced, dropped */
+                continue;
+        }
+        if (is_indexed(fsynced)) {  /* written or received in this sync */
+            chunks = fsynced->chunks;
+            if (!chunks) {  /* not chunked for the transfer, read back */
+                ONERR(str_cats(&filename, fsynced->name, NULL), ERROR_MEMORY);
+                fd = open(filename.s, O_RDONLY);
+                if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {  /* changed since */
+                    if (fd != -1)
+                        close(fd), fd = -1;
+                    fsynced = fsynced->next;
+                    continue;
+                }
+                status = chunk_file(&chunks, fd, st.st_size, priv->stop);
+                ONSTOP(priv->stop, ERROR_STOP);
+                ONERR(status, ERROR_FREAD);
+                close(fd), fd = -1;
+            }
+            record = malloc(INDEX_RECSIZE * chunks->count);
+            if (!record) {
+                status = ERROR_MEMORY;
+                goto error;
+            }
+            for (p = record, chunk = chunks->chunk; chunk < chunks->chunk + chunks->count; ++chunk) {
+                key = chunk_key(chunk->hash);
+                for (k = 0; k < 8; ++k)
+                    *p++ = key >> (56 - k * 8);
+                *p++ = chunk->size >> 24, *p++ = chunk->size >> 16;
+                *p++ = chunk->size >> 8,  *p++ = chunk->size;
+            }
+            if (ISERR(write_index_group(fdnew, fsynced->name, record, chunks->count))) {
+                status = ERROR_DWRITE;
+                goto error;
+            }
+            free(record), record = NULL;
+            if (chunks != fsynced->chunks)
+                free(chunks);
+            chunks = NULL;
+        }
+        fsynced = fsynced->next;
+    }
+    count = 0;
+    WRITE_ONERR(count, fdnew, write_size, ERROR_DWRITE);
+    close(fdnew), fdnew = -1;
+    if (rename(loadname.s, pathname.s) == -1) {
+        status = ERROR_DWRITE;
+        goto error;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    if (chunks && chunks != fsynced->chunks)
+        free(chunks);
+    if (fdnew != -1)
+        close(fdnew);
+    if (fdold != -1)
+        close(fdold);
+    free(record);
+    free(buffer);
+    return status;
+}
+
+typedef struct CLEAN {
+    struct CLEAN *next;
+    time_t backup;
+    off_t dedup;
+    volatile sig_atomic_t *stop;
+    char dirname[];
+} CLEAN;
+
+/* Queue of sync directories whose expired backups are left to remove,
+ * and whether a cleaner thread is working through it. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    CLEAN *next, **last;
+    bool busy;
+} cleaner = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+    .next  = NULL,
+    .last  = &cleaner.next,
+    .busy  = false
+};
+
+static int clean_r(STR pathname, const char *entname, time_t backup,
+                   time_t deadline, volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    struct stat st;
+    DIR *dir = NULL;
+    struct dirent *ent;
+
+    if (time(NULL) >= deadline) {  /* the rest is left to the next run */
+        status = ERROR_STOP;
+        goto error;
+    }
+    ONERR(str_cats(&pathname, "/", entname, NULL), ERROR_MEMORY);
+    if (stat(pathname.s, &st) == -1) {
+        status = errno == ENOENT ? 0 : ERROR_DREAD;  /* another run may be cleaning too */
+        goto error;
+    }
+    if (backup == -1 || st.st_mtime < backup)
+        switch (st.st_mode & S_IFMT) {
+        case S_IFDIR:
+            dir = opendir(pathname.s);
+            if (!dir) {
+                status = errno == ENOENT ? 0 : ERROR_DOPEN;
+                goto error;
+            }
+            while (ent = readdir(dir), ent) {
+                ONSTOP(stop, ERROR_STOP);
+                if (!strcmp(ent->d_name, ".") ||
+                    !strcmp(ent->d_name, "..") )
+                    continue;
+                if (ISERR(status = clean_r(pathname, ent->d_name, -1, deadline, stop)))
+                    goto error;
+            }
+            closedir(dir), dir = NULL;
+            ONERR(str_cats(&pathname, "", NULL), ERROR_MEMORY);
+            if (rmdir(pathname.s) == -1 && errno != ENOENT) {
+                status = ERROR_DREMOVE;
+                goto error;
+            }
+            break;
+        default:
+            if (unlink(pathname.s) == -1 && errno != ENOENT) {
+                status = ERROR_DREMOVE;
+                goto error;
+            }
+        }
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    return status;
+}
+
+/* Make the backup file pathname share its contents through the store:
+ * it becomes the store entry named by its SHA-256, mode, owner and mtime,
+ * or is replaced by a hard link to the entry already there.  A link shares
+ * these with the entry, so backups that differ in them keep entries of
+ * their own.  The link count of an entry is its reference count.  Files
+ * that can not be shared are left as they are.  Returns 1 if pathname was
+ * replaced, which changes the times of its directory. */
+static int store_file(STR storename, const char *pathname, const struct stat *stfile,
+                      volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    STR tmpname;
+    char str[PATH_MAX];
+    uint8_t hash[CHUNK_HASHSIZE];
+    char name[CHUNK_HASHSIZE*2+1];
+    struct stat st;
+    int fd;
+    size_t n;
+
+    fd = open(pathname, O_RDONLY);
+    if (fd == -1) {
+        status = 0;
+        goto error;
+    }
+    status = chunk_hashfile(hash, fd, stfile->st_size, stop);
+    close(fd);
+    ONSTOP(stop, ERROR_STOP);
+    if (ISERR(status)) {
+        status = 0;
+        goto error;
+    }
+    for (n = 0; n < CHUNK_HASHSIZE; ++n)
+        sprintf(name + n * 2, "%02x", hash[n]);
+    ONERR(str_catf(&storename, "%s-%o-%lu-%lu-%lld", name, (unsigned int)stfile->st_mode,
+                   (unsigned long)stfile->st_uid, (unsigned long)stfile->st_gid, (long long)stfile->st_mtime ), ERROR_MEMORY);
+    if (link(pathname, storename.s) != -1 ||  /* the first of these contents */
+        errno != EEXIST ||
+        lstat(storename.s, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != stfile->st_size ||
+        st.st_mode != stfile->st_mode || st.st_mtime != stfile->st_mtime ||
+        st.st_uid != stfile->st_uid || st.st_gid != stfile->st_gid ) {
+        status = 0;
+        goto error;
+    }
+    STR_INIT(tmpname, str);
+    ONERR(str_cats(&tmpname, storename.s, NULL), ERROR_MEMORY);
+    ONERR(str_catf(&tmpname, "~%d", getpid()), ERROR_MEMORY);
+    status = 0;
+    if (link(storename.s, tmpname.s) != -1) {
+        if (rename(tmpname.s, pathname) != -1)
+            status = 1;
+        else
+            unlink(tmpname.s);
+    }
+error:
+    return status;
+}
+
+/* The times of the directories it changes are put back, since clean_r()
+ * expires a backup by the mtime of its directory. */
+static int store_r(STR pathname, const char *entname, STR storename, off_t dedup,
+                   time_t deadline, volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    struct stat st;
+    DIR *dir = NULL;
+    struct dirent *ent;
+    bool changed = false;
+    struct timeval tv[2];
+
+    if (time(NULL) >= deadline) {
+        status = ERROR_STOP;
+        goto error;
+    }
+    ONERR(str_cats(&pathname, "/", entname, NULL), ERROR_MEMORY);
+    if (lstat(pathname.s, &st) == -1) {
+        status = 0;
+        goto error;
+    }
+    switch (st.st_mode & S_IFMT) {
+    case S_IFDIR:
+        dir = opendir(pathname.s);
+        if (!dir) {
+            status = 0;
+            goto error;
+        }
+        while (ent = readdir(dir), ent) {
+            ONSTOP(stop, ERROR_STOP);
+            if (!strcmp(ent->d_name, ".") ||
+                !strcmp(ent->d_name, "..") )
+                continue;
+            if (ISERR(status = store_r(pathname, ent->d_name, storename, dedup, deadline, stop)))
+                goto error;
+            if (status > 0)
+                changed = true;
+        }
+        break;
+    case S_IFREG:
+        if (st.st_nlink == 1 && st.st_size >= dedup) {  /* not in the store yet */
+            status = store_file(storename, pathname.s, &st, stop);
+            goto error;
+        }
+        break;
+    }
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    if (changed && !ISERR(str_cats(&pathname, "", NULL))) {
+        tv[0].tv_sec = st.st_atime, tv[0].tv_usec = 0;
+        tv[1].tv_sec = st.st_mtime, tv[1].tv_usec = 0;
+        lutimes(pathname.s, tv);
+    }
+    return status;
+}
+
+/* Remove the store entries no backup links to any more, and links left
+ * by a store_file() that did not finish. */
+static int reclaim_store(STR storename, time_t deadline,
+                         volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    DIR *dir = NULL;
+    struct dirent *ent;
+    struct stat st;
+
+    dir = opendir(storename.s);
+    if (!dir) {
+        status = ERROR_DOPEN;
+        goto error;
+    }
+    storename.hold = true;
+    while (ent = readdir(dir), ent) {
+        ONSTOP(stop, ERROR_STOP);
+        if (time(NULL) >= deadline) {
+            status = ERROR_STOP;
+            goto error;
+        }
+        if (!strcmp(ent->d_name, ".") ||
+            !strcmp(ent->d_name, "..") )
+            continue;
+        ONERR(str_cats(&storename, ent->d_name, NULL), ERROR_MEMORY);
+        if (lstat(storename.s, &st) != -1 &&
+            (st.st_nlink == 1 || strchr(ent->d_name, '~')) &&
+            unlink(storename.s) == -1 && errno != ENOENT ) {
+            status = ERROR_DREMOVE;
+            goto error;
+        }
+    }
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    return status;
+}
+
+static int clean_dir(CLEAN *clean) {
+    int status = INT_MIN;
+    STR pathname, storename;
+    char str1[PATH_MAX], str2[PATH_MAX];
+    DIR *dir = NULL;
+    struct dirent *ent;
+    time_t deadline;
+
+    ONSTOP(clean->stop, ERROR_STOP);
+    deadline = time(NULL) + CLEAN_BUDGET;
+    STR_INIT(pathname, str1);
+    ONERR(str_cats(&pathname, clean->dirname, "/"SYNCDIR, NULL), ERROR_MEMORY);
+    dir = opendir(pathname.s);
+    if (!dir) {
+        status = ERROR_DOPEN;
+        goto error;
+    }
+    while (ent = readdir(dir), ent) {
+        ONSTOP(clean->stop, ERROR_STOP);
+        if (!strcmp(ent->d_name, ".") ||
+            !strcmp(ent->d_name, "..") ||
+            !strcmp(ent->d_name, LASTFILE) ||
+            !strcmp(ent->d_name, CHUNKFILE) ||
+            !strcmp(ent->d_name, SCANFILE) ||
+            !strcmp(ent->d_name, DIRTYFILE) ||
+            !strcmp(ent->d_name, STATSFILE) ||
+            !strcmp(ent->d_name, STOREDIR) ||
+            !strcmp(ent->d_name, LOCKDIR) )
+            continue;
+        if (ISERR(status = clean_r(pathname, ent->d_name, clean->backup, deadline, clean->stop)))
+            goto error;
+    }
+    ONERR(str_cats(&pathname, "", NULL), ERROR_MEMORY);
+    if (clean->dedup > 0) {
+        STR_INIT(storename, str2);
+        ONERR(str_cats(&storename, pathname.s, "/"STOREDIR, NULL), ERROR_MEMORY);
+        mkdir(storename.s, S_IRWXU);
+        ONERR(str_cats(&storename, "/", NULL), ERROR_MEMORY);
+        if (ISERR(status = reclaim_store(storename, deadline, clean->stop)))
+            goto error;
+        rewinddir(dir);
+        while (ent = readdir(dir), ent) {
+            ONSTOP(clean->stop, ERROR_STOP);
+            if (!strcmp(ent->d_name, ".") ||
+                !strcmp(ent->d_name, "..") ||
+                !strcmp(ent->d_name, LASTFILE) ||
+                !strcmp(ent->d_name, CHUNKFILE) ||
+                !strcmp(ent->d_name, SCANFILE) ||
+                !strcmp(ent->d_name, DIRTYFILE) ||
+                !strcmp(ent->d_name, STATSFILE) ||
+                !strcmp(ent->d_name, STOREDIR) ||
+                !strcmp(ent->d_name, LOCKDIR) )
+                continue;
+            if (ISERR(status = store_r(pathname, ent->d_name, storename, clean->dedup, deadline, clean->stop)))
+                goto error;
+        }
+    }
+    closedir(dir), dir = NULL;
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    return status;
+}
+
+static void *clean_thread(void *data) {
+    CLEAN *clean;
+    int64_t t;
+
+    trace_thread("clean");
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE);  /* this thread only */
+#endif  /* #ifdef SYS_ioprio_set */
+    pthread_mutex_lock(&cleaner.mutex);
+    while (clean = cleaner.next, clean) {
+        cleaner.next = clean->next;
+        if (!cleaner.next)
+            cleaner.last = &cleaner.next;
+        pthread_mutex_unlock(&cleaner.mutex);
+        t = TRACE_BEGIN();
+        clean_dir(clean);
+        trace_span(t, "clean", clean->dirname, NULL, -1);
+        free(clean);
+        pthread_mutex_lock(&cleaner.mutex);
+    }
+    cleaner.busy = false;
+    pthread_cond_broadcast(&cleaner.cond);
+    pthread_mutex_unlock(&cleaner.mutex);
+    return NULL;
+}
+
+/* Hand the removal of expired backups to the cleaner thread, so that
+ * neither the lock nor the peer waits for it.  The next labels are
+ * synced while it runs, and psync_clean_wait() waits for the end. */
+static int clean(PRIV *priv) {
+    int status = INT_MIN;
+    CLEAN *clean;
+    pthread_t tid;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    clean = malloc(sizeof(*clean) + strlen(priv->dirname) + 1);
+    if (!clean) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    clean->next = NULL;
+    clean->backup = priv->backup;
+    clean->dedup = priv->dedup;
+    clean->stop = priv->stop;
+    strcpy(clean->dirname, priv->dirname);
+    pthread_mutex_lock(&cleaner.mutex);
+    if (!cleaner.busy) {
+        if (pthread_create(&tid, NULL, clean_thread, NULL) != 0) {
+            pthread_mutex_unlock(&cleaner.mutex);
+            free(clean);
+            status = ERROR_SYSTEM;
+            goto error;
+        }
+        pthread_detach(tid);
+        cleaner.busy = true;
+    }
+    *cleaner.last = clean, cleaner.last = &clean->next;
+    pthread_mutex_unlock(&cleaner.mutex);
+    status = 0;
+error:
+    return status;
+}
+
+/* Leave the stats of this run ending with result in SYNCDIR, and copy
+ * them to priv->stats if any.  A plan only goes to priv->stats. */
+static int save_stats(PRIV *priv, int result) {
+    int status = INT_MIN;
+    STR pathname, loadname;
+    char str1[PATH_MAX], str2[PATH_MAX];
+    int fd = -1;
+
+    if (!priv->planning) {
+        STR_INIT(pathname, str1);
+        STR_INIT(loadname, str2);
+        ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR"/"STATSFILE, NULL), ERROR_MEMORY);
+        ONERR(str_cats(&loadname, priv->dirname, "/"SYNCDIR"/"LOCKDIR"/"STATSFILE, NULL), ERROR_MEMORY);
+        fd = creat(loadname.s, S_IRUSR|S_IWUSR);
+        if (fd == -1) {
+            status = ERROR_DMAKE;
+            goto error;
+        }
+        ONERR(stats_write(&priv->phases, priv->label, priv->dirname, priv->t, result, fd), ERROR_DWRITE);
+        close(fd), fd = -1;
+        if (rename(loadname.s, pathname.s) == -1) {
+            status = ERROR_DWRITE;
+            goto error;
         }
     }
+    if (priv->stats != -1)
+        ONERR(stats_write(&priv->phases, priv->label, priv->dirname, priv->t, result, priv->stats), ERROR_SWRITE);
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* What a sync would do on one side, as a plan reports it. */
+typedef struct {
+    intmax_t upfiles, upbytes;      /* to upload, moved files aside */
+    intmax_t movefiles, movebytes;  /* moved on the peer instead of uploaded */
+    intmax_t removes;               /* entries removed as the peer removed them */
+    intmax_t backfiles, backbytes;  /* regular files that go to the backup */
+    intmax_t rate;                  /* [byte/sec] download measured, 0: unknown */
+} PLAN;
+
+static int get_plan(PRIV *priv, PLAN *plan) {
+    int status = INT_MIN;
+    STR pathname;
+    char str[PATH_MAX];
+    FLIST *fsynced;
+    struct stat st;
+
+    ONSTOP(priv->stop, ERROR_STOP);
+    memset(plan, 0, sizeof(*plan));
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, priv->dirname, "/", NULL), ERROR_MEMORY);
+    pathname.hold = true;
     for (fsynced = priv->fsynced.next; *fsynced->name; fsynced = fsynced->next) {
         ONSTOP(priv->stop, ERROR_STOP);
         switch (fsynced->st.flags & (FST_UPLD|FST_LTYPE)) {
         case FST_UPLD|FST_LREG:
-            fprintf(fp, "U %s\n", fsynced->name);
-            break;
-        case FST_UPLD|FST_LDIR:
-            fprintf(fp, "U %s/\n", fsynced->name);
-            break;
+            if (fsynced->move) {
+                ++plan->movefiles;
+                plan->movebytes += fsynced->st.size;
+                break;
+            }
+            /* fall through */
         case FST_UPLD|FST_LLNK:
-            fprintf(fp, "U %s@\n", fsynced->name);
+            ++plan->upfiles;
+            plan->upbytes += fsynced->st.size;
             break;
-        case FST_UPLD:
-            fprintf(fp, "U %s%%\n", fsynced->name);
+        }
+        switch (fsynced->st.flags & (FST_DNLD|FST_LTYPE)) {
+        case FST_DNLD|FST_LREG:  /* only the peer's size is left in the list */
+            ONERR(str_cats(&pathname, fsynced->name, NULL), ERROR_MEMORY);
+            ++plan->backfiles;
+            if (lstat(pathname.s, &st) != -1)
+                plan->backbytes += st.st_size;
             break;
         }
+        if ((fsynced->st.flags & (FST_DNLD|FST_RTYPE)) == FST_DNLD &&
+            fsynced->st.flags & FST_LTYPE )
+            ++plan->removes;
     }
     status = 0;
 error:
-    if (fp)
-        fclose(fp);
     return status;
 }
 
-static int clean_r(STR pathname, const char *entname, time_t backup,
-                   volatile sig_atomic_t *stop ) {
+static int write_PLAN(PLAN plan, int fd) {  /* WRITE() shifts what it writes */
     int status = INT_MIN;
-    struct stat st;
-    DIR *dir = NULL;
-    struct dirent *ent;
 
-    ONERR(str_cats(&pathname, "/", entname, NULL), ERROR_MEMORY);
-    if (stat(pathname.s, &st) == -1) {
-        status = ERROR_DREAD;
-        goto error;
+    WRITE_ONERR(plan.upfiles, fd, write_size, -1);
+    WRITE_ONERR(plan.upbytes, fd, write_size, -1);
+    WRITE_ONERR(plan.movefiles, fd, write_size, -1);
+    WRITE_ONERR(plan.movebytes, fd, write_size, -1);
+    WRITE_ONERR(plan.removes, fd, write_size, -1);
+    WRITE_ONERR(plan.backfiles, fd, write_size, -1);
+    WRITE_ONERR(plan.backbytes, fd, write_size, -1);
+    WRITE_ONERR(plan.rate, fd, write_size, -1);
+    status = 0;
+error:
+    return status;
+}
+
+static int read_PLAN(PLAN *plan, int fd) {
+    int status = INT_MIN;
+
+    READ_ONERR(plan->upfiles, fd, read_size, -1);
+    READ_ONERR(plan->upbytes, fd, read_size, -1);
+    READ_ONERR(plan->movefiles, fd, read_size, -1);
+    READ_ONERR(plan->movebytes, fd, read_size, -1);
+    READ_ONERR(plan->removes, fd, read_size, -1);
+    READ_ONERR(plan->backfiles, fd, read_size, -1);
+    READ_ONERR(plan->backbytes, fd, read_size, -1);
+    READ_ONERR(plan->rate, fd, read_size, -1);
+    status = 0;
+error:
+    return status;
+}
+
+static int send_probe(PRIV *priv) {
+    int status = INT_MIN;
+    size_t size, n;
+    char buffer[LOADBUFFER_SIZE];
+
+    memset(buffer, 0, sizeof(buffer));
+    for (size = PLAN_PROBE; size > 0; size -= n) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        n = size > sizeof(buffer) ? sizeof(buffer) : size;
+        if (write_size(priv->fdout, buffer, n) != n) {
+            status = ERROR_FUPLD;
+            goto error;
+        }
     }
-    if (backup == -1 || st.st_mtime < backup)
-        switch (st.st_mode & S_IFMT) {
-        case S_IFDIR:
-            dir = opendir(pathname.s);
-            if (!dir) {
-                status = ERROR_DOPEN;
-                goto error;
-            }
-            while (ent = readdir(dir), ent) {
-                ONSTOP(stop, ERROR_STOP);
-                if (!strcmp(ent->d_name, ".") ||
-                    !strcmp(ent->d_name, "..") )
-                    continue;
-                if (ISERR(status = clean_r(pathname, ent->d_name, -1, stop)))
-                    goto error;
-            }
-            closedir(dir), dir = NULL;
-            ONERR(str_cats(&pathname, "", NULL), ERROR_MEMORY);
-            if (rmdir(pathname.s) == -1) {
-                status = ERROR_DREMOVE;
-                goto error;
-            }
-            break;
-        default:
-            if (unlink(pathname.s) == -1) {
-                status = ERROR_DREMOVE;
-                goto error;
-            }
+    status = 0;
+error:
+    return status;
+}
+
+/* The clock starts with the first buffer in, so that the time the peer
+ * took to get here does not count. */
+static int recv_probe(PRIV *priv, intmax_t *rate) {
+    int status = INT_MIN;
+    size_t size, n;
+    struct timespec begin, end;
+    int64_t nsec;
+    char buffer[LOADBUFFER_SIZE];
+
+    for (size = PLAN_PROBE; size > 0; size -= n) {
+        ONSTOP(priv->stop, ERROR_STOP);
+        n = size > sizeof(buffer) ? sizeof(buffer) : size;
+        if (read_size(priv->fdin, buffer, n) != n) {
+            status = ERROR_FDNLD;
+            goto error;
         }
+        if (size == PLAN_PROBE)
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nsec = (int64_t)(end.tv_sec - begin.tv_sec) * 1000000000 + (end.tv_nsec - begin.tv_nsec);
+    *rate = nsec > 0 ? (PLAN_PROBE - sizeof(buffer)) * 1000000000.0 / nsec : 0;
+    if (priv->bwlimit > 0 && (*rate == 0 || *rate > priv->bwlimit))
+        *rate = priv->bwlimit;
     status = 0;
 error:
-    if (dir)
-        closedir(dir);
     return status;
 }
-static int clean(PRIV *priv) {
+
+/* One line for the label, the counts of this side first and of the peer
+ * after a slash.  Both directions run at once, so the estimate is the
+ * longer of the two at the measured rates. */
+static int report_plan(PRIV *priv, const PLAN *local, const PLAN *remote) {
     int status = INT_MIN;
-    STR pathname;
-    char str[PATH_MAX];
-    DIR *dir = NULL;
-    struct dirent *ent;
- 
-    ONSTOP(priv->stop, ERROR_STOP);
-    STR_INIT(pathname, str);
-    ONERR(str_cats(&pathname, priv->dirname, "/"SYNCDIR, NULL), ERROR_MEMORY);
-    dir = opendir(pathname.s);
-    if (!dir) {
-        status = ERROR_DOPEN;
+    double up, down;
+
+    up = local->upbytes == 0 ? 0 : remote->rate > 0 ? (double)local->upbytes / remote->rate : -1;
+    down = remote->upbytes == 0 ? 0 : local->rate > 0 ? (double)remote->upbytes / local->rate : -1;
+    if (dprintf(priv->plan, "%s: upload %jd files %jd bytes, download %jd files %jd bytes, "
+                            "move %jd/%jd files, remove %jd/%jd, backup %jd/%jd files %jd/%jd bytes, ",
+                priv->label ? priv->label : priv->dirname,
+                local->upfiles, local->upbytes, remote->upfiles, remote->upbytes,
+                remote->movefiles, local->movefiles,
+                local->removes - remote->movefiles, remote->removes - local->movefiles,
+                local->backfiles - remote->movefiles, remote->backfiles - local->movefiles,
+                local->backbytes - remote->movebytes, remote->backbytes - local->movebytes ) < 0)
         goto error;
-    }
-    while (ent = readdir(dir), ent) {
-        ONSTOP(priv->stop, ERROR_STOP);
-        if (!strcmp(ent->d_name, ".") ||
-            !strcmp(ent->d_name, "..") ||
-            !strcmp(ent->d_name, LASTFILE) ||
-            !strcmp(ent->d_name, LOCKDIR) )
-            continue;
-        if (ISERR(status = clean_r(pathname, ent->d_name, priv->backup, priv->stop)))
+    if (up < 0 || down < 0) {
+        if (dprintf(priv->plan, "time unknown\n") < 0)
             goto error;
     }
-    closedir(dir), dir = NULL;
+    else if (dprintf(priv->plan, "about %.0f seconds\n", up > down ? up : down) < 0)
+        goto error;
     status = 0;
 error:
-    if (dir)
-        closedir(dir);
     return status;
 }
 
@@ -1206,73 +4034,229 @@ typedef struct {
     pthread_t tid;
 } PARAM;
 
+/* pthread_join() traced as a span named name. */
+static int join_thread(PARAM *param, const char *name) {
+    int status = INT_MIN;
+    int64_t t;
+
+    t = TRACE_BEGIN();
+    status = pthread_join(param->tid, NULL);
+    trace_span(t, "join", name, NULL, -1);
+    return status;
+}
+
 static void *write_FLIST_thread(void *data) {
     PARAM *param = data;
 
-    param->status = write_FLIST(true, &param->priv->flocal, param->priv->fdout, param->priv->stop);
+    trace_thread("send_list");
+    param->status = write_FLIST(true, false, &param->priv->flocal, param->priv->fdout, param->priv->stop);
+    return NULL;
+}
+
+static void *send_prefix_thread(void *data) {
+    PARAM *param = data;
+
+    trace_thread("send_prefix");
+    param->status = send_prefix(param->priv);
+    return NULL;
+}
+
+static void *send_chunks_thread(void *data) {
+    PARAM *param = data;
+
+    trace_thread("send_chunks");
+    param->status = send_chunks(param->priv);
+    return NULL;
+}
+
+static void *send_needs_thread(void *data) {
+    PARAM *param = data;
+
+    trace_thread("send_needs");
+    param->status = send_needs(param->priv);
     return NULL;
 }
 
 static void *upload_thread(void *data) {
     PARAM *param = data;
 
+    trace_thread("upload");
     param->status = upload(param->priv);
     return NULL;
 }
 
+static void *send_probe_thread(void *data) {
+    PARAM *param = data;
+
+    trace_thread("send_probe");
+    param->status = send_probe(param->priv);
+    return NULL;
+}
+
+/* Count what the sync would do, measure the link, and swap the counts
+ * with the peer.  Only the side that asked for the plan reports it. */
+static int plan(PRIV *priv) {
+    int status = INT_MIN;
+    PARAM param = {
+        .priv   = priv,
+        .status = INT_MIN
+    };
+    PLAN local, remote;
+
+    if (ISERR(status = get_plan(priv, &local)))
+        goto error;
+    if (pthread_create(&param.tid, NULL, send_probe_thread, &param) != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    status = recv_probe(priv, &local.rate);
+    if (join_thread(&param, "join send_probe") != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    if (ISERR(status))
+        goto error;
+    ONERR(param.status, param.status);
+    ONERR(write_PLAN(local, priv->fdout), ERROR_SUPLD);
+    ONERR(read_PLAN(&remote, priv->fdin), ERROR_SDNLD);
+    if (priv->plan != -1)
+        ONERR(report_plan(priv, &local, &remote), ERROR_SWRITE);
+    status = 0;
+error:
+    return status;
+}
+
 static int run(PRIV *priv) {
     int status = INT_MIN;
     PARAM param = {
         .priv   = priv,
         .status = INT_MIN
     };
+    int n;
 
+    stats_begin(&priv->phases, "load");
     load_fsynced(priv);
+    stats_begin(&priv->phases, "scan");
     if (ISERR(status = get_flocal(priv)))
         goto error;
     ONSTOP(priv->stop, ERROR_STOP);
-    status = sets_next_FLIST(&priv->flocal, &priv->fsynced, add_deleted_func, priv, priv->stop);
+    status = sets_next_auto_FLIST(&priv->flocal, &priv->fsynced, add_deleted_func, priv, priv->stop);
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(status, ERROR_SYSTEM);
+    stats_begin(&priv->phases, "exchange");
+    n = priv->plan != -1;
+    WRITE_ONERR(n, priv->fdout, write_size, ERROR_SUPLD);
+    READ_ONERR(n, priv->fdin, read_size, ERROR_SDNLD);
+    priv->planning = priv->plan != -1 || n;
+    priv->index = has_index(priv);
+    n = priv->index;
+    WRITE_ONERR(n, priv->fdout, write_size, ERROR_SUPLD);
+    READ_ONERR(n, priv->fdin, read_size, ERROR_SDNLD);
+    priv->peerindex = n;
     if (pthread_create(&param.tid, NULL, write_FLIST_thread, &param) != 0) {
         status = ERROR_SYSTEM;
         goto error;
     }
-    status = read_FLIST(true, &priv->fremote, priv->fdin, priv->stop);
+    status = read_FLIST(true, false, &priv->fremote, priv->fdin, priv->stop);
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(status, ERROR_SDNLD);
-    if (pthread_join(param.tid, NULL) != 0) {
+    stats_count(&priv->phases, status);
+    if (join_thread(&param, "join send_list") != 0) {
         status = ERROR_SYSTEM;
         goto error;
     }
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(param.status, ERROR_SUPLD);
-    status = sets_next_FLIST(&priv->flocal, &priv->fremote, make_fsynced_func, priv, priv->stop);
+    stats_begin(&priv->phases, "merge");
+    status = sets_next_auto_FLIST(&priv->flocal, &priv->fremote, make_fsynced_func, priv, priv->stop);
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(status, ERROR_SYSTEM);
-    if (ISERR(status = save_fsynced(priv)))
+    if (ISERR(status = make_moved(priv)))
         goto error;
+    if (priv->planning) {  /* nothing is changed beyond this point */
+        stats_begin(&priv->phases, "plan");
+        status = plan(priv);
+        goto error;
+    }
+#ifdef _INCLUDE_progress_h
+    put_total(priv);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    stats_begin(&priv->phases, "preload");
     if (ISERR(status = preload(priv)))
         goto error;
+    stats_begin(&priv->phases, "chunks");
+    if (pthread_create(&param.tid, NULL, send_prefix_thread, &param) != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    if (ISERR(status = recv_prefix(priv)))
+        goto error;
+    if (join_thread(&param, "join send_prefix") != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    ONERR(param.status, param.status);
+    if (pthread_create(&param.tid, NULL, send_chunks_thread, &param) != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    if (ISERR(status = recv_chunks(priv)))
+        goto error;
+    if (join_thread(&param, "join send_chunks") != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    ONERR(param.status, param.status);
+    if (ISERR(status = fill_chunks(priv)))
+        goto error;
+    if (pthread_create(&param.tid, NULL, send_needs_thread, &param) != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    if (ISERR(status = recv_needs(priv)))
+        goto error;
+    if (join_thread(&param, "join send_needs") != 0) {
+        status = ERROR_SYSTEM;
+        goto error;
+    }
+    ONERR(param.status, param.status);
+#ifdef _INCLUDE_progress_h
+    put_total(priv);
+#endif  /* #ifdef _INCLUDE_progress_h */
+    stats_begin(&priv->phases, "transfer");
+    if (!priv->upbuf)
+        ONERR(new_buffers(priv), ERROR_MEMORY);
+    ratelimit_init(&priv->rlup, priv->bwlimit, priv->bwbegin, priv->bwend);
+    ratelimit_init(&priv->rldown, priv->bwlimit, priv->bwbegin, priv->bwend);
     if (pthread_create(&param.tid, NULL, upload_thread, &param) != 0) {
         status = ERROR_SYSTEM;
         goto error;
     }
     if (ISERR(status = download(priv)))
         goto error;
-    if (pthread_join(param.tid, NULL) != 0) {
+    if (join_thread(&param, "join upload") != 0) {
         status = ERROR_SYSTEM;
         goto error;
     }
     ONERR(param.status, param.status);
+    stats_begin(&priv->phases, "save");
+    if (ISERR(status = save_fsynced(priv)))
+        goto error;
+    stats_begin(&priv->phases, "commit");
     if (ISERR(status = commit(priv)))
         goto error;
+    stats_begin(&priv->phases, "logging");
     if (ISERR(status = logging(priv)))
         goto error;
+    if (ISERR(status = save_index(priv)))
+        goto error;
+    stats_begin(&priv->phases, "clean");
     if (ISERR(status = clean(priv)))
         goto error;
     status = 0;
 error:
+    stats_end(&priv->phases, status);
+    save_stats(priv, status);
     return status;
 }
 
@@ -1285,6 +4269,49 @@ void psync_free(PSYNC *psync) {
     free_priv((PRIV *)psync);
 }
 
+void psync_clean_wait(void) {
+    pthread_mutex_lock(&cleaner.mutex);
+    while (cleaner.busy)
+        pthread_cond_wait(&cleaner.cond, &cleaner.mutex);
+    pthread_mutex_unlock(&cleaner.mutex);
+}
+
 int psync_run(PSYNC *psync) {
-    return run((PRIV *)psync);
+    int status = INT_MIN;
+    int fdin, fdout;
+
+    fdin = nonblock_set(psync->fdin), fdout = nonblock_set(psync->fdout);
+    status = run((PRIV *)psync);
+    nonblock_reset(psync->fdout, fdout), nonblock_reset(psync->fdin, fdin);
+    return status;
+}
+
+int psync_record(const char *const dirnames[], unsigned int count,
+                 volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    RECORD_TREE *trees = NULL;
+    char (*journals)[PATH_MAX] = NULL;
+    STR pathname;
+    unsigned int n;
+
+    trees = malloc(sizeof(*trees) * (count > 0 ? count : 1));
+    journals = malloc(sizeof(*journals) * (count > 0 ? count : 1));
+    if (!trees || !journals) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    for (n = 0; n < count; ++n) {
+        str_init(&pathname, journals[n], sizeof(journals[n]));
+        ONERR(str_cats(&pathname, dirnames[n], "/"SYNCDIR, NULL), ERROR_MEMORY);
+        mkdir(pathname.s, S_IRWXU);
+        ONERR(str_cats(&pathname, "/"DIRTYFILE, NULL), ERROR_MEMORY);
+        trees[n].dirname = dirnames[n];
+        trees[n].skip = SYNCDIR;
+        trees[n].journal = journals[n];
+    }
+    status = record_run(trees, count, stop);
+error:
+    free(journals);
+    free(trees);
+    return status;
 }
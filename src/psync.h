@@ -1,4 +1,4 @@
-/* psync.h - Last modified: 07-Mar-2026 (kobayasy)
+/* psync.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -27,9 +27,14 @@
 #define _INCLUDE_psync_h
 
 #include <signal.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
 
-#define PSYNC_FILEID 0x01665370  /* 'p', 'S', 'f', 1 */
+#define PSYNC_FILEID    0x02665370  /* 'p', 'S', 'f', 2 */
+#define PSYNC_FILEID_V1 0x01665370  /* 'p', 'S', 'f', 1 */
+#define PSYNC_CHUNKID   0x01635370  /* 'p', 'S', 'c', 1 */
+#define PSYNC_SCANID    0x02735370  /* 'p', 'S', 's', 2 */
 
 #ifndef EXPIRE_DEFAULT
 #define EXPIRE_DEFAULT (400*24*60*60)  /* [sec] */
@@ -38,6 +43,27 @@
 #define BACKUP_DEFAULT   (3*24*60*60)  /* [sec] */
 #endif  /* #ifndef BACKUP_DEFAULT */
 
+#define FSYNC_NONE  0  /* leave write back to the OS */
+#define FSYNC_BATCH 1  /* start write back while downloading, one syncfs before commit */
+#define FSYNC_FILE  2  /* fsync every downloaded file */
+#ifndef FSYNC_DEFAULT
+#define FSYNC_DEFAULT FSYNC_NONE
+#endif  /* #ifndef FSYNC_DEFAULT */
+#ifndef DIRECT_DEFAULT
+#define DIRECT_DEFAULT 0  /* [byte] write files of at least this size with O_DIRECT, 0 never */
+#endif  /* #ifndef DIRECT_DEFAULT */
+#ifndef BUFFER_DEFAULT
+#define BUFFER_DEFAULT (1024*1024)  /* [byte] transfer buffer of each direction */
+#endif  /* #ifndef BUFFER_DEFAULT */
+
+#define ORDER_NAME 0  /* payloads in path order */
+#define ORDER_SIZE 1  /* smallest first */
+#define ORDER_NEW  2  /* most recently modified first */
+#ifndef ORDER_DEFAULT
+#define ORDER_DEFAULT ORDER_NAME
+#endif  /* #ifndef ORDER_DEFAULT */
+#define PRIORITY_MAX 256  /* [byte] priority= globs, terminator included */
+
 //#define ERROR_UNKNOWN  (-1)
 #define ERROR_FTYPE    (-2)
 #define ERROR_FPERM    (-3)
@@ -67,13 +93,28 @@ typedef struct {
     const time_t t;
     time_t expire;
     time_t backup;
+    int fsync;
+    off_t direct;
+    size_t buffer;
+    uint64_t bwlimit;
+    int bwbegin, bwend;
+    int order;
+    const char *priority;
+    time_t scancache;
+    off_t dedup;
     int fdin, fdout;
     int info;
+    const char *label;
+    int stats;
+    int plan;
 } PSYNC;
 
 extern PSYNC *psync_new(const char *dirname,
                         volatile sig_atomic_t *stop );
 extern void psync_free(PSYNC *psync);
 extern int psync_run(PSYNC *psync);
+extern void psync_clean_wait(void);
+extern int psync_record(const char *const dirnames[], unsigned int count,
+                        volatile sig_atomic_t *stop );
 
 #endif  /* #ifndef _INCLUDE_psync_h */
@@ -1,4 +1,4 @@
-/* psync_psp.c - Last modified: 28-Feb-2026 (kobayasy)
+/* psync_psp.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -37,6 +37,7 @@
 #include <time.h>
 #include <pthread.h>
 #include "common.h"
+#include "trace.h"
 #include "psync.h"
 #include "psync_psp.h"
 
@@ -45,6 +46,15 @@ typedef struct s_clist {
     char *dirname;
     time_t expire;
     time_t backup;
+    int fsync;
+    off_t direct;
+    size_t buffer;
+    uint64_t bwlimit;
+    int bwbegin, bwend;
+    int order;
+    char priority[PRIORITY_MAX];
+    time_t scancache;
+    off_t dedup;
     char name[1];
 } CLIST;
 
@@ -53,6 +63,15 @@ static CLIST *new_CLIST(CLIST *clist) {
     clist->dirname = clist->name;
     clist->expire = 0;
     clist->backup = 0;
+    clist->fsync = FSYNC_NONE;
+    clist->direct = 0;
+    clist->buffer = 0;
+    clist->bwlimit = 0;
+    clist->bwbegin = 0, clist->bwend = 0;
+    clist->order = ORDER_NAME;
+    *clist->priority = 0;
+    clist->scancache = 0;
+    clist->dedup = 0;
     return clist;
 }
 
@@ -70,6 +89,15 @@ static CLIST *add_CLIST(CLIST *clist, const char *name, const char *dirname) {
     cnew->dirname = strcpy(cnew->name + length, dirname);
     cnew->expire = 0;
     cnew->backup = 0;
+    cnew->fsync = FSYNC_NONE;
+    cnew->direct = 0;
+    cnew->buffer = 0;
+    cnew->bwlimit = 0;
+    cnew->bwbegin = 0, cnew->bwend = 0;
+    cnew->order = ORDER_NAME;
+    *cnew->priority = 0;
+    cnew->scancache = 0;
+    cnew->dedup = 0;
     LIST_INSERT_NEXT(cnew, clist);
 error:
     return cnew;
@@ -155,6 +183,8 @@ static int delete_func(CLIST *c, void *data) {
 typedef struct {
     int fdin, fdout;
     int info;
+    int stats;
+    int plan;
     volatile sig_atomic_t *stop;
     CLIST *config;
     CLIST clocal, cremote;
@@ -168,10 +198,16 @@ static PRIV *new_priv(volatile sig_atomic_t *stop) {
         goto error;
     priv->fdin = -1, priv->fdout = -1;
     priv->info = -1;
+    priv->stats = -1;
+    priv->plan = -1;
     priv->stop = stop;
     priv->config = new_CLIST(&priv->clocal);
     priv->config->expire = EXPIRE_DEFAULT;
     priv->config->backup = BACKUP_DEFAULT;
+    priv->config->fsync = FSYNC_DEFAULT;
+    priv->config->direct = DIRECT_DEFAULT;
+    priv->config->buffer = BUFFER_DEFAULT;
+    priv->config->order = ORDER_DEFAULT;
     new_CLIST(&priv->cremote);
 error:
     return priv;
@@ -197,6 +233,15 @@ static CLIST *add_config(const char *name, const char *dirname, PRIV *priv) {
         goto error;
     config->expire = priv->clocal.expire;
     config->backup = priv->clocal.backup;
+    config->fsync = priv->clocal.fsync;
+    config->direct = priv->clocal.direct;
+    config->buffer = priv->clocal.buffer;
+    config->bwlimit = priv->clocal.bwlimit;
+    config->bwbegin = priv->clocal.bwbegin, config->bwend = priv->clocal.bwend;
+    config->order = priv->clocal.order;
+    strcpy(config->priority, priv->clocal.priority);
+    config->scancache = priv->clocal.scancache;
+    config->dedup = priv->clocal.dedup;
 error:
     return config;
 }
@@ -245,8 +290,20 @@ static int psync(PRIV *priv, CLIST *config) {
         if (!ack_remote) {
             psync->expire = psync->t - config->expire;
             psync->backup = psync->t - config->backup;
+            psync->fsync = config->fsync;
+            psync->direct = config->direct;
+            psync->buffer = config->buffer;
+            psync->bwlimit = config->bwlimit;
+            psync->bwbegin = config->bwbegin, psync->bwend = config->bwend;
+            psync->order = config->order;
+            psync->priority = config->priority;
+            psync->scancache = config->scancache;
+            psync->dedup = config->dedup;
             psync->fdin = priv->fdin, psync->fdout = priv->fdout;
             psync->info = priv->info;
+            psync->label = config->name;
+            psync->stats = priv->stats;
+            psync->plan = priv->plan;
             status = psync_run(psync);
         }
         else
@@ -264,12 +321,16 @@ error:
 static int psync_func(SETS sets, CLIST *clocal, CLIST *cremote, void *data) {
     int status = INT_MIN;
     PRIV *priv = data;
+    int64_t t;
 
     switch (sets) {
     case SETS_1AND2:
         if (priv->info != -1)
             dprintf(priv->info, "[%s\n", clocal->name);
-        if (ISERR(status = psync(priv, clocal)))
+        t = TRACE_BEGIN();
+        status = psync(priv, clocal);
+        trace_span(t, "label", clocal->name, NULL, -1);
+        if (ISERR(status))
             goto error;
         if (priv->info != -1) {
             if (status)
@@ -296,6 +357,7 @@ typedef struct {
 static void *write_CLIST_thread(void *data) {
     PARAM *param = data;
 
+    trace_thread("send_config");
     param->status = write_CLIST(&param->priv->clocal, param->priv->fdout, param->priv->stop);
     return NULL;
 }
@@ -306,6 +368,7 @@ static int run(PRIV *priv) {
         .priv   = priv,
         .status = INT_MIN
     };
+    int64_t t;
 
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(greeting(priv), ERROR_PROTOCOL);
@@ -316,7 +379,10 @@ static int run(PRIV *priv) {
     status = read_CLIST(&priv->cremote, priv->fdin, priv->stop);
     ONSTOP(priv->stop, ERROR_STOP);
     ONERR(status, ERROR_SDNLD);
-    if (pthread_join(param.tid, NULL) != 0) {
+    t = TRACE_BEGIN();
+    status = pthread_join(param.tid, NULL);
+    trace_span(t, "join", "join send_config", NULL, -1);
+    if (status != 0) {
         status = ERROR_SYSTEM;
         goto error;
     }
@@ -331,6 +397,29 @@ error:
     return status;
 }
 
+static int record(PRIV *priv) {
+    int status = INT_MIN;
+    const char **dirnames = NULL;
+    unsigned int count;
+    CLIST *config;
+
+    count = 0;
+    for (config = priv->clocal.next; *config->name; config = config->next)
+        ++count;
+    dirnames = malloc(sizeof(*dirnames) * (count > 0 ? count : 1));
+    if (!dirnames) {
+        status = ERROR_MEMORY;
+        goto error;
+    }
+    count = 0;
+    for (config = priv->clocal.next; *config->name; config = config->next)
+        dirnames[count++] = config->dirname;
+    status = psync_record(dirnames, count, priv->stop);
+error:
+    free(dirnames);
+    return status;
+}
+
 PSP *psp_new(volatile sig_atomic_t *stop) {
     return (PSP *)new_priv(stop);
 }
@@ -347,5 +436,15 @@ PSP_CONFIG *psp_config(const char *name, const char *dirname, PSP *psp) {
 }
 
 int psp_run(PSP *psp) {
-    return run((PRIV *)psp);
+    int status = INT_MIN;
+    int fdin, fdout;
+
+    fdin = nonblock_set(psp->fdin), fdout = nonblock_set(psp->fdout);
+    status = run((PRIV *)psp);
+    nonblock_reset(psp->fdout, fdout), nonblock_reset(psp->fdin, fdin);
+    return status;
+}
+
+int psp_record(PSP *psp) {
+    return record((PRIV *)psp);
 }
@@ -1,4 +1,4 @@
-/* psync_psp.h - Last modified: 28-Feb-2026 (kobayasy)
+/* psync_psp.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2018-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -30,7 +30,7 @@
 #include <time.h>
 #include "psync.h"
 
-#define PSYNC_PROTID 0x03705370  /* 'p', 'S', 'p', 3 */
+#define PSYNC_PROTID 0x09705370  /* 'p', 'S', 'p', 9 */
 
 #define ERROR_NOTREADYLOCAL  1
 #define ERROR_NOTREADYREMOTE 2
@@ -39,12 +39,23 @@
 typedef struct {
     int fdin, fdout;
     int info;
+    int stats;
+    int plan;
 } PSP;
 
 typedef struct {
     const char *dirname;
     time_t expire;
     time_t backup;
+    int fsync;
+    off_t direct;
+    size_t buffer;
+    uint64_t bwlimit;
+    int bwbegin, bwend;
+    int order;
+    char priority[PRIORITY_MAX];
+    time_t scancache;
+    off_t dedup;
     const char name[1];
 } PSP_CONFIG;
 
@@ -52,5 +63,6 @@ extern PSP *psp_new(volatile sig_atomic_t *stop);
 extern void psp_free(PSP *psp);
 extern PSP_CONFIG *psp_config(const char *name, const char *dirname, PSP *psp);
 extern int psp_run(PSP *psp);
+extern int psp_record(PSP *psp);
 
 #endif  /* #ifndef _INCLUDE_psync_psp_h */
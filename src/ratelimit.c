@@ -0,0 +1,194 @@
+/* ratelimit.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+#include "ratelimit.h"
+
+#define BURST_DIV   4        /* bucket holds 1/BURST_DIV second of tokens */
+#define PIECE_DIV   8        /* send at most 1/PIECE_DIV second of data at once */
+#define PIECE_ALIGN 4096     /* [byte] */
+#define SLEEP_MAX   100000   /* [usec] check for stop at least this often */
+#define RTT_SLACK   5000     /* [usec] latency above the lowest seen tolerated */
+#define RATE_DIV    16       /* backoff floor and recovery step, fraction of rate */
+
+static int64_t clock_default(void *data) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);  /* not stepped by the time of day */
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static time_t time_default(void *data) {
+    return time(NULL);
+}
+
+static void sleep_default(int64_t usec, void *data) {
+    struct timespec ts = {
+        .tv_sec  = usec / 1000000,
+        .tv_nsec = usec % 1000000 * 1000
+    };
+
+    nanosleep(&ts, NULL);
+}
+
+static int64_t burst(RATELIMIT *ratelimit) {
+    int64_t size;
+
+    size = ratelimit->current / BURST_DIV;
+    return size < PIECE_ALIGN ? PIECE_ALIGN : size;
+}
+
+/* true when it is the time of day the limit applies */
+static bool active(RATELIMIT *ratelimit) {
+    time_t t;
+    struct tm tm;
+    int minute;
+
+    if (ratelimit->begin == ratelimit->end)
+        return true;
+    t = ratelimit->time(ratelimit->data);
+    if (!localtime_r(&t, &tm))
+        return true;
+    minute = tm.tm_hour * 60 + tm.tm_min;
+    if (ratelimit->begin < ratelimit->end)
+        return minute >= ratelimit->begin && minute < ratelimit->end;
+    return minute >= ratelimit->begin || minute < ratelimit->end;
+}
+
+static void refill(RATELIMIT *ratelimit, int64_t now) {
+    int64_t elapsed;
+
+    elapsed = now - ratelimit->last;
+    if (elapsed <= 0)
+        return;
+    if (elapsed > 1000000)
+        elapsed = 1000000;
+    ratelimit->tokens += elapsed * (int64_t)ratelimit->current / 1000000;
+    if (ratelimit->tokens > burst(ratelimit))
+        ratelimit->tokens = burst(ratelimit);
+    ratelimit->last = now;
+}
+
+void ratelimit_init(RATELIMIT *ratelimit, uint64_t rate, int begin, int end) {
+    ratelimit->rate = rate;
+    ratelimit->current = rate;
+    ratelimit->begin = begin, ratelimit->end = end;
+    ratelimit->tokens = 0;
+    ratelimit->last = -1;
+    ratelimit->rttmin = -1;
+    ratelimit->clock = clock_default;
+    ratelimit->time = time_default;
+    ratelimit->sleep = sleep_default;
+    ratelimit->data = NULL;
+}
+
+/* Largest piece of at most size bytes to hand to ratelimit_wait() at once,
+ * so that a big transfer buffer does not turn into long bursts and pauses. */
+size_t ratelimit_size(RATELIMIT *ratelimit, size_t size) {
+    size_t piece;
+
+    if (!ratelimit->rate)
+        return size;
+    piece = ratelimit->rate / PIECE_DIV / PIECE_ALIGN * PIECE_ALIGN;
+    if (piece < PIECE_ALIGN)
+        piece = PIECE_ALIGN;
+    return size < piece ? size : piece;
+}
+
+/* Take size bytes worth of tokens, sleeping until the bucket allows it. */
+int ratelimit_wait(RATELIMIT *ratelimit, size_t size,
+                   volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    int64_t now, wait;
+    bool on;
+
+    if (!ratelimit->rate) {
+        status = 0;
+        goto error;
+    }
+    now = ratelimit->clock(ratelimit->data);
+    on = active(ratelimit);
+    if (ratelimit->last == -1 || !on) {
+        ratelimit->tokens = burst(ratelimit);
+        ratelimit->last = now;
+        if (!on) {
+            status = 0;
+            goto error;
+        }
+    }
+    refill(ratelimit, now);
+    ratelimit->tokens -= size;
+    while (ratelimit->tokens < 0) {
+        ONSTOP(stop, -1);
+        wait = -ratelimit->tokens * 1000000 / (int64_t)ratelimit->current + 1;
+        if (wait > SLEEP_MAX)
+            wait = SLEEP_MAX;
+        ratelimit->sleep(wait, ratelimit->data);
+        refill(ratelimit, ratelimit->clock(ratelimit->data));
+    }
+    status = 0;
+error:
+    return status;
+}
+
+/* Feed back how long a write of one piece blocked.  A latency well above
+ * the lowest seen means the link is queueing, so the rate backs off by a
+ * quarter; otherwise it recovers by RATE_DIV steps up to the configured
+ * rate. */
+void ratelimit_rtt(RATELIMIT *ratelimit, int64_t usec) {
+    uint64_t floor;
+
+    if (!ratelimit->rate)
+        return;
+    if (ratelimit->rttmin == -1 || usec < ratelimit->rttmin)
+        ratelimit->rttmin = usec;
+    floor = ratelimit->rate / RATE_DIV;
+    if (usec > ratelimit->rttmin * 2 + RTT_SLACK) {
+        ratelimit->current -= ratelimit->current / 4;
+        if (ratelimit->current < floor)
+            ratelimit->current = floor;
+    }
+    else if (ratelimit->current < ratelimit->rate) {
+        ratelimit->current += floor;
+        if (ratelimit->current > ratelimit->rate)
+            ratelimit->current = ratelimit->rate;
+    }
+    if (!ratelimit->current)
+        ratelimit->current = 1;
+}
+
+int64_t ratelimit_now(RATELIMIT *ratelimit) {
+    return ratelimit->clock(ratelimit->data);
+}
@@ -0,0 +1,54 @@
+/* ratelimit.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_ratelimit_h
+#define _INCLUDE_ratelimit_h
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t rate;     /* [byte/sec] configured, 0: unlimited */
+    uint64_t current;  /* [byte/sec] after backoff */
+    int begin, end;    /* [min] of the day the limit applies, begin == end: all day */
+    int64_t tokens;    /* [byte] */
+    int64_t last;      /* [usec] time of the last refill */
+    int64_t rttmin;    /* [usec] lowest write latency seen, -1: none yet */
+    int64_t (*clock)(void *data);            /* [usec] monotonic */
+    time_t (*time)(void *data);              /* time of day for begin and end */
+    void (*sleep)(int64_t usec, void *data);
+    void *data;
+} RATELIMIT;
+
+extern void ratelimit_init(RATELIMIT *ratelimit, uint64_t rate, int begin, int end);
+extern size_t ratelimit_size(RATELIMIT *ratelimit, size_t size);
+extern int ratelimit_wait(RATELIMIT *ratelimit, size_t size,
+                          volatile sig_atomic_t *stop );
+extern void ratelimit_rtt(RATELIMIT *ratelimit, int64_t usec);
+extern int64_t ratelimit_now(RATELIMIT *ratelimit);
+
+#endif  /* #ifndef _INCLUDE_ratelimit_h */
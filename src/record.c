@@ -0,0 +1,370 @@
+/* record.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif  /* #ifdef HAVE_SYS_INOTIFY_H */
+#include "common.h"
+#include "record.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define WATCH_MASK (IN_ATTRIB|IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_DONT_FOLLOW)
+#define EVENT_SIZE (64*1024)  /* [byte] */
+
+typedef struct {
+    unsigned int tree;
+    int parent;  /* wd of the parent directory, -1 for the top */
+    bool dirty;  /* recorded since the last mark */
+    char *path;  /* relative to the top, "" for the top */
+} WATCH;
+
+typedef struct {
+    const RECORD_TREE *trees;
+    unsigned int count;
+    int fd;
+    int *journal;  /* fd of each tree */
+    int *mark;  /* wd watching each journal */
+    WATCH **watch;  /* indexed by wd */
+    int size;
+} PRIV;
+
+static int record_char(int fd, char c) {
+    int status = INT_MIN;
+    char line[2];
+
+    line[0] = c, line[1] = '\n';
+    if (write_size(fd, line, sizeof(line)) != sizeof(line)) {
+        status = -1;
+        goto error;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+static int record_line(int fd, const char *path) {
+    int status = INT_MIN;
+    char line[PATH_MAX+2];
+    int length;
+
+    length = snprintf(line, sizeof(line), "/%s\n", path);
+    if (length >= sizeof(line) || strchr(path, '\n')) {  /* can not be a line */
+        status = record_char(fd, RECORD_LOST);
+        goto error;
+    }
+    if (write_size(fd, line, length) != length) {
+        status = -1;
+        goto error;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+static int set_dirty(PRIV *priv, int wd) {
+    int status = INT_MIN;
+    WATCH *watch;
+
+    watch = wd >= 0 && wd < priv->size ? priv->watch[wd] : NULL;
+    if (watch && !watch->dirty) {
+        ONERR(record_line(priv->journal[watch->tree], watch->path), -1);
+        watch->dirty = true;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+/* Watch the directory path and every directory below it.  A directory
+ * already watched keeps its wd and takes the new path, which follows a
+ * directory moved inside the tree. */
+static int watch_tree(PRIV *priv, unsigned int tree, int parent, const char *path) {
+    int status = INT_MIN;
+    const RECORD_TREE *top = &priv->trees[tree];
+    STR pathname;
+    char str[PATH_MAX], child[PATH_MAX];
+    int wd;
+    WATCH **p, *watch = NULL;
+    DIR *dir = NULL;
+    struct dirent *ent;
+    struct stat st;
+    bool isdir;
+
+    STR_INIT(pathname, str);
+    ONERR(str_cats(&pathname, top->dirname, *path ? "/" : "", path, NULL), -1);
+    wd = inotify_add_watch(priv->fd, pathname.s, WATCH_MASK);
+    if (wd == -1) {
+        switch (errno) {
+        case ENOENT:
+        case ENOTDIR:  /* gone or replaced already, the parent is dirty */
+            status = 0;
+            break;
+        case ENOSPC:
+            status = RECORD_ERROR_WATCH;
+            break;
+        default:
+            status = -1;
+        }
+        goto error;
+    }
+    if (wd >= priv->size) {
+        p = realloc(priv->watch, sizeof(*priv->watch) * (wd + 256));
+        if (!p) {
+            status = -1;
+            goto error;
+        }
+        memset(p + priv->size, 0, sizeof(*p) * (wd + 256 - priv->size));
+        priv->watch = p, priv->size = wd + 256;
+    }
+    watch = priv->watch[wd];
+    if (!watch) {
+        watch = malloc(sizeof(*watch));
+        if (!watch) {
+            status = -1;
+            goto error;
+        }
+        watch->dirty = false;
+        watch->path = NULL;
+        priv->watch[wd] = watch;
+    }
+    free(watch->path);
+    watch->path = strdup(path);
+    if (!watch->path) {
+        status = -1;
+        goto error;
+    }
+    watch->tree = tree;
+    watch->parent = parent;
+    dir = opendir(pathname.s);
+    if (!dir) {
+        status = 0;
+        goto error;
+    }
+    ONERR(str_cats(&pathname, "/", NULL), -1);
+    while (ent = readdir(dir), ent) {
+        if (!strcmp(ent->d_name, ".") ||
+            !strcmp(ent->d_name, "..") ||
+            (!*path && top->skip && !strcmp(ent->d_name, top->skip)) )
+            continue;
+        switch (ent->d_type) {
+        case DT_DIR:
+            isdir = true;
+            break;
+        case DT_UNKNOWN:
+            isdir = !str_cats(&pathname, ent->d_name, NULL) &&
+                    lstat(pathname.s, &st) != -1 && S_ISDIR(st.st_mode);
+            *pathname.e = 0;
+            break;
+        default:
+            isdir = false;
+        }
+        if (!isdir)
+            continue;
+        if (snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", ent->d_name) >= sizeof(child)) {
+            status = -1;
+            goto error;
+        }
+        if (ISERR(status = watch_tree(priv, tree, wd, child)))
+            goto error;
+    }
+    status = 0;
+error:
+    if (dir)
+        closedir(dir);
+    return status;
+}
+
+static int event(PRIV *priv, const struct inotify_event *ev) {
+    int status = INT_MIN;
+    unsigned int tree;
+    WATCH *watch;
+    char child[PATH_MAX];
+    int wd;
+
+    if (ev->mask & IN_Q_OVERFLOW) {  /* lost, and new directories may be unwatched */
+        for (tree = 0; tree < priv->count; ++tree)
+            ONERR(record_char(priv->journal[tree], RECORD_LOST), -1);
+        for (tree = 0; tree < priv->count; ++tree)
+            if (ISERR(status = watch_tree(priv, tree, -1, "")))
+                goto error;
+        for (tree = 0; tree < priv->count; ++tree)
+            ONERR(record_char(priv->journal[tree], RECORD_LOST), -1);
+        status = 0;
+        goto error;
+    }
+    for (tree = 0; tree < priv->count; ++tree)
+        if (ev->wd == priv->mark[tree]) {  /* a scan has started */
+            for (wd = 0; wd < priv->size; ++wd)
+                if (priv->watch[wd] && priv->watch[wd]->tree == tree)
+                    priv->watch[wd]->dirty = false;
+            ONERR(record_char(priv->journal[tree], RECORD_SYNC), -1);
+            status = 0;
+            goto error;
+        }
+    watch = ev->wd >= 0 && ev->wd < priv->size ? priv->watch[ev->wd] : NULL;
+    if (!watch) {
+        status = 0;
+        goto error;
+    }
+    if (ev->mask & IN_IGNORED) {
+        free(watch->path);
+        free(watch);
+        priv->watch[ev->wd] = NULL;
+    }
+    else if (ev->len > 0) {
+        ONERR(set_dirty(priv, ev->wd), -1);
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE|IN_MOVED_TO))) {
+            if (snprintf(child, sizeof(child), "%s%s%s", watch->path, *watch->path ? "/" : "", ev->name) >= sizeof(child)) {
+                status = -1;
+                goto error;
+            }
+            if (ISERR(status = watch_tree(priv, watch->tree, ev->wd, child)))
+                goto error;
+        }
+    }
+    else if (ev->mask & IN_ATTRIB)  /* the directory itself, an entry of its parent */
+        ONERR(set_dirty(priv, watch->parent), -1);
+    status = 0;
+error:
+    return status;
+}
+
+int record_run(const RECORD_TREE *trees, unsigned int count,
+               volatile sig_atomic_t *stop ) {
+    int status = INT_MIN;
+    PRIV priv = {
+        .trees   = trees,
+        .count   = count,
+        .fd      = -1,
+        .journal = NULL,
+        .mark    = NULL,
+        .watch   = NULL,
+        .size    = 0
+    };
+    union {
+        struct inotify_event ev;
+        char buffer[EVENT_SIZE];
+    } buf;
+    const struct inotify_event *ev;
+    ssize_t size;
+    char *p;
+    unsigned int tree;
+    int wd;
+
+    priv.journal = malloc(sizeof(*priv.journal) * count);
+    priv.mark = malloc(sizeof(*priv.mark) * count);
+    if (!priv.journal || !priv.mark) {
+        status = -1;
+        goto error;
+    }
+    for (tree = 0; tree < count; ++tree)
+        priv.journal[tree] = -1;
+    priv.fd = inotify_init();
+    if (priv.fd == -1) {
+        status = RECORD_ERROR_SYSTEM;
+        goto error;
+    }
+    for (tree = 0; tree < count; ++tree) {
+        priv.journal[tree] = open(trees[tree].journal, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
+        if (priv.journal[tree] == -1) {
+            status = -1;
+            goto error;
+        }
+        if (flock(priv.journal[tree], LOCK_EX|LOCK_NB) == -1) {
+            status = errno == EWOULDBLOCK ? RECORD_ERROR_LOCK : -1;
+            goto error;
+        }
+        if (ftruncate(priv.journal[tree], 0) == -1) {
+            status = -1;
+            goto error;
+        }
+        priv.mark[tree] = inotify_add_watch(priv.fd, trees[tree].journal, IN_CLOSE_WRITE);
+        if (priv.mark[tree] == -1) {
+            status = -1;
+            goto error;
+        }
+    }
+    for (tree = 0; tree < count; ++tree)
+        if (ISERR(status = watch_tree(&priv, tree, -1, "")))
+            goto error;
+    for (tree = 0; tree < count; ++tree)
+        if (dprintf(priv.journal[tree], RECORD_HEAD" %ld %ld\n", (long)getpid(), (long)time(NULL)) < 0) {
+            status = -1;
+            goto error;
+        }
+    while (!ISSTOP(stop)) {
+        size = read(priv.fd, buf.buffer, sizeof(buf.buffer));
+        if (size == -1) {
+            if (errno == EINTR)
+                continue;
+            status = -1;
+            goto error;
+        }
+        for (p = buf.buffer; p < buf.buffer + size; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ISERR(status = event(&priv, ev)))
+                goto error;
+        }
+    }
+    status = 0;
+error:
+    for (wd = 0; wd < priv.size; ++wd)
+        if (priv.watch[wd]) {
+            free(priv.watch[wd]->path);
+            free(priv.watch[wd]);
+        }
+    free(priv.watch);
+    if (priv.journal)
+        for (tree = 0; tree < count; ++tree)
+            if (priv.journal[tree] != -1)
+                close(priv.journal[tree]);
+    free(priv.mark);
+    free(priv.journal);
+    if (priv.fd != -1)
+        close(priv.fd);
+    return status;
+}
+#else  /* #ifdef HAVE_SYS_INOTIFY_H */
+int record_run(const RECORD_TREE *trees, unsigned int count,
+               volatile sig_atomic_t *stop ) {
+    return RECORD_ERROR_SYSTEM;
+}
+#endif  /* #ifdef HAVE_SYS_INOTIFY_H */
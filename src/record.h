@@ -0,0 +1,56 @@
+/* record.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_record_h
+#define _INCLUDE_record_h
+
+#include <signal.h>
+
+/* The journal is a text file of one line each:
+ *   RECORD_HEAD pid time  first line, written once every tree is watched
+ *   /path                 directory whose entries changed ("/" for the top)
+ *   RECORD_LOST           events were lost, nothing recorded can be trusted
+ *   RECORD_MARK           written by a scan when it starts
+ *   RECORD_SYNC           the recorder has caught up with the last mark
+ */
+#define RECORD_HEAD "psync-record"
+#define RECORD_LOST '!'
+#define RECORD_MARK '?'
+#define RECORD_SYNC '='
+
+#define RECORD_ERROR_LOCK   (-2)  /* already recorded by another recorder */
+#define RECORD_ERROR_WATCH  (-3)  /* too many directories to watch */
+#define RECORD_ERROR_SYSTEM (-4)  /* not supported on this system */
+
+typedef struct {
+    const char *dirname;  /* top of the tree to watch */
+    const char *skip;  /* entry of dirname not to watch */
+    const char *journal;
+} RECORD_TREE;
+
+extern int record_run(const RECORD_TREE *trees, unsigned int count,
+                      volatile sig_atomic_t *stop );
+
+#endif  /* #ifndef _INCLUDE_record_h */
@@ -0,0 +1,226 @@
+/* session.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "session.h"
+
+static int set_addr(struct sockaddr_un *addr, const char *sockname) {
+    int status = -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sockname) >= sizeof(addr->sun_path))
+        goto error;
+    strcpy(addr->sun_path, sockname);
+    status = 0;
+error:
+    return status;
+}
+
+/* Connect to a running session server, -1 when there is none. */
+int session_connect(const char *sockname) {
+    int status = -1;
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (set_addr(&addr, sockname) == -1)
+        goto error;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        goto error;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        goto error;
+    status = fd, fd = -1;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* Listen on sockname, reachable by the owner only.  A socket file left by
+ * a server that is gone is replaced. */
+int session_listen(const char *sockname) {
+    int status = -1;
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd = -1;
+    int n;
+
+    if (set_addr(&addr, sockname) == -1)
+        goto error;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        goto error;
+    mask = umask(S_IRWXG|S_IRWXO);
+    n = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (n == -1 && errno == EADDRINUSE) {
+        n = session_connect(sockname);
+        if (n != -1) {  /* another server won the race */
+            close(n);
+            umask(mask);
+            goto error;
+        }
+        unlink(sockname);
+        n = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    umask(mask);
+    if (n == -1)
+        goto error;
+    if (listen(fd, 8) == -1)
+        goto error;
+    status = fd, fd = -1;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* Hand stdin, stdout and stderr over to the server and wait until it has
+ * run the session on them.  The status of the session is set to *result. */
+int session_call(int fd, const int fds[3], int *result) {
+    int status = -1;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr h;
+        char buffer[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    struct cmsghdr *cmsg;
+    char c = 0;
+    int32_t value;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &c, iov.iov_len = sizeof(c);
+    msg.msg_iov = &iov, msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer, msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+    while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+    if (n != sizeof(c))
+        goto error;
+    while ((n = read(fd, &value, sizeof(value))) == -1 && errno == EINTR);
+    if (n != sizeof(value))
+        goto error;
+    *result = value;
+    status = 0;
+error:
+    return status;
+}
+
+static int recv_fds(int fd, int fds[3]) {
+    int status = -1;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr h;
+        char buffer[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    struct cmsghdr *cmsg;
+    char c;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c, iov.iov_len = sizeof(c);
+    msg.msg_iov = &iov, msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer, msg.msg_controllen = sizeof(control.buffer);
+    while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+    if (n != sizeof(c))
+        goto error;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3) )
+        goto error;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+    status = 0;
+error:
+    return status;
+}
+
+/* Run func on the stdio of each caller, one session at a time, until no
+ * caller came for timeout seconds.  The socket file is removed before
+ * returning. */
+int session_serve(int fd, const char *sockname, unsigned int timeout,
+                  int (*func)(const int fds[3], void *data), void *data ) {
+    int status = -1;
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+    bool listening = true;
+    int conn = -1;
+    int fds[3];
+    int32_t result;
+
+    for (;;) {
+        switch (poll(&pfd, 1, !listening ? 0 : timeout > INT_MAX / 1000 ? INT_MAX : (int)timeout * 1000)) {
+        case -1:
+            if (errno == EINTR)
+                continue;
+            goto error;
+        case 0:  /* idle */
+            if (!listening) {
+                status = 0;
+                goto error;
+            }
+            unlink(sockname);  /* then serve whoever connected meanwhile */
+            listening = false;
+            continue;
+        }
+        conn = accept(fd, NULL, NULL);
+        if (conn == -1)
+            continue;
+        if (recv_fds(conn, fds) != -1) {
+            result = func(fds, data);
+            close(fds[0]), close(fds[1]), close(fds[2]);
+            while (write(conn, &result, sizeof(result)) == -1 && errno == EINTR);
+        }
+        close(conn), conn = -1;
+    }
+error:
+    if (listening)
+        unlink(sockname);
+    return status;
+}
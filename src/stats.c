@@ -0,0 +1,203 @@
+/* stats.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+#include "stats.h"
+
+#define IOFILE "/proc/self/io"
+#define IO_RCHAR 0
+#define IO_WCHAR 1
+#define IO_SYSCR 2
+#define IO_SYSCW 3
+
+static const char *const iokeys[] = {"rchar", "wchar", "syscr", "syscw"};
+
+/* Read the I/O counters of this process, -1 for those unknown, and
+ * return the size read. */
+static ssize_t read_io(intmax_t io[4]) {
+    char buffer[512], *s, *e;
+    ssize_t size;
+    size_t length;
+    int fd;
+    unsigned int n;
+
+    for (n = 0; n < 4; ++n)
+        io[n] = -1;
+    fd = open(IOFILE, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    size = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (size <= 0)
+        return 0;
+    buffer[size] = 0;
+    for (s = buffer; *s; s = e) {
+        e = strchr(s, '\n');
+        e = e ? e + 1 : s + strlen(s);
+        for (n = 0; n < 4; ++n) {
+            length = strlen(iokeys[n]);
+            if (!strncmp(s, iokeys[n], length) && s[length] == ':')
+                io[n] = strtoimax(s + length + 1, NULL, 10);
+        }
+    }
+    return size;
+}
+
+static intmax_t delta(intmax_t begin, intmax_t end) {
+    return begin != -1 && end != -1 ? end - begin : -1;
+}
+
+/* Close the phase running with status, and start the one named name,
+ * if any, from the same reading of the clock and the counters. */
+static void next_phase(STATS *stats, const char *name, int status) {
+    struct timespec now;
+    intmax_t io[4];
+    ssize_t size;
+    STATS_PHASE *phase;
+
+    if (stats->name)
+        trace_span((int64_t)stats->begin.tv_sec * 1000000000 + stats->begin.tv_nsec,
+                   "phase", stats->name, NULL, -1 );
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size = read_io(io);
+    if (stats->name && stats->count < STATS_PHASES) {
+        phase = &stats->phase[stats->count++];
+        phase->name = stats->name;
+        phase->nsec = (int64_t)(now.tv_sec - stats->begin.tv_sec) * 1000000000 +
+                      (now.tv_nsec - stats->begin.tv_nsec);
+        phase->files = __atomic_load_n(&stats->files, __ATOMIC_RELAXED);
+        phase->rchar = delta(stats->io[IO_RCHAR], io[IO_RCHAR]);
+        phase->wchar = delta(stats->io[IO_WCHAR], io[IO_WCHAR]);
+        phase->syscr = delta(stats->io[IO_SYSCR], io[IO_SYSCR]);
+        phase->syscw = delta(stats->io[IO_SYSCW], io[IO_SYSCW]);
+        phase->status = status;
+    }
+    stats->name = name;
+    stats->begin = now;
+    stats->files = 0;
+    memcpy(stats->io, io, sizeof(stats->io));
+    if (stats->io[IO_RCHAR] != -1)  /* the read above only counts from here on */
+        stats->io[IO_RCHAR] += size;
+    if (stats->io[IO_SYSCR] != -1)
+        ++stats->io[IO_SYSCR];
+}
+
+void stats_init(STATS *stats) {
+    stats->count = 0;
+    stats->name = NULL;
+    stats->files = 0;
+}
+
+void stats_begin(STATS *stats, const char *name) {
+    next_phase(stats, name, 0);
+}
+
+/* May be called from several threads of the same phase. */
+void stats_count(STATS *stats, intmax_t files) {
+    __atomic_add_fetch(&stats->files, files, __ATOMIC_RELAXED);
+}
+
+void stats_end(STATS *stats, int status) {
+    if (stats->name)
+        next_phase(stats, NULL, status);
+}
+
+static int write_string(int fd, const char *s) {
+    int status = -1;
+    const char *e;
+
+    if (dprintf(fd, "\"") < 0)
+        goto error;
+    while (*s) {
+        for (e = s; *e && *e != '"' && *e != '\\' && (unsigned char)*e >= 0x20; ++e);
+        if (e > s && dprintf(fd, "%.*s", (int)(e - s), s) < 0)
+            goto error;
+        if (!*e)
+            break;
+        if (*e == '"' || *e == '\\') {
+            if (dprintf(fd, "\\%c", *e) < 0)
+                goto error;
+        }
+        else if (dprintf(fd, "\\u%04x", (unsigned char)*e) < 0)
+            goto error;
+        s = e + 1;
+    }
+    if (dprintf(fd, "\"") < 0)
+        goto error;
+    status = 0;
+error:
+    return status;
+}
+
+/* One JSON object on a line: the run as a whole, then each phase. */
+int stats_write(const STATS *stats, const char *label, const char *dirname,
+                time_t t, int status, int fd ) {
+    int sts = -1;
+    char host[256];
+    int64_t nsec;
+    const STATS_PHASE *phase;
+
+    if (gethostname(host, sizeof(host)) == -1)
+        *host = 0;
+    host[sizeof(host)-1] = 0;
+    nsec = 0;
+    for (phase = stats->phase; phase < stats->phase + stats->count; ++phase)
+        nsec += phase->nsec;
+    if (dprintf(fd, "{") < 0)
+        goto error;
+    if (label) {
+        if (dprintf(fd, "\"label\":") < 0 || write_string(fd, label) ||
+            dprintf(fd, ",") < 0 )
+            goto error;
+    }
+    if (dprintf(fd, "\"dirname\":") < 0 || write_string(fd, dirname) ||
+        dprintf(fd, ",\"host\":") < 0 || write_string(fd, host) ||
+        dprintf(fd, ",\"time\":%jd,\"status\":%d,\"seconds\":%.6f,\"phases\":[",
+                (intmax_t)t, status, nsec / 1e9 ) < 0 )
+        goto error;
+    for (phase = stats->phase; phase < stats->phase + stats->count; ++phase)
+        if (dprintf(fd, "%s{\"phase\":\"%s\",\"seconds\":%.6f,\"files\":%jd,"
+                        "\"rchar\":%jd,\"wchar\":%jd,\"syscr\":%jd,\"syscw\":%jd,\"status\":%d}",
+                    phase > stats->phase ? "," : "", phase->name, phase->nsec / 1e9, phase->files,
+                    phase->rchar, phase->wchar, phase->syscr, phase->syscw, phase->status ) < 0)
+            goto error;
+    if (dprintf(fd, "]}\n") < 0)
+        goto error;
+    sts = 0;
+error:
+    return sts;
+}
@@ -0,0 +1,59 @@
+/* stats.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_stats_h
+#define _INCLUDE_stats_h
+
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_PHASES 16
+
+typedef struct {
+    const char *name;
+    int64_t nsec;            /* [nsec] CLOCK_MONOTONIC */
+    intmax_t files;          /* entries the phase went through */
+    intmax_t rchar, wchar;   /* [byte] read and written, -1: unknown */
+    intmax_t syscr, syscw;   /* read and write system calls, -1: unknown */
+    int status;
+} STATS_PHASE;
+
+typedef struct {
+    unsigned int count;      /* phases done */
+    const char *name;        /* phase running, NULL: none */
+    struct timespec begin;
+    intmax_t files;
+    intmax_t io[4];          /* /proc/self/io at the beginning, -1: unknown */
+    STATS_PHASE phase[STATS_PHASES];
+} STATS;
+
+extern void stats_init(STATS *stats);
+extern void stats_begin(STATS *stats, const char *name);
+extern void stats_count(STATS *stats, intmax_t files);
+extern void stats_end(STATS *stats, int status);
+extern int stats_write(const STATS *stats, const char *label, const char *dirname,
+                       time_t t, int status, int fd );
+
+#endif  /* #ifndef _INCLUDE_stats_h */
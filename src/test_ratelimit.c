@@ -0,0 +1,151 @@
+/* test_ratelimit.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Deterministic test of the token bucket of ratelimit.c: the clock, the
+ * time of day and sleep are replaced by a simulated clock that advances
+ * only when the bucket sleeps or the test moves it, so every check is
+ * exact and the test takes no time.  Prints one line per check and exits
+ * with failure if any of them fails.
+ *
+ * usage: test_ratelimit
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ratelimit.h"
+
+#define RATE 1000000  /* [byte/sec] */
+#define BURST (RATE/4)  /* BURST_DIV of ratelimit.c */
+#define SLEEP_MAX 100000  /* [usec] of ratelimit.c */
+#define NOON 1790000000  /* [sec] a fixed time of day */
+
+typedef struct {
+    int64_t now;    /* [usec] */
+    time_t time;
+    int64_t slept;  /* [usec] in total */
+    unsigned long sleeps;
+} SIMCLOCK;
+
+static int64_t sim_clock(void *data) {
+    SIMCLOCK *sim = data;
+
+    return sim->now;
+}
+
+static time_t sim_time(void *data) {
+    SIMCLOCK *sim = data;
+
+    return sim->time;
+}
+
+static void sim_sleep(int64_t usec, void *data) {
+    SIMCLOCK *sim = data;
+
+    sim->now += usec;
+    sim->slept += usec;
+    ++sim->sleeps;
+}
+
+static void init(RATELIMIT *ratelimit, SIMCLOCK *sim, uint64_t rate, int begin, int end) {
+    sim->now = 1000000;
+    sim->time = NOON;
+    sim->slept = 0, sim->sleeps = 0;
+    ratelimit_init(ratelimit, rate, begin, end);
+    ratelimit->clock = sim_clock;
+    ratelimit->time = sim_time;
+    ratelimit->sleep = sim_sleep;
+    ratelimit->data = sim;
+}
+
+static bool check(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    bool ok = true;
+    RATELIMIT ratelimit;
+    SIMCLOCK sim;
+    volatile sig_atomic_t stop = 0;
+    struct tm tm;
+    time_t t;
+    int minute;
+
+    init(&ratelimit, &sim, RATE, 0, 0);
+    ratelimit_wait(&ratelimit, BURST, &stop);
+    ok &= check("burst: a full bucket at the start",
+                sim.slept == 0 && ratelimit.tokens == 0 );
+    ratelimit_wait(&ratelimit, 50000, &stop);
+    ok &= check("burst: an empty bucket waits size/rate",
+                sim.slept == 50001 && ratelimit.tokens == 1 );
+    sim.now += 20000, sim.slept = 0;
+    ratelimit_wait(&ratelimit, 20001, &stop);
+    ok &= check("refill: idle time refills at the rate",
+                sim.slept == 0 && ratelimit.tokens == 0 );
+    sim.now += 10 * 1000000;
+    ratelimit_wait(&ratelimit, 0, &stop);
+    ok &= check("refill: capped at the burst size",
+                ratelimit.tokens == BURST );
+    sim.slept = 0, sim.sleeps = 0;
+    ratelimit_wait(&ratelimit, BURST + RATE, &stop);
+    ok &= check("underflow: a piece above the bucket waits for its deficit",
+                sim.slept == RATE && ratelimit.tokens == 0 );
+    ok &= check("underflow: in sleeps of at most SLEEP_MAX",
+                sim.sleeps == RATE / SLEEP_MAX );
+    sim.now -= 500000, sim.slept = 0;
+    ratelimit_wait(&ratelimit, 0, &stop);
+    ok &= check("refill: a clock that goes back adds nothing",
+                sim.slept == 0 && ratelimit.tokens == 0 );
+
+    t = NOON;
+    localtime_r(&t, &tm);
+    minute = tm.tm_hour * 60 + tm.tm_min;
+    init(&ratelimit, &sim, RATE, (minute + 60) % 1440, (minute + 120) % 1440);
+    ratelimit_wait(&ratelimit, 10 * RATE, &stop);
+    ok &= check("window: no limit outside begin-end",
+                sim.slept == 0 );
+    init(&ratelimit, &sim, RATE, (minute + 1440 - 10) % 1440, (minute + 10) % 1440);
+    ratelimit_wait(&ratelimit, BURST + RATE, &stop);
+    ok &= check("window: limited inside begin-end",
+                sim.slept == RATE );
+
+    init(&ratelimit, &sim, 0, 0, 0);
+    ratelimit_wait(&ratelimit, 10 * RATE, &stop);
+    ok &= check("unlimited: rate 0 never waits",
+                sim.slept == 0 && ratelimit_size(&ratelimit, 10 * RATE) == 10 * RATE );
+    init(&ratelimit, &sim, RATE, 0, 0);
+    stop = 1;
+    ok &= check("stop: a waiting piece returns an error",
+                ratelimit_wait(&ratelimit, BURST + RATE, &stop) < 0 );
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
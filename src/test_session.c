@@ -0,0 +1,340 @@
+/* test_session.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Test of the session server of session.c: starts session_serve() on a
+ * socket in a temporary directory in a child process, connects to it with
+ * session_connect() and hands it the pipes to a local psync_run() peer
+ * with session_call(), so that the server syncs its directory with the
+ * local one over the passed descriptors.  Runs two sessions, the second
+ * after a change, checks that each completed with status 0, that the
+ * trees are the same and that the server wrote to the passed stderr, then
+ * that the server removes the socket and exits once idle.  Prints one line
+ * per check and exits with failure if any of them fails.
+ *
+ * usage: test_session [DIRECTORY]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "psync.h"
+#include "session.h"
+
+#define TIMEOUT 3  /* [sec] idle time of the server, longer than ts in main() */
+#define MARK "session\n"  /* written by the server to the passed stderr */
+
+typedef struct {
+    PSYNC *psync;
+    int status;
+    pthread_t tid;
+} PEER;
+
+static bool check(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    fflush(stdout);
+    return ok;
+}
+
+static int write_file(const char *pathname, const char *s, size_t size) {
+    int status = INT_MIN;
+    char buffer[4096];
+    size_t length = strlen(s), n;
+    int fd = -1;
+
+    fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1)
+        goto error;
+    for (n = 0; n < sizeof(buffer); ++n)
+        buffer[n] = s[n % length];
+    while (size > 0) {
+        n = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (write(fd, buffer, n) != (ssize_t)n)
+            goto error;
+        size -= n;
+    }
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+static bool same_file(const char *pathname1, const char *pathname2) {
+    bool same = false;
+    char buffer1[4096], buffer2[4096];
+    ssize_t n1, n2;
+    int fd1 = -1, fd2 = -1;
+
+    fd1 = open(pathname1, O_RDONLY);
+    fd2 = open(pathname2, O_RDONLY);
+    if (fd1 == -1 || fd2 == -1)
+        goto error;
+    do {
+        n1 = read(fd1, buffer1, sizeof(buffer1));
+        n2 = read(fd2, buffer2, sizeof(buffer2));
+        if (n1 != n2 || n1 == -1 || memcmp(buffer1, buffer2, n1))
+            goto error;
+    } while (n1 > 0);
+    same = true;
+error:
+    if (fd2 != -1)
+        close(fd2);
+    if (fd1 != -1)
+        close(fd1);
+    return same;
+}
+
+static const char *const files[] = {"a.txt", "empty", "sub/b.bin"};
+
+/* dirname/name into pathname, false when it does not fit. */
+static bool path_of(char *pathname, size_t size, const char *dirname, const char *name) {
+    int n;
+
+    n = snprintf(pathname, size, "%s/%s", dirname, name);
+    return n >= 0 && (size_t)n < size;
+}
+
+static bool same_tree(const char *dirname1, const char *dirname2) {
+    char pathname1[PATH_MAX], pathname2[PATH_MAX];
+    size_t n;
+
+    for (n = 0; n < sizeof(files)/sizeof(*files); ++n) {
+        if (!path_of(pathname1, sizeof(pathname1), dirname1, files[n]) ||
+            !path_of(pathname2, sizeof(pathname2), dirname2, files[n]) ||
+            !same_file(pathname1, pathname2) )
+            return false;
+    }
+    return true;
+}
+
+/* The server side of a session, as serve_session() of main.c. */
+static int serve_func(const int fds[3], void *data) {
+    int status = INT_MIN;
+    PSYNC *psync = NULL;
+
+    if (write(fds[2], MARK, strlen(MARK)) != (ssize_t)strlen(MARK))
+        goto error;
+    psync = psync_new(data, NULL);
+    if (!psync)
+        goto error;
+    psync->fdin = fds[0], psync->fdout = fds[1];
+    status = psync_run(psync);
+error:
+    if (psync)
+        psync_free(psync);
+    return status;
+}
+
+static void *peer_thread(void *data) {
+    PEER *peer = data;
+
+    peer->status = psync_run(peer->psync);
+    close(peer->psync->fdout);
+    close(peer->psync->fdin);
+    return NULL;
+}
+
+/* One session: the local peer on dirname runs in a thread while its pipes
+ * are handed to the server, the stderr passed is read back into mark. */
+static int call(const char *sockname, const char *dirname, int *result,
+                char *mark, size_t size ) {
+    int status = INT_MIN;
+    PEER peer = {NULL, INT_MIN};
+    int up[2] = {-1, -1}, down[2] = {-1, -1}, err[2] = {-1, -1};
+    int fds[3];
+    bool started = false;
+    int fd = -1;
+    ssize_t n;
+    int i;
+
+    *result = INT_MIN, *mark = 0;
+    if (pipe(up) == -1 || pipe(down) == -1 || pipe(err) == -1)
+        goto error;
+    peer.psync = psync_new(dirname, NULL);
+    if (!peer.psync)
+        goto error;
+    peer.psync->fdout = up[1], peer.psync->fdin = down[0];
+    fd = session_connect(sockname);
+    if (fd == -1)
+        goto error;
+    if (pthread_create(&peer.tid, NULL, peer_thread, &peer))
+        goto error;
+    up[1] = down[0] = -1;  /* closed by the thread */
+    started = true;
+    fds[0] = up[0], fds[1] = down[1], fds[2] = err[1];
+    n = session_call(fd, fds, result);
+    close(up[0]), up[0] = -1;  /* the server is done with them */
+    close(down[1]), down[1] = -1;
+    close(err[1]), err[1] = -1;
+    if (n == -1)
+        goto error;
+    n = read(err[0], mark, size - 1);
+    if (n >= 0)
+        mark[n] = 0;
+    status = 0;
+error:
+    if (started) {
+        pthread_join(peer.tid, NULL);
+        if (peer.status)
+            status = INT_MIN;
+    }
+    if (fd != -1)
+        close(fd);
+    for (i = 0; i < 2; ++i) {
+        if (up[i] != -1)
+            close(up[i]);
+        if (down[i] != -1)
+            close(down[i]);
+        if (err[i] != -1)
+            close(err[i]);
+    }
+    if (peer.psync)
+        psync_free(peer.psync);
+    return status;
+}
+
+static int remove_func(const char *pathname, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(pathname);
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    bool ok = true;
+    const char *dirname = ".";
+    char topname[PATH_MAX] = "", dirname1[PATH_MAX], dirname2[PATH_MAX];
+    char sockname[PATH_MAX], pathname[PATH_MAX];
+    char mark[64];
+    struct timespec ts = {1, 100000000};  /* mtimes must move on */
+    pid_t pid = -1;
+    int fd = -1;
+    int result, n;
+
+    if (argc > 2)
+        goto usage;
+    if (argc > 1)
+        dirname = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    if (!path_of(topname, sizeof(topname), dirname, "test_session.XXXXXX")) {
+        fprintf(stderr, "%s: Too long\n", dirname);
+        *topname = 0;
+        goto error;
+    }
+    if (!mkdtemp(topname)) {
+        perror(topname);
+        *topname = 0;
+        goto error;
+    }
+    if (!path_of(dirname1, sizeof(dirname1), topname, "dir1") ||
+        !path_of(dirname2, sizeof(dirname2), topname, "dir2") ||
+        !path_of(sockname, sizeof(sockname), topname, "session.sock") ||
+        !path_of(pathname, sizeof(pathname), dirname1, "sub") ) {
+        fprintf(stderr, "%s: Too long\n", topname);
+        goto error;
+    }
+    if (mkdir(dirname1, S_IRWXU) == -1 || mkdir(dirname2, S_IRWXU) == -1 ||
+        mkdir(pathname, S_IRWXU) == -1 ) {
+        perror(topname);
+        goto error;
+    }
+    for (n = 0; n < (int)(sizeof(files)/sizeof(*files)); ++n) {
+        if (!path_of(pathname, sizeof(pathname), dirname1, files[n]) ||
+            write_file(pathname, files[n], n == 1 ? 0 : n == 2 ? 200000 : 100) ) {
+            perror(pathname);
+            goto error;
+        }
+    }
+
+    fd = session_listen(sockname);
+    if (!check("listen: a socket in the directory", fd != -1))
+        goto error;
+    pid = fork();
+    switch (pid) {
+    case -1:
+        perror("fork");
+        goto error;
+    case 0:  /* server */
+        n = session_serve(fd, sockname, TIMEOUT, serve_func, dirname2);
+        psync_clean_wait();
+        _exit(n == -1 ? 1 : 0);
+    }
+    close(fd), fd = -1;
+
+    n = call(sockname, dirname1, &result, mark, sizeof(mark));
+    ok &= check("first: the session completed",
+                n == 0 && result == 0 );
+    ok &= check("first: the server wrote to the passed stderr",
+                !strcmp(mark, MARK) );
+    ok &= check("first: the trees are the same",
+                same_tree(dirname1, dirname2) );
+    nanosleep(&ts, NULL);
+    if (!path_of(pathname, sizeof(pathname), dirname1, files[0]) ||
+        write_file(pathname, "changed", 300) ) {
+        perror(pathname);
+        goto error;
+    }
+    n = call(sockname, dirname1, &result, mark, sizeof(mark));
+    ok &= check("second: the same server completed the session",
+                n == 0 && result == 0 && !strcmp(mark, MARK) );
+    ok &= check("second: the change reached the server",
+                same_tree(dirname1, dirname2) );
+
+    n = -1;
+    if (waitpid(pid, &n, 0) == pid)
+        pid = -1;
+    ok &= check("idle: the server exited",
+                pid == -1 && WIFEXITED(n) && WEXITSTATUS(n) == 0 );
+    ok &= check("idle: the socket was removed",
+                access(sockname, F_OK) == -1 );
+    psync_clean_wait();
+    status = 0;
+error:
+    if (pid != -1) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    if (fd != -1)
+        close(fd);
+    if (*topname)
+        nftw(topname, remove_func, 16, FTW_DEPTH|FTW_PHYS);
+    return !status && ok ? EXIT_SUCCESS : EXIT_FAILURE;
+usage:
+    fprintf(stderr, "usage: %s [DIRECTORY]\n", argv[0]);
+    return EXIT_FAILURE;
+}
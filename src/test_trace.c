@@ -0,0 +1,374 @@
+/* test_trace.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Test of --trace on a whole run: syncs two directories in a temporary
+ * directory through a fake ssh that runs the remote command locally, with
+ * the trace written to a file, and waits until every process of the run
+ * has ended, the detached child that removes expired backups included.
+ * Then checks that the sync completed and that the trace is one JSON
+ * document with its events, as tools that load it expect.  Prints one line
+ * per check and exits with failure if any of them fails.
+ *
+ * usage: test_trace [PSYNC [DIRECTORY]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TIMEOUT 60  /* [sec] for the whole run */
+#define DEPTH_MAX 64  /* of JSON values */
+
+static bool check(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    fflush(stdout);
+    return ok;
+}
+
+/* dirname/name into pathname, false when it does not fit. */
+static bool path_of(char *pathname, size_t size, const char *dirname, const char *name) {
+    int n;
+
+    n = snprintf(pathname, size, "%s/%s", dirname, name);
+    return n >= 0 && (size_t)n < size;
+}
+
+static int write_file(const char *pathname, const char *s, mode_t mode) {
+    int status = INT_MIN;
+    size_t length = strlen(s);
+    int fd = -1;
+
+    fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, mode);
+    if (fd == -1)
+        goto error;
+    if (write(fd, s, length) != (ssize_t)length)
+        goto error;
+    status = 0;
+error:
+    if (fd != -1)
+        close(fd);
+    return status;
+}
+
+/* The whole file, NUL terminated, or NULL. */
+static char *read_file(const char *pathname) {
+    char *result = NULL;
+    char *buffer = NULL, *p;
+    size_t size = 0, length = 0;
+    ssize_t n;
+    int fd = -1;
+
+    fd = open(pathname, O_RDONLY);
+    if (fd == -1)
+        goto error;
+    do {
+        if (length + 1 >= size) {
+            size = size ? size * 2 : 4096;
+            p = realloc(buffer, size);
+            if (!p)
+                goto error;
+            buffer = p;
+        }
+        n = read(fd, buffer + length, size - length - 1);
+        if (n == -1)
+            goto error;
+        length += n;
+    } while (n > 0);
+    buffer[length] = 0;
+    result = buffer, buffer = NULL;
+error:
+    if (fd != -1)
+        close(fd);
+    free(buffer);
+    return result;
+}
+
+static const char *skip_space(const char *s) {
+    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+        ++s;
+    return s;
+}
+
+/* One JSON value at s (RFC 8259), the end of it or NULL when it is not. */
+static const char *parse_value(const char *s, int depth) {
+    static const char *const literals[] = {"true", "false", "null"};
+    const char *p;
+    size_t n;
+
+    if (depth > DEPTH_MAX)
+        return NULL;
+    s = skip_space(s);
+    switch (*s) {
+    case '{':
+    case '[':
+        p = skip_space(s + 1);
+        if (*p == (*s == '{' ? '}' : ']'))
+            return p + 1;
+        for (;;) {
+            if (*s == '{') {
+                p = skip_space(p);
+                if (*p != '"' || !(p = parse_value(p, depth + 1)))
+                    return NULL;
+                p = skip_space(p);
+                if (*p++ != ':')
+                    return NULL;
+            }
+            if (!(p = parse_value(p, depth + 1)))
+                return NULL;
+            p = skip_space(p);
+            if (*p == ',')
+                ++p;
+            else if (*p == (*s == '{' ? '}' : ']'))
+                return p + 1;
+            else
+                return NULL;
+        }
+    case '"':
+        for (p = s + 1; *p != '"'; ++p)
+            if ((unsigned char)*p < 0x20)
+                return NULL;
+            else if (*p == '\\') {
+                ++p;
+                if (*p == 'u') {
+                    for (n = 1; n <= 4; ++n)
+                        if (!strchr("0123456789abcdefABCDEF", p[n]) || !p[n])
+                            return NULL;
+                    p += 4;
+                }
+                else if (!*p || !strchr("\"\\/bfnrt", *p))
+                    return NULL;
+            }
+        return p + 1;
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        p = s + (*s == '-');
+        if (*p == '0')
+            ++p;
+        else if (*p >= '1' && *p <= '9')
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        else
+            return NULL;
+        if (*p == '.') {
+            if (!(*++p >= '0' && *p <= '9'))
+                return NULL;
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+        if (*p == 'e' || *p == 'E') {
+            ++p;
+            if (*p == '+' || *p == '-')
+                ++p;
+            if (!(*p >= '0' && *p <= '9'))
+                return NULL;
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+        return p;
+    }
+    for (n = 0; n < sizeof(literals)/sizeof(*literals); ++n)
+        if (!strncmp(s, literals[n], strlen(literals[n])))
+            return s + strlen(literals[n]);
+    return NULL;
+}
+
+/* Occurrences of s in buffer. */
+static size_t count_of(const char *buffer, const char *s) {
+    size_t count = 0;
+
+    while ((buffer = strstr(buffer, s)))
+        ++count, buffer += strlen(s);
+    return count;
+}
+
+/* Run psync in dirname until it and every process it started have ended,
+ * which hold the write end of a pipe until then.  The exit status of
+ * psync itself is returned, -1 on error. */
+static int run_psync(const char *psync, const char *dirname, const char *trace) {
+    int status = -1;
+    char pathname[PATH_MAX], option[PATH_MAX+16], *s;
+    struct pollfd pfd;
+    char buffer[64];
+    int fds[2] = {-1, -1};
+    pid_t pid = -1;
+    int fd, n;
+
+    if (pipe(fds) == -1)
+        goto error;
+    pid = fork();
+    switch (pid) {
+    case -1:
+        goto error;
+    case 0:
+        close(fds[0]);
+        fd = open("/dev/null", O_RDWR);
+        if (fd != -1)
+            dup2(fd, STDIN_FILENO), dup2(fd, STDOUT_FILENO), close(fd);
+        s = getenv("PATH");
+        if (!path_of(pathname, sizeof(pathname), dirname, "bin") ||
+            snprintf(option, sizeof(option), "%s:%s", pathname, s ? s : "/bin:/usr/bin") >= (int)sizeof(option) ||
+            setenv("PATH", option, 1) == -1 ||
+            !path_of(pathname, sizeof(pathname), dirname, "h1") ||
+            setenv("HOME", pathname, 1) == -1 ||
+            snprintf(option, sizeof(option), "--trace=%s", trace) >= (int)sizeof(option) )
+            _exit(127);
+        execl(psync, psync, "-q", option, "host", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]), fds[1] = -1;
+    if (waitpid(pid, &n, 0) != pid)
+        goto error;
+    pid = -1;
+    pfd.fd = fds[0], pfd.events = POLLIN;
+    do
+        if (poll(&pfd, 1, TIMEOUT * 1000) != 1)
+            goto error;
+    while (read(fds[0], buffer, sizeof(buffer)) > 0);
+    status = WIFEXITED(n) ? WEXITSTATUS(n) : -1;
+error:
+    if (pid != -1)
+        waitpid(pid, NULL, 0);
+    if (fds[1] != -1)
+        close(fds[1]);
+    if (fds[0] != -1)
+        close(fds[0]);
+    return status;
+}
+
+static int remove_func(const char *pathname, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(pathname);
+}
+
+int main(int argc, char *argv[]) {
+    int status = INT_MIN;
+    bool ok = true;
+    const char *psync = "./psync", *dirname = ".";
+    char psyncname[PATH_MAX], topname[PATH_MAX] = "", pathname[PATH_MAX];
+    char trace[PATH_MAX], script[PATH_MAX+256];
+    static const char *const dirs[] = {"bin", "h1", "h1/d", "h2", "h2/d"};
+    char *buffer = NULL;
+    const char *p;
+    size_t n;
+
+    if (argc > 3)
+        goto usage;
+    if (argc > 1)
+        psync = argv[1];
+    if (argc > 2)
+        dirname = argv[2];
+    if (!realpath(psync, psyncname)) {
+        perror(psync);
+        goto error;
+    }
+    if (!path_of(topname, sizeof(topname), dirname, "test_trace.XXXXXX")) {
+        fprintf(stderr, "%s: Too long\n", dirname);
+        *topname = 0;
+        goto error;
+    }
+    if (!mkdtemp(topname)) {
+        perror(topname);
+        *topname = 0;
+        goto error;
+    }
+    if (!realpath(topname, pathname) || strlen(pathname) >= sizeof(topname)) {
+        perror(topname);
+        goto error;
+    }
+    strcpy(topname, pathname);
+    for (n = 0; n < sizeof(dirs)/sizeof(*dirs); ++n)
+        if (!path_of(pathname, sizeof(pathname), topname, dirs[n]) ||
+            mkdir(pathname, S_IRWXU) == -1 ) {
+            perror(pathname);
+            goto error;
+        }
+    if (!path_of(pathname, sizeof(pathname), topname, "bin/ssh") ||
+        snprintf(script, sizeof(script),
+                 "#!/bin/sh\n"
+                 "for a; do last=$a; done\n"  /* the remote command */
+                 "HOME='%s/h2' exec sh -c \"$last\"\n", topname ) >= (int)sizeof(script) ||
+        write_file(pathname, script, S_IRWXU) ) {
+        perror(pathname);
+        goto error;
+    }
+    if (!path_of(pathname, sizeof(pathname), topname, "bin/"PACKAGE_TARNAME) ||
+        symlink(psyncname, pathname) == -1 ) {
+        perror(pathname);
+        goto error;
+    }
+    if (!path_of(pathname, sizeof(pathname), topname, "h1/.psync.conf") ||
+        write_file(pathname, "test d\n", S_IRUSR|S_IWUSR) ||
+        !path_of(pathname, sizeof(pathname), topname, "h2/.psync.conf") ||
+        write_file(pathname, "test d\n", S_IRUSR|S_IWUSR) ||
+        !path_of(pathname, sizeof(pathname), topname, "h1/d/a") ||
+        write_file(pathname, "a\n", S_IRUSR|S_IWUSR) ||
+        !path_of(trace, sizeof(trace), topname, "trace.json") ) {
+        perror(pathname);
+        goto error;
+    }
+
+    ok &= check("run: completed with a trace",
+                run_psync(psyncname, topname, trace) == 0 );
+    ok &= check("run: the file reached the other side",
+                path_of(pathname, sizeof(pathname), topname, "h2/d/a") &&
+                access(pathname, F_OK) == 0 );
+    buffer = read_file(trace);
+    ok &= check("trace: written",
+                buffer != NULL );
+    if (!buffer)
+        goto error;
+    p = skip_space(buffer);
+    ok &= check("trace: an object of traceEvents",
+                !strncmp(p, "{\"traceEvents\":[", 16) );
+    p = parse_value(p, 0);
+    ok &= check("trace: one JSON document",
+                p && !*skip_space(p) );
+    ok &= check("trace: closed once",
+                count_of(buffer, "]}") == 1 );
+    ok &= check("trace: events of the run",
+                count_of(buffer, "\"ph\":\"X\"") > 0 );
+    status = 0;
+error:
+    free(buffer);
+    if (*topname)
+        nftw(topname, remove_func, 16, FTW_DEPTH|FTW_PHYS);
+    return !status && ok ? EXIT_SUCCESS : EXIT_FAILURE;
+usage:
+    fprintf(stderr, "usage: %s [PSYNC [DIRECTORY]]\n", argv[0]);
+    return EXIT_FAILURE;
+}
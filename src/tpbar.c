@@ -1,4 +1,4 @@
-/* tpbar.c - Last modified: 22-Mar-2026 (kobayasy)
+/* tpbar.c - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2023-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -47,6 +47,7 @@ void tpbar_init(TPBAR *tpbar) {
 #endif  /* #ifdef HAVE_TGETENT */
 
     tpbar->up = NULL;
+    tpbar->ce = NULL;
     tpbar->co = -1;
     tpbar->bar = NULL;
 #ifdef HAVE_TGETENT
@@ -55,6 +56,7 @@ void tpbar_init(TPBAR *tpbar) {
         goto error;
     s = tpbar->buffer;
     tpbar->up = tgetstr("up", &s);
+    tpbar->ce = tgetstr("ce", &s);
     tpbar->co = tgetnum("co");
     mr = tgetstr("mr", &s);
     me = tgetstr("me", &s);
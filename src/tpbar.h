@@ -1,4 +1,4 @@
-/* tpbar.h - Last modified: 22-Mar-2026 (kobayasy)
+/* tpbar.h - Last modified: 19-Oct-2026 (kobayasy)
  *
  * Copyright (C) 2023-2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
  *
@@ -31,6 +31,7 @@
 
 typedef struct {
     char *up;
+    char *ce;
     int co;
     char *bar;
     struct {
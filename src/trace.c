@@ -0,0 +1,277 @@
+/* trace.c - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif  /* #ifdef HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_BUFFER (64*1024)     /* [byte] events of a thread written out at once */
+#define EVENT_MAX (PATH_MAX+1024)  /* [byte] one event, longer names cut to fit */
+
+/* Events of a thread, formatted as they come and written out when full
+ * or at the end of the thread, so threads only meet on the mutex then. */
+typedef struct s_tbuf {
+    struct s_tbuf *next, *prev;
+    unsigned int tid;
+    size_t length;
+    char buffer[TRACE_BUFFER];
+} TBUF;
+
+static struct {
+    int fd;
+    pid_t pid;
+    unsigned int tids;
+    bool key;
+    pthread_key_t tbuf;
+    pthread_mutex_t mutex;
+    TBUF tbufs;
+} priv = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+bool trace_on = false;
+
+int64_t trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Not write_size(), which is traced itself. */
+static int write_all(const char *buf, size_t count) {
+    int status = -1;
+    ssize_t n;
+
+    while (count > 0) {
+        n = write(priv.fd, buf, count);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+        buf += n, count -= n;
+    }
+    status = 0;
+error:
+    return status;
+}
+
+static void flush_tbuf(TBUF *tbuf) {
+    pthread_mutex_lock(&priv.mutex);
+    if (priv.fd != -1)
+        write_all(tbuf->buffer, tbuf->length);
+    tbuf->length = 0;
+    pthread_mutex_unlock(&priv.mutex);
+}
+
+static void free_tbuf(void *data) {
+    TBUF *tbuf = data;
+
+    flush_tbuf(tbuf);
+    pthread_mutex_lock(&priv.mutex);
+    LIST_DELETE(tbuf);
+    pthread_mutex_unlock(&priv.mutex);
+    free(tbuf);
+}
+
+static TBUF *get_tbuf(void) {
+    TBUF *tbuf;
+
+    tbuf = pthread_getspecific(priv.tbuf);
+    if (!tbuf) {
+        tbuf = malloc(sizeof(*tbuf));
+        if (!tbuf)
+            goto error;
+        tbuf->length = 0;
+        pthread_mutex_lock(&priv.mutex);
+        tbuf->tid = ++priv.tids;
+        LIST_INSERT_PREV(tbuf, &priv.tbufs);
+        pthread_mutex_unlock(&priv.mutex);
+        pthread_setspecific(priv.tbuf, tbuf);
+    }
+error:
+    return tbuf;
+}
+
+static void add_event(const char *event, size_t length) {
+    TBUF *tbuf;
+
+    tbuf = get_tbuf();
+    if (!tbuf)
+        return;
+    if (tbuf->length + length > sizeof(tbuf->buffer))
+        flush_tbuf(tbuf);
+    memcpy(tbuf->buffer + tbuf->length, event, length);
+    tbuf->length += length;
+}
+
+/* Quote s as a JSON string into buffer, cut short to fit in size. */
+static size_t quote(char *buffer, size_t size, const char *s) {
+    char *p = buffer, *e = buffer + size - 1;
+
+    *p++ = '"';
+    for (; *s && e - p > 6; ++s)
+        if (*s == '"' || *s == '\\')
+            *p++ = '\\', *p++ = *s;
+        else if ((unsigned char)*s < 0x20)
+            p += sprintf(p, "\\u%04x", (unsigned char)*s);
+        else
+            *p++ = *s;
+    *p++ = '"';
+    *p = 0;
+    return p - buffer;
+}
+
+int trace_open(int fd) {
+    int status = INT_MIN;
+    char event[256];
+
+    if (!priv.key) {
+        if (pthread_key_create(&priv.tbuf, free_tbuf) != 0) {
+            status = -1;
+            goto error;
+        }
+        priv.tbufs.next = &priv.tbufs, priv.tbufs.prev = &priv.tbufs;
+        priv.key = true;
+    }
+    priv.fd = fd;
+    priv.pid = getpid();
+    snprintf(event, sizeof(event), "{\"traceEvents\":[\n"
+                                   "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"psync\"}}",
+             (int)priv.pid );
+    if (write_all(event, strlen(event))) {
+        priv.fd = -1;
+        status = -1;
+        goto error;
+    }
+    trace_on = true;
+    status = 0;
+error:
+    return status;
+}
+
+int trace_close(void) {
+    int status = INT_MIN;
+    TBUF *tbuf;
+
+    if (!trace_on) {
+        status = 0;
+        goto error;
+    }
+    trace_on = false;
+    pthread_mutex_lock(&priv.mutex);
+    for (tbuf = priv.tbufs.next; tbuf != &priv.tbufs; tbuf = tbuf->next) {
+        write_all(tbuf->buffer, tbuf->length);
+        tbuf->length = 0;
+    }
+    status = write_all("\n]}\n", 4);
+    priv.fd = -1;
+    pthread_mutex_unlock(&priv.mutex);
+    tbuf = pthread_getspecific(priv.tbuf);
+    if (tbuf) {
+        pthread_setspecific(priv.tbuf, NULL);
+        free_tbuf(tbuf);
+    }
+error:
+    return status;
+}
+
+void trace_thread(const char *name) {
+    TBUF *tbuf;
+    char event[EVENT_MAX];
+    size_t length;
+
+    if (!trace_on)
+        return;
+    tbuf = get_tbuf();
+    if (!tbuf)
+        return;
+    length = snprintf(event, sizeof(event), ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":",
+                      (int)priv.pid, tbuf->tid );
+    length += quote(event + length, sizeof(event) - length - 2, name);
+    length += sprintf(event + length, "}}");
+    add_event(event, length);
+}
+
+static void add_span(int64_t begin, int64_t end, const char *cat, const char *name,
+                     const char *file, intmax_t size ) {
+    TBUF *tbuf;
+    char event[EVENT_MAX];
+    size_t length;
+
+    tbuf = get_tbuf();
+    if (!tbuf)
+        return;
+    length = snprintf(event, sizeof(event), ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":", cat);
+    length += quote(event + length, 256, name);
+    length += sprintf(event + length, ",\"pid\":%d,\"tid\":%u,\"ts\":%jd.%03d,\"dur\":%jd.%03d,\"args\":{",
+                      (int)priv.pid, tbuf->tid,
+                      (intmax_t)(begin / 1000), (int)(begin % 1000),
+                      (intmax_t)((end - begin) / 1000), (int)((end - begin) % 1000) );
+    if (file) {
+        length += sprintf(event + length, "\"file\":");
+        length += quote(event + length, sizeof(event) - length - 64, file);
+        if (size >= 0)
+            event[length++] = ',';
+    }
+    if (size >= 0)
+        length += sprintf(event + length, "\"size\":%jd", size);
+    length += sprintf(event + length, "}}");
+    add_event(event, length);
+}
+
+void trace_span(int64_t begin, const char *cat, const char *name,
+                const char *file, intmax_t size ) {
+    if (!begin || !trace_on)
+        return;
+    add_span(begin, trace_now(), cat, name, file, size);
+}
+
+/* A blocking call, traced when it waited at least TRACE_WAIT. */
+void trace_wait(int64_t begin, const char *name, intmax_t size) {
+    int64_t end;
+
+    if (!begin || !trace_on)
+        return;
+    end = trace_now();
+    if (end - begin >= (int64_t)TRACE_WAIT * 1000)
+        add_span(begin, end, "wait", name, NULL, size);
+}
@@ -0,0 +1,48 @@
+/* trace.h - Last modified: 19-Oct-2026 (kobayasy)
+ *
+ * Copyright (C) 2026 by Yuichi Kobayashi <kobayasy@kobayasy.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _INCLUDE_trace_h
+#define _INCLUDE_trace_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef TRACE_WAIT
+#define TRACE_WAIT 100  /* [usec] trace_wait() leaves out shorter waits */
+#endif  /* #ifndef TRACE_WAIT */
+
+extern bool trace_on;
+
+#define TRACE_BEGIN() (trace_on ? trace_now() : 0)
+
+extern int64_t trace_now(void);
+extern int trace_open(int fd);
+extern int trace_close(void);
+extern void trace_thread(const char *name);
+extern void trace_span(int64_t begin, const char *cat, const char *name,
+                       const char *file, intmax_t size );
+extern void trace_wait(int64_t begin, const char *name, intmax_t size);
+
+#endif  /* #ifndef _INCLUDE_trace_h */